@@ -0,0 +1,409 @@
+/* Background checkpoints of a model file image.
+ *
+ * A model (the network weights, the Q-table) is saved as a fixed header
+ * followed by the raw parameters, see save_neural_network() in template.c
+ * and save_qtable() in v1.c. A Checkpointer holds two buffers with that
+ * image. checkpoint_take() is called by the training thread between two
+ * games: it copies the parameters into the buffer the writer thread is not
+ * using and hands it over, which costs one memcpy and two uncontended
+ * mutex operations, never I/O. The writer thread then compresses the
+ * image, writes it to "path.tmp", fsyncs it, renames it over 'path' and
+ * fsyncs the directory, so that after a crash 'path' is always the last
+ * complete checkpoint (or the one before), never a torn file.
+ *
+ * If a new snapshot is taken while the previous one is still waiting to
+ * be written, the old one is replaced by the newer: the trainer never
+ * waits for the disk, at worst a checkpoint is skipped.
+ *
+ * Big, sparsely updated parameters (a Q-table where only the states of
+ * the games played change) don't need a full copy: after
+ * checkpoint_track() the trainer reports every chunk it modifies with
+ * checkpoint_dirty(), and each buffer only copies the chunks modified
+ * since it was filled last.
+ *
+ * File format, integers little endian:
+ *
+ *   8 bytes  CHECKPOINT_MAGIC
+ *   4 bytes  size of the image
+ *   4 bytes  size of the compressed payload
+ *   4 bytes  gamelog_checksum() of the image
+ *   payload
+ *
+ * The compression only removes runs of zero 32 bit words, which is all a
+ * Q-table needs (most states are never visited) and costs one pass. The
+ * payload is a sequence of tokens: a word with the high bit set is a run
+ * of that many (without the bit) zero words, otherwise it is the number
+ * of literal words that follow. The image bytes after the last whole
+ * word, if any, are appended as they are.
+ *
+ * checkpoint_fopen() opens either a checkpoint or a plain model file, so
+ * the usual loaders read both.
+ *
+ * Header only, like gamelog.h. */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <pthread.h>
+#include <libgen.h>
+#include "gamelog.h"
+
+#define CHECKPOINT_MAGIC "TTTCKPT1"
+#define CHECKPOINT_HEADER_SIZE 20
+#define CHECKPOINT_ZERO_RUN 0x80000000u
+
+typedef struct {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *path;
+    size_t header_len;              // Fixed part of the image.
+    size_t size;                    // Whole image.
+    unsigned char *image[2];
+    unsigned char *packed;          // Writer scratch.
+    int pending;                    // Buffer waiting for the writer, or -1.
+    int writing;                    // Buffer being written, or -1.
+    size_t chunk;                   // Dirty tracking granularity, or 0.
+    uint64_t *dirty[2];             // Per buffer, chunks to copy.
+    int stop;
+    int error;                      // errno of the last failed write.
+    uint64_t taken, written;        // Stats.
+    uint64_t take_ns, max_take_ns;  // CPU time of checkpoint_take().
+} Checkpointer;
+
+/* Compress 'size' bytes of 'src' into 'dst', that must have room for
+ * checkpoint_packed_bound(size) bytes. Returns the compressed size. */
+static inline size_t checkpoint_packed_bound(size_t size) {
+    return size + size / 2 + 16;
+}
+
+static inline size_t checkpoint_pack(const unsigned char *src, size_t size,
+                                     unsigned char *dst)
+{
+    size_t words = size / 4, i = 0, out = 0;
+    while (i < words) {
+        size_t start = i;
+        while (i < words && gamelog_get_u32(src + i*4) == 0) i++;
+        if (i - start >= 2 || (i == words && i > start)) {
+            gamelog_put_u32(dst + out, CHECKPOINT_ZERO_RUN | (i - start));
+            out += 4;
+            continue;
+        }
+        /* Literals up to the next run of at least 2 zero words. */
+        i = start;
+        while (i < words && !(gamelog_get_u32(src + i*4) == 0 && i+1 < words &&
+                              gamelog_get_u32(src + (i+1)*4) == 0))
+            i++;
+        gamelog_put_u32(dst + out, i - start);
+        memcpy(dst + out + 4, src + start*4, (i - start) * 4);
+        out += 4 + (i - start) * 4;
+    }
+    memcpy(dst + out, src + words*4, size % 4);
+    return out + size % 4;
+}
+
+/* Inverse of checkpoint_pack(). Returns -1 if 'src' is not valid. */
+static inline int checkpoint_unpack(const unsigned char *src, size_t len,
+                                    unsigned char *dst, size_t size)
+{
+    size_t words = size / 4, w = 0, in = 0;
+    while (w < words) {
+        if (in + 4 > len) return -1;
+        uint32_t token = gamelog_get_u32(src + in);
+        size_t n = token & ~CHECKPOINT_ZERO_RUN;
+        in += 4;
+        if (n > words - w) return -1;
+        if (token & CHECKPOINT_ZERO_RUN) {
+            memset(dst + w*4, 0, n*4);
+        } else {
+            if (in + n*4 > len) return -1;
+            memcpy(dst + w*4, src + in, n*4);
+            in += n*4;
+        }
+        w += n;
+    }
+    if (len - in != size % 4) return -1;
+    memcpy(dst + words*4, src + in, size % 4);
+    return 0;
+}
+
+/* Write 'buf' to the file descriptor, retrying short writes. */
+static inline int checkpoint_write_all(int fd, const unsigned char *buf,
+                                       size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Compress 'image' and atomically replace ck->path with it. */
+static inline int checkpoint_write(Checkpointer *ck, const unsigned char *image) {
+    unsigned char *p = ck->packed;
+    size_t len = checkpoint_pack(image, ck->size, p + CHECKPOINT_HEADER_SIZE);
+    memcpy(p, CHECKPOINT_MAGIC, 8);
+    gamelog_put_u32(p + 8, ck->size);
+    gamelog_put_u32(p + 12, len);
+    gamelog_put_u32(p + 16, gamelog_checksum(image, ck->size));
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ck->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return -1;
+    if (checkpoint_write_all(fd, p, CHECKPOINT_HEADER_SIZE + len) == -1 ||
+        fsync(fd) == -1)
+    {
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    if (close(fd) == -1 || rename(tmp, ck->path) == -1) return -1;
+
+    /* Make the rename itself durable. */
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", ck->path);
+    fd = open(dirname(dir), O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    return 0;
+}
+
+static inline void *checkpoint_main(void *arg) {
+    Checkpointer *ck = arg;
+
+    pthread_mutex_lock(&ck->lock);
+    while (1) {
+        while (ck->pending == -1 && !ck->stop)
+            pthread_cond_wait(&ck->cond, &ck->lock);
+        if (ck->pending == -1) break;   // Stopped, nothing left to write.
+        ck->writing = ck->pending;
+        ck->pending = -1;
+        pthread_mutex_unlock(&ck->lock);
+
+        int err = checkpoint_write(ck, ck->image[ck->writing]) == -1 ? errno : 0;
+
+        pthread_mutex_lock(&ck->lock);
+        ck->writing = -1;
+        if (err) ck->error = err;
+        else ck->written++;
+    }
+    pthread_mutex_unlock(&ck->lock);
+    return NULL;
+}
+
+/* Free the memory of 'ck', the writer thread must not be running. */
+static inline void checkpoint_free(Checkpointer *ck) {
+    free(ck->image[0]);
+    free(ck->image[1]);
+    free(ck->packed);
+    free(ck->dirty[0]);
+    free(ck->dirty[1]);
+    free(ck->path);
+    free(ck);
+}
+
+/* Create a checkpointer writing to 'path' an image made of 'header'
+ * ('header_len' bytes) followed by 'data_len' bytes of parameters, and
+ * start its writer thread. Returns NULL on error, with errno set. */
+static inline Checkpointer *checkpoint_create(const char *path,
+                                              const void *header,
+                                              size_t header_len,
+                                              size_t data_len)
+{
+    Checkpointer *ck = calloc(1, sizeof(*ck));
+    if (ck == NULL) return NULL;
+    ck->path = strdup(path);
+    ck->header_len = header_len;
+    ck->size = header_len + data_len;
+    for (int b = 0; b < 2; b++) ck->image[b] = malloc(ck->size);
+    ck->packed = malloc(CHECKPOINT_HEADER_SIZE + checkpoint_packed_bound(ck->size));
+    if (!ck->path || !ck->image[0] || !ck->image[1] || !ck->packed) {
+        checkpoint_free(ck);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (int b = 0; b < 2; b++) memcpy(ck->image[b], header, header_len);
+    ck->pending = ck->writing = -1;
+    pthread_mutex_init(&ck->lock, NULL);
+    pthread_cond_init(&ck->cond, NULL);
+    int err = pthread_create(&ck->tid, NULL, checkpoint_main, ck);
+    if (err) {
+        pthread_mutex_destroy(&ck->lock);
+        pthread_cond_destroy(&ck->cond);
+        checkpoint_free(ck);
+        errno = err;
+        return NULL;
+    }
+    return ck;
+}
+
+/* Track the modified chunks of 'chunk' bytes, see checkpoint_dirty().
+ * Returns -1 with errno set if out of memory. */
+static inline int checkpoint_track(Checkpointer *ck, size_t chunk) {
+    size_t chunks = (ck->size - ck->header_len + chunk - 1) / chunk;
+    size_t words = (chunks + 63) / 64;
+    ck->chunk = chunk;
+    for (int b = 0; b < 2; b++) {
+        ck->dirty[b] = malloc(words * sizeof(uint64_t));
+        if (ck->dirty[b] == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(ck->dirty[b], 0xff, words * sizeof(uint64_t));  // Copy all.
+    }
+    return 0;
+}
+
+/* The parameters at byte 'offset' were modified. Only the training
+ * thread touches the dirty maps, so this is two plain stores. */
+static inline void checkpoint_dirty(Checkpointer *ck, size_t offset) {
+    size_t c = offset / ck->chunk;
+    ck->dirty[0][c / 64] |= 1ULL << (c % 64);
+    ck->dirty[1][c / 64] |= 1ULL << (c % 64);
+}
+
+/* Copy 'data' into buffer 'b': everything, or the dirty chunks. */
+static inline void checkpoint_copy(Checkpointer *ck, int b, const void *data) {
+    unsigned char *dst = ck->image[b] + ck->header_len;
+    size_t len = ck->size - ck->header_len;
+    if (ck->chunk == 0) {
+        memcpy(dst, data, len);
+        return;
+    }
+    size_t chunks = (len + ck->chunk - 1) / ck->chunk;
+    for (size_t w = 0; w < (chunks + 63) / 64; w++) {
+        uint64_t bits = ck->dirty[b][w];
+        ck->dirty[b][w] = 0;
+        while (bits) {
+            size_t off = (w * 64 + __builtin_ctzll(bits)) * ck->chunk;
+            bits &= bits - 1;
+            if (off >= len) break;
+            size_t n = len - off < ck->chunk ? len - off : ck->chunk;
+            memcpy(dst + off, (const unsigned char *)data + off, n);
+        }
+    }
+}
+
+/* Snapshot 'data' (data_len bytes, see checkpoint_create()) and queue it
+ * for writing. Called by the training thread, never blocks on I/O. The
+ * time accounted is the CPU time of the calling thread: wall time would
+ * also count the writer thread preempting it on a busy machine. */
+static inline void checkpoint_take(Checkpointer *ck, const void *data) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+
+    /* Copy into the buffer the writer is not writing. If it held a
+     * snapshot not written yet, take it back first: ours is newer. */
+    pthread_mutex_lock(&ck->lock);
+    int b = ck->writing == 0 ? 1 : 0;
+    ck->pending = -1;
+    pthread_mutex_unlock(&ck->lock);
+
+    checkpoint_copy(ck, b, data);
+
+    pthread_mutex_lock(&ck->lock);
+    ck->pending = b;
+    ck->taken++;
+    pthread_cond_signal(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    uint64_t ns = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 +
+                  t1.tv_nsec - t0.tv_nsec;
+    ck->take_ns += ns;
+    if (ns > ck->max_take_ns) ck->max_take_ns = ns;
+}
+
+/* Write the last snapshot, if still pending, stop the writer thread and
+ * free everything. Prints the statistics. Returns -1 if any write failed,
+ * with errno set. */
+static inline int checkpoint_close(Checkpointer *ck) {
+    pthread_mutex_lock(&ck->lock);
+    ck->stop = 1;
+    pthread_cond_signal(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+    pthread_join(ck->tid, NULL);
+
+    if (ck->taken) {
+        printf("Checkpoints: %llu taken, %llu written to %s, "
+               "%.1f us average and %.1f us max CPU per snapshot\n",
+               (unsigned long long)ck->taken,
+               (unsigned long long)ck->written, ck->path,
+               ck->take_ns / 1000.0 / ck->taken, ck->max_take_ns / 1000.0);
+    }
+    int error = ck->error;
+    pthread_mutex_destroy(&ck->lock);
+    pthread_cond_destroy(&ck->cond);
+    checkpoint_free(ck);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Open a model file for reading: a checkpoint is uncompressed in memory
+ * and returned as a stream of the original image, any other file is
+ * returned as it is. Returns NULL on error, with errno set. */
+static inline FILE *checkpoint_fopen(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return NULL;
+
+    unsigned char h[CHECKPOINT_HEADER_SIZE];
+    if (fread(h, CHECKPOINT_HEADER_SIZE, 1, fp) != 1 ||
+        memcmp(h, CHECKPOINT_MAGIC, 8) != 0)
+    {
+        rewind(fp);
+        return fp;
+    }
+
+    /* The sizes come from the file: a payload longer than the file is a
+     * truncated or corrupted checkpoint, don't even allocate it. */
+    size_t size = gamelog_get_u32(h + 8), len = gamelog_get_u32(h + 12);
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1 ||
+        len > (uint64_t)st.st_size - CHECKPOINT_HEADER_SIZE)
+    {
+        fclose(fp);
+        errno = EINVAL;
+        return NULL;
+    }
+    unsigned char *packed = malloc(len + 1), *image = malloc(size + 1);
+    if (packed == NULL || image == NULL) {
+        free(packed);
+        free(image);
+        fclose(fp);
+        errno = ENOMEM;
+        return NULL;
+    }
+    FILE *mem = NULL;
+    if (fread(packed, 1, len, fp) == len &&
+        checkpoint_unpack(packed, len, image, size) == 0 &&
+        gamelog_checksum(image, size) == gamelog_get_u32(h + 16))
+    {
+        mem = fmemopen(NULL, size + 1, "w+b");
+        if (mem && fwrite(image, size, 1, mem) == 1) {
+            rewind(mem);
+        } else if (mem) {
+            fclose(mem);
+            mem = NULL;
+        }
+    }
+    free(packed);
+    free(image);
+    fclose(fp);
+    if (mem == NULL) errno = EINVAL;
+    return mem;
+}
+
+#endif
@@ -0,0 +1,244 @@
+/* Game environments behind a common interface.
+ *
+ * A GameEnv is a table of functions over an EnvState: reset, legal moves
+ * mask, apply and undo a move, "did the last move win", network input
+ * encoding, a unique key for tabular learners, and printing. Trainers
+ * written against it work for any two player, alternate moves game whose
+ * position fits in an EnvState; env_by_name() lists the ones we have:
+ *
+ * - "tictactoe": the usual 3x3 board, 9 actions, 18 inputs. Its key is
+ *   the base 3 number of the board (empty 0, X 1, O 2), the same as
+ *   board_hash() in template.c and v1.c, so Q-tables stay compatible.
+ *
+ * - "connect4": 7 columns of 6, 7 actions (the column), 84 inputs, about
+ *   4.5*10^12 positions.
+ *
+ * Both use the same bitboard representation: 'stones' has the stones of
+ * the side to move and 'mask' all the stones. Playing a move is then
+ * stones ^= mask (the other side is now to move) followed by setting the
+ * new bit in 'mask', and undoing it is the reverse, so neither needs any
+ * history. The first player is always 'X' and moves on even plies.
+ *
+ * Header only, like gamelog.h and envpool.h. */
+
+#ifndef ENV_H
+#define ENV_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ENV_MAX_ACTIONS 16
+#define ENV_MAX_INPUTS 128
+
+typedef struct {
+    uint64_t stones;    // Stones of the side to move.
+    uint64_t mask;      // All the stones.
+    int ply;            // Moves played so far.
+} EnvState;
+
+typedef struct {
+    const char *name;
+    int num_actions;
+    int num_inputs;
+    int max_moves;                                  // Full board.
+    void (*reset)(EnvState *s);
+    uint64_t (*legal)(const EnvState *s);           // Bit 'a': action 'a'.
+    void (*apply)(EnvState *s, int action);         // Action must be legal.
+    void (*undo)(EnvState *s, int action);          // The last action only.
+    int (*won)(const EnvState *s);                  // By the last move?
+    void (*encode)(const EnvState *s, float *inputs);
+    uint64_t (*key)(const EnvState *s);             // Unique per position.
+    void (*print)(const EnvState *s);
+} GameEnv;
+
+/* Stones of the first player (X) and of the second (O). */
+static inline uint64_t env_x(const EnvState *s) {
+    return (s->ply & 1) ? s->stones ^ s->mask : s->stones;
+}
+
+static inline uint64_t env_o(const EnvState *s) {
+    return (s->ply & 1) ? s->stones : s->stones ^ s->mask;
+}
+
+/* Returns 1 if the game is over after the last move, setting 'winner' to
+ * 'X', 'O' or 'T'. */
+static inline int env_terminal(const GameEnv *env, const EnvState *s,
+                               char *winner)
+{
+    if (s->ply && env->won(s)) {
+        *winner = (s->ply & 1) ? 'X' : 'O';
+        return 1;
+    }
+    if (s->ply == env->max_moves || env->legal(s) == 0) {
+        *winner = 'T';
+        return 1;
+    }
+    return 0;
+}
+
+/* Uniformly random legal action, 'r' is any random number. */
+static inline int env_random_move(const GameEnv *env, const EnvState *s,
+                                  unsigned r)
+{
+    uint64_t legal = env->legal(s);
+    int k = r % __builtin_popcountll(legal);
+    while (k--) legal &= legal - 1;     // Drop the k lowest set bits.
+    return __builtin_ctzll(legal);
+}
+
+/* Shared by both games: play and take back 'bit' for the side to move. */
+static inline void env_play_bit(EnvState *s, uint64_t bit) {
+    s->stones ^= s->mask;
+    s->mask |= bit;
+    s->ply++;
+}
+
+static inline void env_undo_bit(EnvState *s, uint64_t bit) {
+    s->mask ^= bit;
+    s->stones ^= s->mask;
+    s->ply--;
+}
+
+static inline void env_reset(EnvState *s) {
+    s->stones = s->mask = 0;
+    s->ply = 0;
+}
+
+/* ------------------------------ Tic tac toe ------------------------------ */
+
+static const uint16_t ttt_lines[8] = {
+    0x007, 0x038, 0x1c0,    // Rows.
+    0x049, 0x092, 0x124,    // Columns.
+    0x111, 0x054            // Diagonals.
+};
+
+static inline uint64_t ttt_legal(const EnvState *s) {
+    return ~s->mask & 0x1ff;
+}
+
+static inline void ttt_apply(EnvState *s, int action) {
+    env_play_bit(s, 1ULL << action);
+}
+
+static inline void ttt_undo(EnvState *s, int action) {
+    env_undo_bit(s, 1ULL << action);
+}
+
+static inline int ttt_won(const EnvState *s) {
+    uint64_t last = s->stones ^ s->mask;    // Stones of who just moved.
+    for (int l = 0; l < 8; l++)
+        if ((last & ttt_lines[l]) == ttt_lines[l]) return 1;
+    return 0;
+}
+
+/* 2 inputs per tile, like board_to_inputs(): 00 empty, 10 X, 01 O. */
+static inline void ttt_encode(const EnvState *s, float *inputs) {
+    uint64_t x = env_x(s), o = env_o(s);
+    for (int k = 0; k < 9; k++) {
+        inputs[k*2] = (x >> k) & 1;
+        inputs[k*2+1] = (o >> k) & 1;
+    }
+}
+
+static inline uint64_t ttt_key(const EnvState *s) {
+    uint64_t x = env_x(s), o = env_o(s), h = 0;
+    for (int k = 0; k < 9; k++)
+        h = h * 3 + ((x >> k) & 1) + ((o >> k) & 1) * 2;
+    return h;
+}
+
+static inline void ttt_print(const EnvState *s) {
+    uint64_t x = env_x(s), o = env_o(s);
+    for (int k = 0; k < 9; k++) {
+        putchar((x >> k) & 1 ? 'X' : ((o >> k) & 1 ? 'O' : '.'));
+        putchar(k % 3 == 2 ? '\n' : '|');
+    }
+}
+
+static const GameEnv tictactoe_env = {
+    "tictactoe", 9, 18, 9, env_reset, ttt_legal, ttt_apply, ttt_undo,
+    ttt_won, ttt_encode, ttt_key, ttt_print
+};
+
+/* ------------------------------ Connect four -----------------------------
+ * Column 'c' uses bits c*7 .. c*7+5, bottom to top; bit c*7+6 is always
+ * empty, so that shifts in the win check don't wrap between columns. */
+
+#define C4_WIDTH 7
+#define C4_HEIGHT 6
+#define C4_BOTTOM 0x0040810204081ULL    // Bit 0 of every column.
+#define C4_COLUMN(c) (0x3fULL << ((c) * 7))
+
+static inline uint64_t c4_legal(const EnvState *s) {
+    uint64_t legal = 0;
+    for (int c = 0; c < C4_WIDTH; c++)
+        if (!(s->mask & (1ULL << (c*7 + C4_HEIGHT - 1)))) legal |= 1 << c;
+    return legal;
+}
+
+static inline void c4_apply(EnvState *s, int col) {
+    /* Adding the bottom bit carries to the lowest empty cell. */
+    uint64_t column = s->mask & C4_COLUMN(col);
+    env_play_bit(s, (column + (1ULL << (col*7))) & C4_COLUMN(col));
+}
+
+static inline void c4_undo(EnvState *s, int col) {
+    uint64_t column = s->mask & C4_COLUMN(col);
+    env_undo_bit(s, 1ULL << (63 - __builtin_clzll(column)));
+}
+
+static inline int c4_won(const EnvState *s) {
+    uint64_t p = s->stones ^ s->mask;
+    static const int dirs[4] = {1, 7, 6, 8};  // Vertical, horizontal, diagonals.
+    for (int d = 0; d < 4; d++) {
+        uint64_t m = p & (p >> dirs[d]);
+        if (m & (m >> (2 * dirs[d]))) return 1;
+    }
+    return 0;
+}
+
+static inline void c4_encode(const EnvState *s, float *inputs) {
+    uint64_t x = env_x(s), o = env_o(s);
+    for (int c = 0; c < C4_WIDTH; c++) {
+        for (int r = 0; r < C4_HEIGHT; r++) {
+            int bit = c*7 + r, k = c*C4_HEIGHT + r;
+            inputs[k*2] = (x >> bit) & 1;
+            inputs[k*2+1] = (o >> bit) & 1;
+        }
+    }
+}
+
+/* stones + mask sets, in every column, the bit above the top stone, so
+ * together with the side to move (the ply parity) it is unique. */
+static inline uint64_t c4_key(const EnvState *s) {
+    return s->stones + s->mask + C4_BOTTOM;
+}
+
+static inline void c4_print(const EnvState *s) {
+    uint64_t x = env_x(s), o = env_o(s);
+    for (int r = C4_HEIGHT - 1; r >= 0; r--) {
+        for (int c = 0; c < C4_WIDTH; c++) {
+            uint64_t bit = 1ULL << (c*7 + r);
+            putchar(x & bit ? 'X' : (o & bit ? 'O' : '.'));
+            putchar(c == C4_WIDTH - 1 ? '\n' : '|');
+        }
+    }
+    printf("0 1 2 3 4 5 6\n");
+}
+
+static const GameEnv connect4_env = {
+    "connect4", C4_WIDTH, C4_WIDTH * C4_HEIGHT * 2, C4_WIDTH * C4_HEIGHT,
+    env_reset, c4_legal, c4_apply, c4_undo, c4_won, c4_encode, c4_key,
+    c4_print
+};
+
+/* Look up an environment by name, NULL if there is no such game. */
+static inline const GameEnv *env_by_name(const char *name) {
+    static const GameEnv *envs[] = {&tictactoe_env, &connect4_env};
+    for (size_t i = 0; i < sizeof(envs)/sizeof(envs[0]); i++)
+        if (!strcmp(envs[i]->name, name)) return envs[i];
+    return NULL;
+}
+
+#endif
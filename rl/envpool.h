@@ -0,0 +1,165 @@
+/* Pool of tic tac toe environments stepped in lockstep.
+ *
+ * The pool holds N games in structure of arrays form: one array with the
+ * X bitboards, one with the O bitboards, one with the ply counters, and so
+ * forth, so that the per step work (apply N moves, check N boards for a
+ * win) is a handful of straight loops over small integers that the
+ * compiler turns into SIMD code. Bit 'k' of a bitboard is board position
+ * 'k', the same numbering used everywhere else (0-8, row major).
+ *
+ * Every call to envpool_step() plays exactly one move in every game.
+ * Games that end are reported in pool->finished[] and immediately reset,
+ * so after a few steps the games are at different plies: some have X to
+ * move and some O. envpool_gather() collects the indexes of the games
+ * with a given side to move and envpool_encode() turns them into a dense
+ * batch of network inputs, so a batched inference kernel always sees
+ * full batches of positions that actually need a move.
+ *
+ * Header only, like gamelog.h, since every program here is a single
+ * translation unit. */
+
+#ifndef ENVPOOL_H
+#define ENVPOOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENVPOOL_FULL_BOARD 0x1ff
+
+/* The 8 winning lines as bitboard masks. */
+static const uint16_t envpool_lines[8] = {
+    0x007, 0x038, 0x1c0,    // Rows.
+    0x049, 0x092, 0x124,    // Columns.
+    0x111, 0x054            // Diagonals.
+};
+
+/* A game that ended during the last step, reported before the reset. */
+typedef struct {
+    int env;                // Index of the game inside the pool.
+    char winner;            // 'X', 'O' or 'T'.
+    int num_moves;
+    int moves[9];           // Moves in play order, X first.
+} EnvPoolResult;
+
+typedef struct {
+    int n;                  // Number of games.
+    uint16_t *x;            // X bitboards.
+    uint16_t *o;            // O bitboards.
+    uint8_t *ply;           // Moves played so far: X moves on even plies.
+    uint64_t *history;      // Moves so far, one nibble per ply.
+    uint8_t *term;          // Scratch: 0 running, 1 win, 2 draw.
+    int num_finished;       // Games that ended in the last step.
+    EnvPoolResult *finished;
+} EnvPool;
+
+static inline EnvPool *envpool_create(int n) {
+    EnvPool *p = calloc(1, sizeof(*p));
+    p->n = n;
+    p->x = calloc(n, sizeof(uint16_t));
+    p->o = calloc(n, sizeof(uint16_t));
+    p->ply = calloc(n, sizeof(uint8_t));
+    p->history = calloc(n, sizeof(uint64_t));
+    p->term = calloc(n, sizeof(uint8_t));
+    p->finished = calloc(n, sizeof(EnvPoolResult));
+    return p;
+}
+
+static inline void envpool_free(EnvPool *p) {
+    free(p->x);
+    free(p->o);
+    free(p->ply);
+    free(p->history);
+    free(p->term);
+    free(p->finished);
+    free(p);
+}
+
+/* Bitboard of the empty (legal) squares of game 'i'. */
+static inline unsigned envpool_legal(const EnvPool *p, int i) {
+    return ~(p->x[i] | p->o[i]) & ENVPOOL_FULL_BOARD;
+}
+
+/* Store in 'idx' the games where 'side' (0 = X, 1 = O) is to move.
+ * Returns how many there are. */
+static inline int envpool_gather(const EnvPool *p, int side, int *idx) {
+    int count = 0;
+    for (int i = 0; i < p->n; i++)
+        if ((p->ply[i] & 1) == side) idx[count++] = i;
+    return count;
+}
+
+/* Encode the games listed in 'idx' as network inputs, 18 floats per game,
+ * using the same 2 inputs per tile coding of board_to_inputs():
+ * 00 empty, 10 X, 01 O. */
+static inline void envpool_encode(const EnvPool *p, const int *idx, int count,
+                                  float *inputs)
+{
+    for (int b = 0; b < count; b++) {
+        unsigned x = p->x[idx[b]], o = p->o[idx[b]];
+        float *in = inputs + b*18;
+        for (int k = 0; k < 9; k++) {
+            in[k*2] = (x >> k) & 1;
+            in[k*2+1] = (o >> k) & 1;
+        }
+    }
+}
+
+/* Pick a uniformly random empty square of game 'i'. 'r' is any random
+ * number, the caller decides where randomness comes from. */
+static inline int envpool_random_move(const EnvPool *p, int i, unsigned r) {
+    unsigned legal = envpool_legal(p, i);
+    int k = r % __builtin_popcount(legal);
+    while (k--) legal &= legal - 1;     // Drop the k lowest set bits.
+    return __builtin_ctz(legal);
+}
+
+/* Play moves[i] in every game i, for the side to move. Moves must be
+ * legal. Games that are over after the move are copied in p->finished
+ * (p->num_finished of them) and reset to the empty board. Returns the
+ * number of finished games. */
+static inline int envpool_step(EnvPool *p, const int *moves) {
+    int n = p->n;
+    uint16_t *restrict x = p->x, *restrict o = p->o;
+    uint8_t *restrict ply = p->ply, *restrict term = p->term;
+    uint64_t *restrict hist = p->history;
+
+    /* Apply the moves. Branch free so that it vectorizes. */
+    for (int i = 0; i < n; i++) {
+        uint16_t bit = 1 << moves[i];
+        uint16_t xmove = (ply[i] & 1) ? 0 : 0xffff;
+        x[i] |= bit & xmove;
+        o[i] |= bit & ~xmove;
+        hist[i] |= (uint64_t)moves[i] << (ply[i] * 4);
+        ply[i]++;
+    }
+
+    /* Terminal check: only the side that just moved can have won. Each
+     * board is tested against all the 8 lines without branches. */
+    for (int i = 0; i < n; i++) {
+        uint16_t m = (ply[i] & 1) ? x[i] : o[i];
+        uint8_t win = 0;
+        for (int l = 0; l < 8; l++)
+            win |= (m & envpool_lines[l]) == envpool_lines[l];
+        term[i] = win ? 1 : (ply[i] == 9 ? 2 : 0);
+    }
+
+    /* Collect and reset the finished games. This is the only scalar
+     * part, and it only touches games that actually ended. */
+    p->num_finished = 0;
+    for (int i = 0; i < n; i++) {
+        if (!term[i]) continue;
+        EnvPoolResult *res = &p->finished[p->num_finished++];
+        res->env = i;
+        res->num_moves = ply[i];
+        for (int k = 0; k < ply[i]; k++)
+            res->moves[k] = (hist[i] >> (k*4)) & 0xf;
+        res->winner = term[i] == 2 ? 'T' : ((ply[i] & 1) ? 'X' : 'O');
+        x[i] = o[i] = 0;
+        ply[i] = 0;
+        hist[i] = 0;
+    }
+    return p->num_finished;
+}
+
+#endif
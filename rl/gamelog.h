@@ -0,0 +1,469 @@
+/* Compact binary game log.
+ *
+ * Every game is packed into GAMELOG_RECORD_SIZE (5) bytes: nine 4 bit
+ * move nibbles followed by a 4 bit result code. Moves are the board
+ * positions 0-8 in the order they were played, X always moves first, and
+ * unused slots are set to GAMELOG_NO_MOVE, so the number of moves is
+ * implicit in the record.
+ *
+ *   byte 0: move 0 (low nibble), move 1 (high nibble)
+ *   byte 1: move 2, move 3
+ *   byte 2: move 4, move 5
+ *   byte 3: move 6, move 7
+ *   byte 4: move 8, result (GAMELOG_RESULT_*)
+ *
+ * The file starts with a 16 bytes header, followed by blocks. Each block
+ * has its own 16 bytes header (magic, record count, checksum) and up to
+ * GAMELOG_BLOCK_RECORDS records. All the integers are little endian.
+ * Writers only ever append whole blocks, so a log can be extended by
+ * later runs, and a process killed mid-write leaves at most a truncated
+ * tail block that the reader ignores.
+ *
+ * The writer is buffered: records are accumulated in memory and written
+ * with a single write(2) per block. The reader maps the file and hands
+ * out pointers to records inside the mapping, so iterating even billions
+ * of records costs no copies and no allocations besides the block index.
+ *
+ * This file is header only on purpose: every program in this directory
+ * is a single translation unit, and both the neural network trainer and
+ * the Q-learning trainer include it. */
+
+#ifndef GAMELOG_H
+#define GAMELOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define GAMELOG_MAGIC "TTTGLOG"         // 7 chars + version byte.
+#define GAMELOG_VERSION 1
+#define GAMELOG_FILE_HEADER_SIZE 16
+#define GAMELOG_BLOCK_MAGIC 0x4b4c4247  // "GBLK" little endian.
+#define GAMELOG_BLOCK_HEADER_SIZE 16
+#define GAMELOG_BLOCK_RECORDS 4096
+#define GAMELOG_RECORD_SIZE 5
+#define GAMELOG_NO_MOVE 0xF
+
+#define GAMELOG_FLAG_CHECKSUM (1<<0)    // Blocks carry a FNV-1a checksum.
+
+#define GAMELOG_RESULT_NONE 0
+#define GAMELOG_RESULT_X 1
+#define GAMELOG_RESULT_O 2
+#define GAMELOG_RESULT_TIE 3
+
+/* ============================ Low level helpers =========================== */
+
+static inline void gamelog_put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static inline uint32_t gamelog_get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* 32 bit FNV-1a. Not a CRC, but it is one multiply per byte and catches
+ * the torn writes and bit rot we care about here. */
+static inline uint32_t gamelog_checksum(const unsigned char *p, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Convert between the 'X' / 'O' / 'T' winner symbols used by the
+ * programs and the 4 bit result code stored in the records. */
+static inline int gamelog_result_code(char winner) {
+    switch(winner) {
+    case 'X': return GAMELOG_RESULT_X;
+    case 'O': return GAMELOG_RESULT_O;
+    case 'T': return GAMELOG_RESULT_TIE;
+    default: return GAMELOG_RESULT_NONE;
+    }
+}
+
+static inline char gamelog_result_symbol(int code) {
+    switch(code) {
+    case GAMELOG_RESULT_X: return 'X';
+    case GAMELOG_RESULT_O: return 'O';
+    case GAMELOG_RESULT_TIE: return 'T';
+    default: return '?';
+    }
+}
+
+/* Pack a game into 'rec', that must have room for GAMELOG_RECORD_SIZE
+ * bytes. Returns -1 if the game can't be represented. */
+static inline int gamelog_encode(unsigned char *rec, const int *moves,
+                                 int num_moves, char winner)
+{
+    unsigned char nib[10];
+
+    if (num_moves < 0 || num_moves > 9) return -1;
+    for (int i = 0; i < 9; i++) {
+        if (i < num_moves) {
+            if (moves[i] < 0 || moves[i] > 8) return -1;
+            nib[i] = moves[i];
+        } else {
+            nib[i] = GAMELOG_NO_MOVE;
+        }
+    }
+    nib[9] = gamelog_result_code(winner);
+    for (int i = 0; i < GAMELOG_RECORD_SIZE; i++)
+        rec[i] = nib[i*2] | (nib[i*2+1] << 4);
+    return 0;
+}
+
+/* Unpack a record into 'moves' (room for 9 entries) and 'winner'.
+ * Returns the number of moves, or -1 with 'winner' set to '?' if the
+ * record is invalid: a move above 8 or played twice. Without checksums
+ * nothing else catches a corrupted record, and the moves are used as
+ * indexes by the readers. */
+static inline int gamelog_decode(const unsigned char *rec, int *moves,
+                                 char *winner)
+{
+    int num_moves = 0;
+    unsigned seen = 0;
+    for (int i = 0; i < 9; i++) {
+        int m = (rec[i>>1] >> ((i&1)*4)) & 0xf;
+        if (m == GAMELOG_NO_MOVE) break;
+        if (m > 8 || seen & (1u << m)) {
+            *winner = '?';
+            return -1;
+        }
+        seen |= 1u << m;
+        moves[num_moves++] = m;
+    }
+    *winner = gamelog_result_symbol(rec[4] >> 4);
+    return num_moves;
+}
+
+/* Write 'len' bytes handling short writes and EINTR. */
+static inline int gamelog_write_all(int fd, const unsigned char *p, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* ================================= Writer ================================= */
+
+typedef struct {
+    int fd;
+    uint32_t flags;
+    uint32_t count;         // Records buffered in the current block.
+    uint64_t written;       // Records appended since gamelog_create().
+    unsigned char buf[GAMELOG_BLOCK_HEADER_SIZE +
+                      GAMELOG_BLOCK_RECORDS * GAMELOG_RECORD_SIZE];
+} GameLogWriter;
+
+/* Open 'path' for appending, creating it if needed. When the file already
+ * exists its header is validated and its flags win over 'flags', so that
+ * all the blocks of a log agree on the checksum setting.
+ * Returns NULL on error, with errno set. */
+static inline GameLogWriter *gamelog_create(const char *path, uint32_t flags) {
+    int fd = open(path, O_RDWR|O_CREAT|O_APPEND, 0644);
+    if (fd == -1) return NULL;
+
+    unsigned char hdr[GAMELOG_FILE_HEADER_SIZE];
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) goto err;
+
+    if (sb.st_size == 0) {
+        memset(hdr, 0, sizeof(hdr));
+        memcpy(hdr, GAMELOG_MAGIC, 7);
+        hdr[7] = GAMELOG_VERSION;
+        gamelog_put_u32(hdr+8, flags);
+        if (gamelog_write_all(fd, hdr, sizeof(hdr)) == -1) goto err;
+    } else {
+        if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            memcmp(hdr, GAMELOG_MAGIC, 7) != 0 ||
+            hdr[7] != GAMELOG_VERSION)
+        {
+            errno = EINVAL;
+            goto err;
+        }
+        flags = gamelog_get_u32(hdr+8);
+
+        /* Walk the block headers to find where valid data ends: if a
+         * previous run died mid-block, cut the torn tail, otherwise the
+         * blocks we append would be unreachable for the reader. */
+        off_t off = GAMELOG_FILE_HEADER_SIZE;
+        unsigned char bh[GAMELOG_BLOCK_HEADER_SIZE];
+        while (off + GAMELOG_BLOCK_HEADER_SIZE <= sb.st_size &&
+               pread(fd, bh, sizeof(bh), off) == sizeof(bh) &&
+               gamelog_get_u32(bh) == GAMELOG_BLOCK_MAGIC)
+        {
+            uint32_t count = gamelog_get_u32(bh+4);
+            off_t next = off + GAMELOG_BLOCK_HEADER_SIZE +
+                         (off_t)count * GAMELOG_RECORD_SIZE;
+            if (count == 0 || count > GAMELOG_BLOCK_RECORDS ||
+                next > sb.st_size) break;
+            off = next;
+        }
+        if (off != sb.st_size && ftruncate(fd, off) == -1) goto err;
+    }
+
+    GameLogWriter *w = malloc(sizeof(*w));
+    if (w == NULL) goto err;
+    w->fd = fd;
+    w->flags = flags;
+    w->count = 0;
+    w->written = 0;
+    return w;
+
+err:
+    {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return NULL;
+}
+
+/* Write the buffered records, if any, as a new block. */
+static inline int gamelog_flush(GameLogWriter *w) {
+    if (w->count == 0) return 0;
+
+    size_t payload = (size_t)w->count * GAMELOG_RECORD_SIZE;
+    unsigned char *rec = w->buf + GAMELOG_BLOCK_HEADER_SIZE;
+    uint32_t sum = (w->flags & GAMELOG_FLAG_CHECKSUM) ?
+                   gamelog_checksum(rec, payload) : 0;
+
+    gamelog_put_u32(w->buf, GAMELOG_BLOCK_MAGIC);
+    gamelog_put_u32(w->buf+4, w->count);
+    gamelog_put_u32(w->buf+8, sum);
+    gamelog_put_u32(w->buf+12, 0);
+    if (gamelog_write_all(w->fd, w->buf,
+                          GAMELOG_BLOCK_HEADER_SIZE + payload) == -1)
+        return -1;
+    w->count = 0;
+    return 0;
+}
+
+/* Append a game. The record is only buffered: it reaches the file when
+ * the block fills up, or on gamelog_flush() / gamelog_close(). */
+static inline int gamelog_append(GameLogWriter *w, const int *moves,
+                                 int num_moves, char winner)
+{
+    unsigned char *rec = w->buf + GAMELOG_BLOCK_HEADER_SIZE +
+                         (size_t)w->count * GAMELOG_RECORD_SIZE;
+    if (gamelog_encode(rec, moves, num_moves, winner) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    w->written++;
+    if (++w->count == GAMELOG_BLOCK_RECORDS) return gamelog_flush(w);
+    return 0;
+}
+
+/* Flush pending records and release the writer. */
+static inline int gamelog_close(GameLogWriter *w) {
+    int retval = gamelog_flush(w);
+    if (close(w->fd) == -1) retval = -1;
+    free(w);
+    return retval;
+}
+
+/* ================================= Reader ================================= */
+
+typedef struct {
+    const unsigned char *map;
+    size_t size;
+    uint32_t flags;
+    uint64_t num_records;
+    uint64_t num_blocks;
+    size_t *block_off;      // Offset of the first record of every block.
+    uint32_t *block_count;  // Number of records of every block.
+    uint64_t *block_first;  // Index of the first record of every block.
+} GameLogReader;
+
+static inline void gamelog_release(GameLogReader *r) {
+    munmap((void*)r->map, r->size);
+    free(r->block_off);
+    free(r->block_count);
+    free(r->block_first);
+    free(r);
+}
+
+/* Map 'path' and index its blocks. If 'verify' is true and the log was
+ * written with checksums, every block is checked, which touches all the
+ * pages once: skip it when the same file is mapped over and over.
+ * A truncated tail (a block torn by a crash while appending) is dropped
+ * with a warning, a checksum mismatch makes the open fail.
+ * Returns NULL on error. */
+static inline GameLogReader *gamelog_open(const char *path, int verify) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if (sb.st_size < GAMELOG_FILE_HEADER_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t size = sb.st_size;
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    if (memcmp(map, GAMELOG_MAGIC, 7) != 0 || map[7] != GAMELOG_VERSION) {
+        munmap(map, size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    GameLogReader *r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        munmap(map, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint64_t cap = 16;
+    r->map = map;
+    r->size = size;
+    r->flags = gamelog_get_u32(map+8);
+    r->block_off = malloc(sizeof(size_t) * cap);
+    r->block_count = malloc(sizeof(uint32_t) * cap);
+    r->block_first = malloc(sizeof(uint64_t) * cap);
+    if (!r->block_off || !r->block_count || !r->block_first) {
+        gamelog_release(r);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t off = GAMELOG_FILE_HEADER_SIZE;
+    while (off < size) {
+        const unsigned char *h = map + off;
+        if (size - off < GAMELOG_BLOCK_HEADER_SIZE ||
+            gamelog_get_u32(h) != GAMELOG_BLOCK_MAGIC)
+            break;
+
+        uint32_t count = gamelog_get_u32(h+4);
+        size_t payload = (size_t)count * GAMELOG_RECORD_SIZE;
+        if (count == 0 || count > GAMELOG_BLOCK_RECORDS ||
+            size - off - GAMELOG_BLOCK_HEADER_SIZE < payload)
+            break;
+
+        const unsigned char *rec = h + GAMELOG_BLOCK_HEADER_SIZE;
+        if (verify && (r->flags & GAMELOG_FLAG_CHECKSUM) &&
+            gamelog_checksum(rec, payload) != gamelog_get_u32(h+8))
+        {
+            fprintf(stderr, "%s: checksum mismatch in block %llu\n", path,
+                    (unsigned long long)r->num_blocks);
+            gamelog_release(r);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        if (r->num_blocks == cap) {
+            /* A failed realloc() leaves the old array to us: keep it in
+             * 'r' so that gamelog_release() frees it. */
+            cap *= 2;
+            size_t *off_grown = realloc(r->block_off, sizeof(size_t) * cap);
+            if (off_grown) r->block_off = off_grown;
+            uint32_t *count_grown = realloc(r->block_count, sizeof(uint32_t) * cap);
+            if (count_grown) r->block_count = count_grown;
+            uint64_t *first_grown = realloc(r->block_first, sizeof(uint64_t) * cap);
+            if (first_grown) r->block_first = first_grown;
+            if (!off_grown || !count_grown || !first_grown) {
+                gamelog_release(r);
+                errno = ENOMEM;
+                return NULL;
+            }
+        }
+        r->block_off[r->num_blocks] = off + GAMELOG_BLOCK_HEADER_SIZE;
+        r->block_count[r->num_blocks] = count;
+        r->block_first[r->num_blocks] = r->num_records;
+        r->num_blocks++;
+        r->num_records += count;
+        off += GAMELOG_BLOCK_HEADER_SIZE + payload;
+    }
+
+    if (off != size) {
+        fprintf(stderr, "%s: ignoring %zu bytes of truncated tail\n",
+                path, size - off);
+    }
+    return r;
+}
+
+/* Return a pointer to the records of block 'b', storing how many there
+ * are in '*count'. Blocks are the natural unit to shard a log across
+ * threads, since they can be located without reading anything else. */
+static inline const unsigned char *gamelog_block(const GameLogReader *r,
+                                                 uint64_t b, uint32_t *count)
+{
+    *count = r->block_count[b];
+    return r->map + r->block_off[b];
+}
+
+/* Sequential iterator over all the records of a log. */
+typedef struct {
+    const GameLogReader *r;
+    uint64_t block;
+    uint32_t idx;
+} GameLogIter;
+
+static inline void gamelog_iter_init(GameLogIter *it, const GameLogReader *r) {
+    it->r = r;
+    it->block = 0;
+    it->idx = 0;
+}
+
+/* Position the iterator so that the next record returned is the one with
+ * global index 'idx'. Blocks may be partially filled (every writer session
+ * closes with a short block), so the block is found by binary search. */
+static inline void gamelog_iter_seek(GameLogIter *it, const GameLogReader *r,
+                                     uint64_t idx)
+{
+    uint64_t lo = 0, hi = r->num_blocks;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (r->block_first[mid] <= idx) lo = mid; else hi = mid;
+    }
+    it->r = r;
+    if (idx >= r->num_records) {
+        it->block = r->num_blocks;
+        it->idx = 0;
+    } else {
+        it->block = lo;
+        it->idx = idx - r->block_first[lo];
+    }
+}
+
+/* Return the next record, or NULL when the log is exhausted. */
+static inline const unsigned char *gamelog_next(GameLogIter *it) {
+    while (it->block < it->r->num_blocks) {
+        if (it->idx < it->r->block_count[it->block]) {
+            return it->r->map + it->r->block_off[it->block] +
+                   (size_t)(it->idx++) * GAMELOG_RECORD_SIZE;
+        }
+        it->block++;
+        it->idx = 0;
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,310 @@
+/* Multi layer perceptron with a shape chosen at runtime.
+ *
+ * NeuralNetwork in template.c has one hidden layer and sizes fixed at
+ * compile time, which is what makes its loops fast: the compiler knows
+ * every trip count. An Mlp has any number of layers of any width, given
+ * when it is created, for experiments with bigger models, while trying
+ * to keep most of that speed:
+ *
+ * - All the weights and biases live in one 64 byte aligned buffer
+ *   (m->params), so copying, saving or averaging a model is a single loop,
+ *   exactly like NeuralGradients for the fixed network.
+ *
+ * - Every layer is padded to a multiple of MLP_ALIGN floats: weight rows,
+ *   biases and activations. The padding is zero and stays zero, so the
+ *   kernels always work on whole, aligned vectors with no remainder loop.
+ *
+ * - The forward kernel of a layer is picked when the network is created.
+ *   The shapes listed in MLP_KERNEL_SHAPES get their own copy of the
+ *   kernel, instantiated by a macro with constant sizes so the compiler
+ *   fully unrolls and vectorizes it; any other shape uses the same code
+ *   with runtime sizes.
+ *
+ * Weights of layer 'l' are stored by input: row 'i' holds the weights
+ * from input 'i' to all the outputs, like weights_ih in NeuralNetwork. A
+ * layer is then computed by adding the rows of the non zero inputs, which
+ * skips most of the work with our sparse board inputs and after ReLU.
+ *
+ * Hidden layers use ReLU, the last layer produces raw logits.
+ *
+ * Header only, like gamelog.h and envpool.h. */
+
+#ifndef MLP_H
+#define MLP_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MLP_MAX_LAYERS 8        // Weight layers, not counting the inputs.
+#define MLP_ALIGN 16            // Floats, 64 bytes.
+#define MLP_PAD(n) (((n) + MLP_ALIGN - 1) & ~(MLP_ALIGN - 1))
+
+typedef void (*MlpKernel)(const float *restrict in, int n_in,
+                          const float *restrict w, const float *restrict b,
+                          float *restrict out, int stride, int relu);
+
+typedef struct {
+    int num_layers;                         // Weight layers.
+    int sizes[MLP_MAX_LAYERS+1];            // Units, inputs first.
+    int stride[MLP_MAX_LAYERS+1];           // Padded sizes.
+    size_t w_off[MLP_MAX_LAYERS];           // Offsets in params, floats.
+    size_t b_off[MLP_MAX_LAYERS];
+    size_t num_params;                      // Including the padding.
+    int max_stride;                         // Widest padded layer.
+    float *params;
+    size_t act_off[MLP_MAX_LAYERS+1];       // Offsets in act, floats.
+    float *act;                             // Activations of the last
+                                            // forward pass, inputs first.
+                                            // Not for mlp_infer().
+    float *delta[2];                        // Backprop scratch.
+    float *probs;                           // Softmax of the logits.
+    MlpKernel kernel[MLP_MAX_LAYERS];
+    int specialized;                        // Layers with a fixed kernel.
+} Mlp;
+
+/* One layer: out = b + sum(in[i] * row[i]), then ReLU if 'relu'. Forced
+ * inline so that the instances below see constant sizes. */
+static inline __attribute__((always_inline))
+void mlp_layer(const float *restrict in, int n_in, const float *restrict w,
+               const float *restrict b, float *restrict out, int stride,
+               int relu)
+{
+    w = __builtin_assume_aligned(w, 64);
+    out = __builtin_assume_aligned(out, 64);
+    memcpy(out, b, sizeof(float) * stride);
+    for (int i = 0; i < n_in; i++) {
+        float x = in[i];
+        if (x == 0) continue;
+        const float *row = w + (size_t)i * stride;
+        for (int j = 0; j < stride; j++) out[j] += x * row[j];
+    }
+    if (relu)
+        for (int j = 0; j < stride; j++) out[j] = out[j] > 0 ? out[j] : 0;
+}
+
+static void mlp_kernel_generic(const float *restrict in, int n_in,
+                               const float *restrict w,
+                               const float *restrict b, float *restrict out,
+                               int stride, int relu)
+{
+    mlp_layer(in, n_in, w, b, out, stride, relu);
+}
+
+/* Shapes (inputs, outputs) with a specialized kernel. The first two are
+ * the layers of the fixed network. */
+#define MLP_KERNEL_SHAPES(X) \
+    X(18, 100) X(100, 9)            \
+    X(18, 32)  X(32, 32)  X(32, 9)  \
+    X(18, 64)  X(64, 64)  X(64, 9)  \
+    X(18, 128) X(128, 128) X(128, 9) \
+    X(128, 64) X(64, 32)
+
+#define MLP_DEFINE_KERNEL(IN, OUT)                                          \
+static void mlp_kernel_##IN##_##OUT(const float *restrict in, int n_in,     \
+                                    const float *restrict w,                \
+                                    const float *restrict b,                \
+                                    float *restrict out, int stride,        \
+                                    int relu)                               \
+{                                                                           \
+    (void)n_in; (void)stride;                                               \
+    mlp_layer(in, IN, w, b, out, MLP_PAD(OUT), relu);                       \
+}
+MLP_KERNEL_SHAPES(MLP_DEFINE_KERNEL)
+#undef MLP_DEFINE_KERNEL
+
+static const struct {
+    int in, out;
+    MlpKernel kernel;
+} mlp_kernels[] = {
+#define MLP_KERNEL_ENTRY(IN, OUT) {IN, OUT, mlp_kernel_##IN##_##OUT},
+    MLP_KERNEL_SHAPES(MLP_KERNEL_ENTRY)
+#undef MLP_KERNEL_ENTRY
+};
+
+/* Select the forward kernels: specialized ones where available if
+ * 'enable', otherwise always the generic one (to measure the difference).
+ * Returns the number of specialized layers. */
+static inline int mlp_specialize(Mlp *m, int enable) {
+    m->specialized = 0;
+    for (int l = 0; l < m->num_layers; l++) {
+        m->kernel[l] = mlp_kernel_generic;
+        if (!enable) continue;
+        for (size_t k = 0; k < sizeof(mlp_kernels)/sizeof(mlp_kernels[0]); k++) {
+            if (mlp_kernels[k].in == m->sizes[l] &&
+                mlp_kernels[k].out == m->sizes[l+1])
+            {
+                m->kernel[l] = mlp_kernels[k].kernel;
+                m->specialized++;
+                break;
+            }
+        }
+    }
+    return m->specialized;
+}
+
+/* Create a network with 'num_sizes' layers of units, inputs first, so
+ * {18, 64, 64, 9} has two hidden layers of 64. Weights are initialized
+ * uniformly in +/- sqrt(6/inputs) (He initialization, since we use ReLU),
+ * using rand() like init_neural_network(). Returns NULL if the shape is
+ * not valid. */
+static inline Mlp *mlp_create(const int *sizes, int num_sizes) {
+    if (num_sizes < 2 || num_sizes > MLP_MAX_LAYERS + 1) return NULL;
+    for (int l = 0; l < num_sizes; l++) if (sizes[l] <= 0) return NULL;
+
+    Mlp *m = calloc(1, sizeof(*m));
+    size_t params = 0, acts = 0;
+    int max_stride = 0;
+
+    m->num_layers = num_sizes - 1;
+    for (int l = 0; l < num_sizes; l++) {
+        m->sizes[l] = sizes[l];
+        m->stride[l] = MLP_PAD(sizes[l]);
+        m->act_off[l] = acts;
+        acts += m->stride[l];
+        if (m->stride[l] > max_stride) max_stride = m->stride[l];
+    }
+    for (int l = 0; l < m->num_layers; l++) {
+        m->w_off[l] = params;
+        params += (size_t)sizes[l] * m->stride[l+1];
+        m->b_off[l] = params;
+        params += m->stride[l+1];
+    }
+    m->num_params = params;
+    m->max_stride = max_stride;
+    m->params = aligned_alloc(64, sizeof(float) * params);
+    m->act = aligned_alloc(64, sizeof(float) * acts);
+    m->delta[0] = aligned_alloc(64, sizeof(float) * max_stride);
+    m->delta[1] = aligned_alloc(64, sizeof(float) * max_stride);
+    m->probs = aligned_alloc(64, sizeof(float) * m->stride[m->num_layers]);
+    memset(m->params, 0, sizeof(float) * params);
+    memset(m->act, 0, sizeof(float) * acts);
+
+    for (int l = 0; l < m->num_layers; l++) {
+        float range = sqrtf(6.0f / sizes[l]);
+        float *w = m->params + m->w_off[l];
+        float *b = m->params + m->b_off[l];
+        for (int i = 0; i < sizes[l]; i++)
+            for (int j = 0; j < sizes[l+1]; j++)
+                w[(size_t)i * m->stride[l+1] + j] =
+                    range * (2.0f * rand() / RAND_MAX - 1);
+        for (int j = 0; j < sizes[l+1]; j++)
+            b[j] = 0.1f * (2.0f * rand() / RAND_MAX - 1);
+    }
+    mlp_specialize(m, 1);
+    return m;
+}
+
+static inline void mlp_free(Mlp *m) {
+    free(m->params);
+    free(m->act);
+    free(m->delta[0]);
+    free(m->delta[1]);
+    free(m->probs);
+    free(m);
+}
+
+/* Forward pass. Stores all the activations for mlp_backward() and
+ * returns the raw logits (m->sizes[num_layers] of them). */
+static inline float *mlp_forward(Mlp *m, const float *inputs) {
+    float *in = m->act;
+    memcpy(in, inputs, sizeof(float) * m->sizes[0]);
+    for (int l = 0; l < m->num_layers; l++) {
+        float *out = m->act + m->act_off[l+1];
+        m->kernel[l](in, m->sizes[l], m->params + m->w_off[l],
+                     m->params + m->b_off[l], out, m->stride[l+1],
+                     l != m->num_layers - 1);
+        in = out;
+    }
+    return in;
+}
+
+/* Forward pass that only reads the network, so that many threads can
+ * share it: the activations go to 'scratch', 2 * m->max_stride floats,
+ * 64 byte aligned, that the caller owns (typically on its stack), instead
+ * of m->act. Nothing is kept for mlp_backward(). Returns the raw logits,
+ * inside 'scratch'. */
+static inline float *mlp_infer(const Mlp *m, const float *inputs,
+                               float *scratch)
+{
+    const float *in = inputs;
+    for (int l = 0; l < m->num_layers; l++) {
+        float *out = scratch + (l & 1) * m->max_stride;
+        m->kernel[l](in, m->sizes[l], m->params + m->w_off[l],
+                     m->params + m->b_off[l], out, m->stride[l+1],
+                     l != m->num_layers - 1);
+        in = out;
+    }
+    return (float *)in;
+}
+
+/* Softmax of the logits of the last forward pass into m->probs. */
+static inline float *mlp_softmax(Mlp *m) {
+    int n = m->sizes[m->num_layers];
+    float *logits = m->act + m->act_off[m->num_layers];
+    float max_val = logits[0], sum = 0;
+    for (int i = 1; i < n; i++) if (logits[i] > max_val) max_val = logits[i];
+    for (int i = 0; i < n; i++) {
+        m->probs[i] = expf(logits[i] - max_val);
+        sum += m->probs[i];
+    }
+    for (int i = 0; i < n; i++) m->probs[i] /= sum;
+    return m->probs;
+}
+
+/* Backpropagation of the last forward pass with softmax and cross
+ * entropy, the error scaled by |reward_scaling| like backprop() in
+ * template.c. If 'grad' is NULL the weights are updated right away with
+ * 'learning_rate', otherwise the gradients are added to 'grad', that has
+ * the layout of m->params (num_params floats) and the weights are left
+ * alone. Only the real units are touched, so the padding stays zero. */
+static inline void mlp_backward(Mlp *m, const float *target_probs,
+                                float learning_rate, float reward_scaling,
+                                float *grad)
+{
+    int L = m->num_layers;
+    float *delta = m->delta[0], *prev = m->delta[1];
+    float scale = fabsf(reward_scaling);
+
+    mlp_softmax(m);
+    for (int j = 0; j < m->sizes[L]; j++)
+        delta[j] = (m->probs[j] - target_probs[j]) * scale;
+
+    for (int l = L - 1; l >= 0; l--) {
+        int n_in = m->sizes[l], n_out = m->sizes[l+1];
+        int stride = m->stride[l+1];
+        float *w = m->params + m->w_off[l];
+        float *b = m->params + m->b_off[l];
+        float *in = m->act + m->act_off[l];
+
+        /* Deltas of the layer below, with the weights before the update.
+         * The inputs layer needs none. */
+        if (l > 0) {
+            for (int i = 0; i < n_in; i++) {
+                float error = 0;
+                if (in[i] > 0) {
+                    const float *row = w + (size_t)i * stride;
+                    for (int j = 0; j < n_out; j++) error += delta[j] * row[j];
+                }
+                prev[i] = error;    // ReLU derivative: 0 if in[i] <= 0.
+            }
+        }
+
+        float *gw = grad ? grad + m->w_off[l] : w;
+        float *gb = grad ? grad + m->b_off[l] : b;
+        float rate = grad ? -1 : learning_rate;
+        for (int i = 0; i < n_in; i++) {
+            if (in[i] == 0) continue;
+            float *row = gw + (size_t)i * stride;
+            float x = rate * in[i];
+            for (int j = 0; j < n_out; j++) row[j] -= x * delta[j];
+        }
+        for (int j = 0; j < n_out; j++) gb[j] -= rate * delta[j];
+
+        float *tmp = delta;
+        delta = prev;
+        prev = tmp;
+    }
+}
+
+#endif
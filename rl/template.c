@@ -3,7 +3,24 @@
 #include <time.h>
 #include <float.h>
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include "gamelog.h"
+#include "envpool.h"
+#include "mlp.h"
+#include "env.h"
+#include "checkpoint.h"
 
 // Neural network parameters.
 #define NN_INPUT_SIZE 18
@@ -11,10 +28,97 @@
 #define NN_OUTPUT_SIZE 9
 #define LEARNING_RATE 0.1
 
+/* Hyper parameters of learn_from_game(). Passing NULL uses the defaults
+ * below, the ones that work well for training against random; the
+ * population trainer gives every network its own set. */
+typedef struct {
+    float learning_rate;
+    float reward_win;
+    float reward_draw;
+    float reward_loss;
+} LearnParams;
+
+const LearnParams default_learn_params = {
+    LEARNING_RATE,
+    1.0f,   // Large reward for win.
+    0.3f,   // Small reward for draw.
+    -2.0f   // Negative reward for loss.
+};
+
+/* When not NULL, every game played (training or against the human) is
+ * appended here, see gamelog.h and the --log option. */
+GameLogWriter *game_log = NULL;
+
+/* Append a finished game to the game log, if logging is enabled. */
+void log_game(int *move_history, int num_moves, char winner) {
+    if (game_log == NULL) return;
+    if (gamelog_append(game_log, move_history, num_moves, winner) == -1) {
+        perror("Writing game log");
+        exit(1);
+    }
+}
+
+/* Live training metrics, see the "Live metrics" section: every training
+ * thread owns one TrainMetrics slot, padded to a cache line so that
+ * threads never write the same line, and is the only writer of its
+ * counters. Updating them is then a plain load, add and store, with no
+ * lock and no syscall; the publisher thread only reads. Threads that
+ * never called metrics_register(), or all of them when --metrics is not
+ * given, have a NULL 'thread_metrics' and skip the accounting. */
+#define CACHE_LINE 64
+#define METRICS_MAX_THREADS 64
+
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_ulong games;
+    atomic_ulong moves;
+    atomic_ulong wins, losses, ties;    // Games of the network.
+    atomic_ulong updates;               // Weight updates.
+    _Atomic double update_norm;         // Sum of their L2 norms.
+} TrainMetrics;
+
+TrainMetrics metrics_slots[METRICS_MAX_THREADS];
+atomic_int metrics_enabled, metrics_used;
+_Thread_local TrainMetrics *thread_metrics = NULL;
+
+/* Get a slot for the calling thread, if metrics are enabled. */
+void metrics_register(void) {
+    if (!atomic_load(&metrics_enabled) || thread_metrics) return;
+    int slot = atomic_fetch_add(&metrics_used, 1);
+    if (slot < METRICS_MAX_THREADS) thread_metrics = &metrics_slots[slot];
+}
+
+/* Single writer add: no need for an atomic read-modify-write. */
+static inline void metrics_add(atomic_ulong *counter, unsigned long n) {
+    atomic_store_explicit(counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+/* Account a finished game, 'nn_symbol' being the side of the network. */
+static inline void metrics_game(int num_moves, char winner, char nn_symbol) {
+    TrainMetrics *m = thread_metrics;
+    if (m == NULL) return;
+    metrics_add(&m->games, 1);
+    metrics_add(&m->moves, num_moves);
+    if (winner == nn_symbol) metrics_add(&m->wins, 1);
+    else if (winner == 'T') metrics_add(&m->ties, 1);
+    else metrics_add(&m->losses, 1);
+}
+
+/* Account a weight update of L2 norm 'norm'. */
+static inline void metrics_update(double norm) {
+    TrainMetrics *m = thread_metrics;
+    metrics_add(&m->updates, 1);
+    atomic_store_explicit(&m->update_norm,
+        atomic_load_explicit(&m->update_norm, memory_order_relaxed) + norm,
+        memory_order_relaxed);
+}
+
 // Game board representation.
 typedef struct {
     char board[9];          // Can be "." (empty) or "X", "O".
     int current_player;     // 0 for player (X), 1 for computer (O).
+    int num_moves;          // Tiles filled so far, see make_move().
 } GameState;
 
 /* Neural network structure. For simplicity we have just
@@ -28,13 +132,34 @@ typedef struct {
     float biases_h[NN_HIDDEN_SIZE];
     float biases_o[NN_OUTPUT_SIZE];
 
+    // Value head: expected reward of the position, from the same hidden
+    // layer. Only trained with --td, see learn_from_game().
+    float weights_hv[NN_HIDDEN_SIZE];
+    float bias_v;
+
     // Activations are part of the structure itself for simplicity.
     float inputs[NN_INPUT_SIZE];
     float hidden[NN_HIDDEN_SIZE];
     float raw_logits[NN_OUTPUT_SIZE]; // Outputs before softmax().
     float outputs[NN_OUTPUT_SIZE];    // Outputs after softmax().
+    float value;                      // Value head output.
+    float value_error;  // Value error to backpropagate with the policy
+                        // error, set by the caller after forward_pass().
 } NeuralNetwork;
 
+/* Gradients with respect to every parameter of the network, with the
+ * same layout of the weights in NeuralNetwork. Used when the updates of
+ * many moves (or many threads) are accumulated and applied at once,
+ * instead of updating the weights after every move like backprop() does. */
+typedef struct {
+    float weights_ih[NN_INPUT_SIZE * NN_HIDDEN_SIZE];
+    float weights_ho[NN_HIDDEN_SIZE * NN_OUTPUT_SIZE];
+    float biases_h[NN_HIDDEN_SIZE];
+    float biases_o[NN_OUTPUT_SIZE];
+    float weights_hv[NN_HIDDEN_SIZE];
+    float bias_v;
+} NeuralGradients;
+
 /* ReLU activation function */
 float relu(float x) {
     return x > 0 ? x : 0;
@@ -62,44 +187,150 @@ void init_neural_network(NeuralNetwork *nn) {
 
     for (int i = 0; i < NN_OUTPUT_SIZE; i++)
         nn->biases_o[i] = RANDOM_WEIGHT();
+
+    // The value head starts close to 0: we know nothing yet.
+    for (int i = 0; i < NN_HIDDEN_SIZE; i++)
+        nn->weights_hv[i] = RANDOM_WEIGHT() * 0.1f;
+    nn->bias_v = 0;
 }
 
-/* Apply softmax activation function to an array input, and
- * set the result into output. */
-void softmax(float *input, float *output, int size) {
-    /* Find maximum value then subtact it to avoid
-     * numerical stability issues with exp(). */
-    float max_val = input[0];
-    for (int i = 1; i < size; i++) {
-        if (input[i] > max_val) {
-            max_val = input[i];
-        }
+/* Softmax kernels, written with GCC vector extensions (also supported by
+ * clang) so that they are SIMD code on any target: SSE on x86-64, NEON on
+ * ARM. The 9 outputs are processed as 3 vectors of 4 floats, the lanes
+ * past 'size' and the illegal moves are masked out. */
+typedef float f32x4 __attribute__((vector_size(16)));
+typedef int32_t i32x4 __attribute__((vector_size(16)));
+
+#define SOFTMAX_MAX_SIZE 16
+#define SOFTMAX_VECTORS(size) (((size) + 3) / 4)
+
+/* Lane by lane 'mask ? a : b', the vector ?: only exists in C++. */
+static inline f32x4 f32x4_select(i32x4 mask, f32x4 a, f32x4 b) {
+    return (f32x4)((mask & (i32x4)a) | (~mask & (i32x4)b));
+}
+
+/* Fast exp() for softmax: the Cephes expf() polynomial, on 4 floats at
+ * once and with no library calls.
+ *
+ * exp(x) = 2^n * exp(r), with n = round(x/ln2) and |r| <= ln2/2. The
+ * rounding adds and subtracts 1.5*2^23, 2^n is built directly in the
+ * exponent bits, and exp(r) is a degree 6 polynomial. x is clamped to
+ * [-87, 88] so that 2^n is always a normal float. The relative error is
+ * about one ulp, see --check-softmax. */
+static inline f32x4 fast_expf4(f32x4 x) {
+    const f32x4 lo = {-87.0f, -87.0f, -87.0f, -87.0f};
+    const f32x4 hi = {88.0f, 88.0f, 88.0f, 88.0f};
+    x = f32x4_select(x < lo, lo, x);
+    x = f32x4_select(x > hi, hi, x);
+
+    f32x4 n = (x * 1.44269504088896341f + 12582912.0f) - 12582912.0f;
+    f32x4 r = x - n * 0.693359375f;         // ln2 in two parts, so that
+    r = r - n * -2.12194440e-4f;            // r is exact enough.
+
+    f32x4 z = r * r;
+    f32x4 y = r * 1.9875691500e-4f + 1.3981999507e-3f;
+    y = y * r + 8.3334519073e-3f;
+    y = y * r + 4.1665795894e-2f;
+    y = y * r + 1.6666665459e-1f;
+    y = y * r + 5.0000001201e-1f;
+    y = y * z + r + 1.0f;
+
+    i32x4 bits = (__builtin_convertvector(n, i32x4) + 127) << 23;
+    return y * (f32x4)bits;
+}
+
+static inline float fast_expf(float x) {
+    f32x4 v = {x, x, x, x};
+    return fast_expf4(v)[0];
+}
+
+/* Shared by the softmax kernels: load the first 'size' inputs in 'x' and
+ * return in 'x' their exp(x - max) over the moves in 'legal', 0 for the
+ * others. Returns 1/sum, to multiply by. */
+static inline __attribute__((always_inline))
+float softmax_exp(const float *input, unsigned legal, int size,
+                                f32x4 *x)
+{
+    int nv = SOFTMAX_VECTORS(size);
+    float buf[SOFTMAX_MAX_SIZE] = {0};
+    i32x4 mask[SOFTMAX_VECTORS(SOFTMAX_MAX_SIZE)];
+    const f32x4 neg = {-FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+    memcpy(buf, input, sizeof(float) * size);
+    legal &= (1u << size) - 1;
+    f32x4 vmax = neg;
+    for (int v = 0; v < nv; v++) {
+        i32x4 lane = {1 << (v*4), 2 << (v*4), 4 << (v*4), 8 << (v*4)};
+        mask[v] = (lane & (int32_t)legal) != 0;
+        memcpy(&x[v], buf + v*4, sizeof(f32x4));
+        x[v] = f32x4_select(mask[v], x[v], neg);
+        vmax = f32x4_select(x[v] > vmax, x[v], vmax);
     }
+    float max_val = vmax[0];
+    for (int l = 1; l < 4; l++) max_val = vmax[l] > max_val ? vmax[l] : max_val;
 
-    // Calculate exp(x_i - max) for each element and sum.
-    float sum = 0.0f;
-    for (int i = 0; i < size; i++) {
-        output[i] = expf(input[i] - max_val);
-        sum += output[i];
+    f32x4 vsum = {0, 0, 0, 0};
+    for (int v = 0; v < nv; v++) {
+        x[v] = (f32x4)((i32x4)fast_expf4(x[v] - max_val) & mask[v]);
+        vsum += x[v];
     }
+    return 1.0f / (vsum[0] + vsum[1] + vsum[2] + vsum[3]);
+}
 
-    // Normalize to get probabilities.
-    if (sum > 0) {
-        for (int i = 0; i < size; i++) {
-            output[i] /= sum;
-        }
-    } else {
-        /* Fallback in case of numerical issues, just provide
-         * a uniform distribution. */
-        for (int i = 0; i < size; i++) {
-            output[i] = 1.0f / size;
-        }
+/* Softmax over the legal moves only: bit 'i' of 'legal' set means move
+ * 'i' is legal. Illegal moves get probability 0, and the legal ones sum
+ * to 1, so these are the probabilities of the moves we can actually
+ * play. 'legal' must have at least one bit set. */
+static inline void softmax_masked(const float *input, unsigned legal, float *output, int size) {
+    f32x4 x[SOFTMAX_VECTORS(SOFTMAX_MAX_SIZE)];
+    float buf[SOFTMAX_MAX_SIZE];
+
+    float inv = softmax_exp(input, legal, size, x);
+    for (int v = 0; v < SOFTMAX_VECTORS(size); v++) {
+        f32x4 p = x[v] * inv;
+        memcpy(buf + v*4, &p, sizeof(p));
     }
+    memcpy(output, buf, sizeof(float) * size);
 }
 
-/* Neural network foward pass (inference). We store the activations
- * so we can also do backpropagation later. */
-void forward_pass(NeuralNetwork *nn, float *inputs) {
+/* Apply softmax activation function to an array input, and
+ * set the result into output.
+ *
+ * Subtracting the maximum value avoids numerical stability issues with
+ * exp(), and since the maximum gives exp(0) = 1 the sum is at least 1,
+ * so there is no division by zero to worry about. 'size' is at most
+ * SOFTMAX_MAX_SIZE. */
+static inline void softmax(float *input, float *output, int size) {
+    softmax_masked(input, ~0u, output, size);
+}
+
+/* Softmax followed by the cross entropy output deltas, fused:
+ *
+ *      delta[i] = (softmax(logits)[i] - target[i]) * scale
+ *
+ * without storing the probabilities. See compute_deltas(). */
+static inline void softmax_xent_delta(const float *logits, const float *target, float scale,
+                        float *delta, int size)
+{
+    f32x4 x[SOFTMAX_VECTORS(SOFTMAX_MAX_SIZE)];
+    float buf[SOFTMAX_MAX_SIZE];
+
+    float inv = softmax_exp(logits, ~0u, size, x);
+    memcpy(buf, target, sizeof(float) * size);
+    for (int v = 0; v < SOFTMAX_VECTORS(size); v++) {
+        f32x4 t, d;
+        memcpy(&t, buf + v*4, sizeof(t));
+        d = (x[v] * inv - t) * scale;
+        memcpy(buf + v*4, &d, sizeof(d));
+    }
+    memcpy(delta, buf, sizeof(float) * size);
+}
+
+/* Neural network foward pass (inference), up to the raw logits and the
+ * value. We store the activations so we can also do backpropagation
+ * later. Training only needs the logits, since compute_deltas() computes
+ * the softmax itself. */
+void forward_logits(NeuralNetwork *nn, float *inputs) {
     // Copy inputs.
     memcpy(nn->inputs, inputs, NN_INPUT_SIZE * sizeof(float));
 
@@ -120,14 +351,75 @@ void forward_pass(NeuralNetwork *nn, float *inputs) {
         }
     }
 
-    // Apply softmax to get the final probabilities.
+    // Value head, a dot product with the same hidden layer.
+    nn->value = nn->bias_v;
+    for (int j = 0; j < NN_HIDDEN_SIZE; j++)
+        nn->value += nn->hidden[j] * nn->weights_hv[j];
+    nn->value_error = 0;
+}
+
+/* forward_logits() plus the softmax, to get the final probabilities
+ * in nn->outputs. */
+void forward_pass(NeuralNetwork *nn, float *inputs) {
+    forward_logits(nn, inputs);
     softmax(nn->raw_logits, nn->outputs, NN_OUTPUT_SIZE);
 }
 
+/* Batched inference: compute the raw logits of 'count' positions at once.
+ * 'inputs' holds NN_INPUT_SIZE floats per position and 'logits' receives
+ * NN_OUTPUT_SIZE floats per position. Unlike forward_pass() nothing is
+ * stored in the network (so it can't be followed by backprop()), and no
+ * softmax is computed: it is monotonic, so the best move is the same.
+ *
+ * The hidden layer is computed by adding the weights_ih rows of the non
+ * zero inputs: with our board encoding at most 9 of the 18 inputs are
+ * set, and each row is contiguous, so this is half the work of the dense
+ * loop and vectorizes well. */
+void forward_batch(NeuralNetwork *nn, float *inputs, int count, float *logits) {
+    float hidden[NN_HIDDEN_SIZE];
+
+    for (int b = 0; b < count; b++) {
+        float *in = inputs + b*NN_INPUT_SIZE;
+        float *out = logits + b*NN_OUTPUT_SIZE;
+
+        memcpy(hidden, nn->biases_h, sizeof(hidden));
+        for (int i = 0; i < NN_INPUT_SIZE; i++) {
+            if (in[i] == 0) continue;
+            float *row = nn->weights_ih + i*NN_HIDDEN_SIZE;
+            for (int j = 0; j < NN_HIDDEN_SIZE; j++)
+                hidden[j] += in[i] * row[j];
+        }
+
+        memcpy(out, nn->biases_o, sizeof(float)*NN_OUTPUT_SIZE);
+        for (int j = 0; j < NN_HIDDEN_SIZE; j++) {
+            float h = relu(hidden[j]);
+            if (h == 0) continue;
+            float *row = nn->weights_ho + j*NN_OUTPUT_SIZE;
+            for (int k = 0; k < NN_OUTPUT_SIZE; k++)
+                out[k] += h * row[k];
+        }
+    }
+}
+
 /* Initialize game state with an empty board. */
 void init_game(GameState *state) {
     memset(state->board,'.',9);
     state->current_player = 0;  // Player (X) goes first
+    state->num_moves = 0;
+}
+
+/* Put the symbol of the current player at 'move' and pass the turn. */
+void make_move(GameState *state, int move) {
+    state->board[move] = (state->current_player == 0) ? 'X' : 'O';
+    state->num_moves++;
+    state->current_player = !state->current_player;
+}
+
+/* Take back the last move, that was played at 'move'. */
+void undo_move(GameState *state, int move) {
+    state->board[move] = '.';
+    state->num_moves--;
+    state->current_player = !state->current_player;
 }
 
 /* Show board on screen in ASCII "art"... */
@@ -177,6 +469,15 @@ void board_to_inputs(GameState *state, float *inputs) {
     }
 }
 
+/* Index of the board as a base 3 number, empty = 0, X = 1, O = 2:
+ * the same hash v1.c uses for its Q-table. */
+int board_hash(GameState *state) {
+    int h = 0;
+    for (int i = 0; i < 9; i++)
+        h = h*3 + (state->board[i] == 'X' ? 1 : (state->board[i] == 'O' ? 2 : 0));
+    return h;
+}
+
 /* Check if the game is over (win or tie).
  * Very brutal but fast enough. */
 int check_game_over(GameState *state, char *winner) {
@@ -227,82 +528,528 @@ int check_game_over(GameState *state, char *winner) {
     return 0; // Game continues.
 }
 
+/* Inference only path used to pick moves: this is the latency critical
+ * operation, both while training and when serving.
+ *
+ * Compared to forward_pass() followed by an argmax over the softmax:
+ * - The hidden layer is built straight from the board, adding the
+ *   weights_ih row of each occupied tile (2 inputs per tile, see
+ *   board_to_inputs()), so empty tiles cost nothing.
+ * - Activations live on the stack, nothing is written in the network,
+ *   so the same network can be used by many threads at once.
+ * - Softmax is monotonic, so the best legal move is the argmax of the
+ *   raw logits over the empty tiles: no expf() at all, unless the caller
+ *   passes 'probs', that then receives the same probabilities forward_pass()
+ *   would store in nn->outputs.
+ *
+ * Returns the best legal move, or -1 if the board is full. */
+int predict_move(NeuralNetwork *nn, GameState *state, float *probs) {
+    float hidden[NN_HIDDEN_SIZE];
+    float logits[NN_OUTPUT_SIZE];
+
+    memcpy(hidden, nn->biases_h, sizeof(hidden));
+    for (int i = 0; i < 9; i++) {
+        if (state->board[i] == '.') continue;
+        int input = i*2 + (state->board[i] == 'O');
+        float *row = nn->weights_ih + input*NN_HIDDEN_SIZE;
+        for (int j = 0; j < NN_HIDDEN_SIZE; j++) hidden[j] += row[j];
+    }
+
+    memcpy(logits, nn->biases_o, sizeof(logits));
+    for (int j = 0; j < NN_HIDDEN_SIZE; j++) {
+        if (hidden[j] <= 0) continue; // ReLU.
+        float *row = nn->weights_ho + j*NN_OUTPUT_SIZE;
+        for (int k = 0; k < NN_OUTPUT_SIZE; k++) logits[k] += hidden[j] * row[k];
+    }
+
+    int best_move = -1;
+    for (int i = 0; i < 9; i++) {
+        if (state->board[i] != '.') continue;
+        if (best_move == -1 || logits[i] > logits[best_move]) best_move = i;
+    }
+    if (probs) softmax(logits, probs, NN_OUTPUT_SIZE);
+    return best_move;
+}
+
+/* Best legal move of an Mlp (see mlp.h), or -1 if the board is full.
+ * The network is only read, like in predict_move(), so the tournament
+ * threads can share it. */
+int mlp_predict_move(Mlp *m, GameState *state) {
+    float inputs[NN_INPUT_SIZE];
+    float scratch[2 * m->max_stride] __attribute__((aligned(64)));
+    board_to_inputs(state, inputs);
+    float *logits = mlp_infer(m, inputs, scratch);
+
+    int best_move = -1;
+    for (int i = 0; i < 9; i++) {
+        if (state->board[i] != '.') continue;
+        if (best_move == -1 || logits[i] > logits[best_move]) best_move = i;
+    }
+    return best_move;
+}
+
+/* ============================== Policy table ==============================
+ * There are only 5478 boards reachable in a game (4520 of them with a move
+ * still to play), so once a network is trained we can just precompute its
+ * answer for every one of them. The table is indexed by board_hash(), the
+ * base 3 number of the board: 3^9 = 19683 one byte entries, a dense array
+ * we can look up with no hashing or probing, and small enough to ship
+ * inside the binary.
+ *
+ * --export-policy writes the table to a file that --policy loads at
+ * startup; --export-policy-c writes it as a C header, and building with
+ * -DPOLICY_HEADER='"policy.h"' embeds it as a const array, used when no
+ * --policy is given and no network is loaded or trained. With
+ * --policy-probs the move probabilities are stored too, quantized to one
+ * byte each (another 177k).
+ *
+ * Once a table is loaded get_computer_move() answers with one lookup.
+ * Training never uses it, since it must see the live network. */
+
+#define POLICY_ENTRIES 19683     // 3^9 boards.
+#define POLICY_FILE_MAGIC "TTTPOL01"
+#define POLICY_FLAG_PROBS (1<<0)
+
+const signed char *policy_moves = NULL;     // Best move, -1 if unreachable.
+const unsigned char *policy_probs = NULL;   // 9 probabilities*255 per board.
+
+#ifdef POLICY_HEADER
+#include POLICY_HEADER
+#endif
+
+/* Visit all the reachable boards from 'state' storing the network answer
+ * for the ones that are not over. Returns the number of new boards. */
+int policy_visit(NeuralNetwork *nn, GameState *state, unsigned char *seen,
+                 signed char *moves, unsigned char *probs)
+{
+    int h = board_hash(state);
+    if (seen[h]) return 0;
+    seen[h] = 1;
+
+    char winner;
+    if (check_game_over(state, &winner)) return 1;
+
+    float p[NN_OUTPUT_SIZE];
+    moves[h] = predict_move(nn, state, probs ? p : NULL);
+    if (probs) {
+        for (int i = 0; i < 9; i++)
+            probs[h*9+i] = (unsigned char)(p[i] * 255.0f + 0.5f);
+    }
+
+    int count = 1;
+    for (int i = 0; i < 9; i++) {
+        if (state->board[i] != '.') continue;
+        make_move(state, i);
+        count += policy_visit(nn, state, seen, moves, probs);
+        undo_move(state, i);
+    }
+    return count;
+}
+
+/* Fill 'moves' (and 'probs' if not NULL) for every reachable board. */
+void build_policy_table(NeuralNetwork *nn, signed char *moves, unsigned char *probs) {
+    unsigned char *seen = calloc(POLICY_ENTRIES, 1);
+    GameState state;
+
+    memset(moves, -1, POLICY_ENTRIES);
+    if (probs) memset(probs, 0, POLICY_ENTRIES*9);
+    init_game(&state);
+    int reachable = policy_visit(nn, &state, seen, moves, probs);
+
+    int playable = 0;
+    for (int h = 0; h < POLICY_ENTRIES; h++) playable += moves[h] != -1;
+    printf("Policy table: %d reachable boards, %d with a move to play\n",
+           reachable, playable);
+    free(seen);
+}
+
+int save_policy_table(const char *path, signed char *moves, unsigned char *probs) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return -1;
+
+    uint32_t hdr[2] = {probs ? POLICY_FLAG_PROBS : 0, POLICY_ENTRIES};
+    int ok = fwrite(POLICY_FILE_MAGIC, 8, 1, fp) == 1 &&
+             fwrite(hdr, sizeof(hdr), 1, fp) == 1 &&
+             fwrite(moves, POLICY_ENTRIES, 1, fp) == 1 &&
+             (!probs || fwrite(probs, POLICY_ENTRIES*9, 1, fp) == 1);
+    if (fclose(fp) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+/* Write the table as a C header defining the policy_builtin_* arrays. */
+int export_policy_c(const char *path, signed char *moves, unsigned char *probs) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return -1;
+
+    fprintf(fp, "/* Generated by template.c --export-policy-c, do not edit. */\n");
+    fprintf(fp, "#define POLICY_BUILTIN 1\n");
+    fprintf(fp, "static const signed char policy_builtin_moves[%d] = {",
+            POLICY_ENTRIES);
+    for (int h = 0; h < POLICY_ENTRIES; h++)
+        fprintf(fp, "%s%d,", h % 32 ? "" : "\n", moves[h]);
+    fprintf(fp, "\n};\n");
+    if (probs) {
+        fprintf(fp, "#define POLICY_BUILTIN_PROBS 1\n");
+        fprintf(fp, "static const unsigned char policy_builtin_probs[%d] = {",
+                POLICY_ENTRIES*9);
+        for (int i = 0; i < POLICY_ENTRIES*9; i++)
+            fprintf(fp, "%s%d,", i % 27 ? "" : "\n", probs[i]);
+        fprintf(fp, "\n};\n");
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* Load a table written by save_policy_table() and make it the one used
+ * by get_computer_move(). */
+int load_policy_table(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return -1;
+
+    char magic[8];
+    uint32_t hdr[2];
+    signed char *moves = malloc(POLICY_ENTRIES);
+    unsigned char *probs = NULL;
+    int ok = fread(magic, 8, 1, fp) == 1 &&
+             memcmp(magic, POLICY_FILE_MAGIC, 8) == 0 &&
+             fread(hdr, sizeof(hdr), 1, fp) == 1 &&
+             hdr[1] == POLICY_ENTRIES &&
+             fread(moves, POLICY_ENTRIES, 1, fp) == 1;
+    if (ok && (hdr[0] & POLICY_FLAG_PROBS)) {
+        probs = malloc(POLICY_ENTRIES*9);
+        ok = fread(probs, POLICY_ENTRIES*9, 1, fp) == 1;
+    }
+    fclose(fp);
+    if (!ok) {
+        free(moves);
+        free(probs);
+        errno = EINVAL;
+        return -1;
+    }
+    policy_moves = moves;
+    policy_probs = probs;
+    return 0;
+}
+
+/* Export the policy of 'nn' to 'path' as a table file, or as a C header
+ * if 'as_c' is true. */
+int export_policy(NeuralNetwork *nn, const char *path, int as_c, int with_probs) {
+    signed char *moves = malloc(POLICY_ENTRIES);
+    unsigned char *probs = with_probs ? malloc(POLICY_ENTRIES*9) : NULL;
+
+    build_policy_table(nn, moves, probs);
+    int retval = as_c ? export_policy_c(path, moves, probs) :
+                        save_policy_table(path, moves, probs);
+    free(moves);
+    free(probs);
+    return retval;
+}
+
+/* Winning lines, and for every tile the lines passing through it:
+ * 2 for the edges, 3 for the corners, 4 for the center, -1 terminated. */
+const int win_lines[8][3] = {
+    {0,1,2}, {3,4,5}, {6,7,8},  // Rows.
+    {0,3,6}, {1,4,7}, {2,5,8},  // Columns.
+    {0,4,8}, {2,4,6}            // Diagonals.
+};
+const int lines_through[9][5] = {
+    {0,3,6,-1}, {0,4,-1},     {0,5,7,-1},
+    {1,3,-1},   {1,4,6,7,-1}, {1,5,-1},
+    {2,3,7,-1}, {2,4,-1},     {2,5,6,-1}
+};
+
+/* Move aware version of check_game_over(), for game loops that go
+ * through make_move(): only the player that just moved can have won,
+ * and only with a line through the tile just played, so we test 2 to 4
+ * lines instead of 8, and the running move counter replaces the scan
+ * for empty tiles. */
+int check_move_over(GameState *state, int move, char *winner) {
+    char symbol = state->board[move];
+    for (const int *l = lines_through[move]; *l != -1; l++) {
+        const int *line = win_lines[*l];
+        if (state->board[line[0]] == symbol &&
+            state->board[line[1]] == symbol &&
+            state->board[line[2]] == symbol)
+        {
+            *winner = symbol;
+            return 1;
+        }
+    }
+    if (state->num_moves == 9) {
+        *winner = 'T';  // Tie
+        return 1;
+    }
+    return 0; // Game continues.
+}
+
+/* Show the move probabilities of the network, marking the highest one
+ * and the selected move.
+ *
+ * That's just for debugging. It's interesting to show to user
+ * in the first iterations of the game, since you can see how initially
+ * the net picks illegal moves as best, and so forth. */
+void display_move_probs(float *probs, int best_move) {
+    int highest_prob_idx = 0;
+    for (int i = 1; i < 9; i++)
+        if (probs[i] > probs[highest_prob_idx]) highest_prob_idx = i;
+
+    printf("Neural network move probabilities:\n");
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            int pos = row * 3 + col;
+
+            // Print probability as percentage.
+            printf("%5.1f%%", probs[pos] * 100.0f);
+
+            // Add markers.
+            if (pos == highest_prob_idx) {
+                printf("*"); // Highest probability overall.
+            }
+            if (pos == best_move) {
+                printf("#"); // Selected move (highest valid probability).
+            }
+            printf(" ");
+        }
+        printf("\n");
+    }
+
+    // Sum of probabilities should be 1.0, hopefully.
+    // Just debugging.
+    float total_prob = 0.0f;
+    for (int i = 0; i < 9; i++)
+        total_prob += probs[i];
+    printf("Sum of all probabilities: %.2f\n\n", total_prob);
+}
+
 /* Get the best move for the computer using the neural network.
  * Note that there is no complex sampling at all, we just get
- * the output with the highest value THAT has an empty tile. */
+ * the output with the highest value THAT has an empty tile.
+ *
+ * If a policy table is loaded the answer is just a lookup. Otherwise,
+ * unless we need to show the probabilities, this is predict_move(), and
+ * the rest of the function is the debugging path. */
 int get_computer_move(GameState *state, NeuralNetwork *nn, int display_probs) {
     float inputs[NN_INPUT_SIZE];
 
+    if (policy_moves) {
+        int move = policy_moves[board_hash(state)];
+        if (display_probs) printf("Move from the policy table: %d\n\n", move);
+        if (move != -1) return move;
+    }
+    if (!display_probs) return predict_move(nn, state, NULL);
+
     board_to_inputs(state, inputs);
     forward_pass(nn, inputs);
 
-    // Find the highest probability value and best legal move.
-    float highest_prob = -1.0f;
-    int highest_prob_idx = -1;
+    // Find the best legal move.
     int best_move = -1;
-    float best_legal_prob = -1.0f;
-
     for (int i = 0; i < 9; i++) {
-        // Track highest probability overall.
-        if (nn->outputs[i] > highest_prob) {
-            highest_prob = nn->outputs[i];
-            highest_prob_idx = i;
-        }
-
-        // Track best legal move.
         if (state->board[i] == '.' &&
-            (best_move == -1 || nn->outputs[i] > best_legal_prob))
-        {
+            (best_move == -1 || nn->outputs[i] > nn->outputs[best_move]))
             best_move = i;
-            best_legal_prob = nn->outputs[i];
-        }
     }
+    display_move_probs(nn->outputs, best_move);
+    return best_move;
+}
+
+/* ============================== Optimizers ===============================
+ * backprop() and apply_gradients() do plain SGD, unless --optimizer picks
+ * another update rule for the main network:
+ *
+ *   sgd:       w -= lr * g
+ *   momentum:  m = mu*m + g,  w -= lr * m
+ *   adam:      m = b1*m + (1-b1)*g,  v = b2*v + (1-b2)*g^2,
+ *              w -= lr * sqrt(1-b2^t)/(1-b1^t) * m / (sqrt(v) + eps)
+ *
+ * The optimizer state (m, and v for Adam) lives in one 64 byte aligned
+ * buffer with the layout of NeuralGradients: the parameter at offset 'i'
+ * from nn->weights_ih has its state in m[i] and v[i]. Each update is a
+ * single pass where every parameter is read once, its gradient computed
+ * from the deltas (backprop) or read (apply_gradients), and its state and
+ * value written back, instead of a pass to compute the gradients and
+ * another to apply them.
+ *
+ * The state belongs to one network: the copies trained by other threads
+ * (population members, evolution strategies, ...) keep using SGD. */
 
-    // That's just for debugging. It's interesting to show to user
-    // in the first iterations of the game, since you can see how initially
-    // the net picks illegal moves as best, and so forth.
-    if (display_probs) {
-        printf("Neural network move probabilities:\n");
-        for (int row = 0; row < 3; row++) {
-            for (int col = 0; col < 3; col++) {
-                int pos = row * 3 + col;
+typedef enum { OPT_SGD, OPT_MOMENTUM, OPT_ADAM } OptimizerType;
 
-                // Print probability as percentage.
-                printf("%5.1f%%", nn->outputs[pos] * 100.0f);
+#define OPT_PARAMS (sizeof(NeuralGradients) / sizeof(float))
+#define OPT_STRIDE ((OPT_PARAMS + 15) & ~(size_t)15)   // Aligned v.
+#define OPT_OFFSET(field) (offsetof(NeuralGradients, field) / sizeof(float))
+#define OPT_TINY 1e-30f     // State below this is flushed to 0.
 
-                // Add markers.
-                if (pos == highest_prob_idx) {
-                    printf("*"); // Highest probability overall.
-                }
-                if (pos == best_move) {
-                    printf("#"); // Selected move (highest valid probability).
-                }
-                printf(" ");
-            }
-            printf("\n");
+typedef struct {
+    OptimizerType type;
+    NeuralNetwork *nn;          // The network this state is for.
+    float learning_rate;        // Used instead of the caller's.
+    float momentum;
+    float beta1, beta2, eps;
+    uint64_t step;
+    float *state;               // m, then v: OPT_STRIDE floats each.
+} Optimizer;
+
+Optimizer *optimizer = NULL;
+
+/* The default learning rates are the best we found training against
+ * random (--opt-lr overrides them). On that task plain SGD still learns
+ * fastest: the targets move with the policy, and the history kept by
+ * momentum and Adam is mostly stale. */
+Optimizer *optimizer_create(const char *name, NeuralNetwork *nn) {
+    Optimizer *o = calloc(1, sizeof(*o));
+    if (!strcmp(name, "sgd")) {
+        o->type = OPT_SGD;
+        o->learning_rate = LEARNING_RATE;
+    } else if (!strcmp(name, "momentum")) {
+        o->type = OPT_MOMENTUM;
+        o->learning_rate = 0.003f;
+        o->momentum = 0.9f;
+    } else if (!strcmp(name, "adam")) {
+        o->type = OPT_ADAM;
+        o->learning_rate = 0.001f;
+        o->beta1 = 0.9f;
+        o->beta2 = 0.999f;
+        o->eps = 1e-8f;
+    } else {
+        free(o);
+        return NULL;
+    }
+    o->nn = nn;
+    o->state = aligned_alloc(64, sizeof(float) * OPT_STRIDE * 2);
+    memset(o->state, 0, sizeof(float) * OPT_STRIDE * 2);
+    return o;
+}
+
+/* Update 'n' parameters 'w', with state 'm' and 'v', using the gradients
+ * scale*g[i]. 'lr' already has Adam's bias correction. With 'metrics'
+ * set returns the sum of the squared changes, else 0. Forced inline so
+ * that the callers' constant 'n' and 'metrics' give straight loops, with
+ * no reduction when the metrics are off. GCC vectorizes them all at -O2,
+ * Adam's only with -fno-math-errno: otherwise sqrt() must be able to set
+ * errno, and that keeps it scalar.
+ *
+ * The state of a parameter that stops getting gradients decays toward
+ * 0 and would end up denormal, that is many times slower to compute
+ * with on most CPUs: it is flushed to 0 instead. */
+static inline __attribute__((always_inline))
+float optimizer_kernel(const Optimizer *o, float lr, float *restrict w,
+                       float *restrict m, float *restrict v, float scale,
+                       const float *restrict g, int n, int metrics)
+{
+    float sq = 0;
+    switch (o->type) {
+    case OPT_SGD:
+        for (int i = 0; i < n; i++) {
+            float d = lr * scale * g[i];
+            w[i] -= d;
+            if (metrics) sq += d * d;
+        }
+        break;
+    case OPT_MOMENTUM:
+        for (int i = 0; i < n; i++) {
+            float mi = o->momentum * m[i] + scale * g[i];
+            m[i] = fabsf(mi) < OPT_TINY ? 0 : mi;
+            float d = lr * m[i];
+            w[i] -= d;
+            if (metrics) sq += d * d;
+        }
+        break;
+    case OPT_ADAM:
+        for (int i = 0; i < n; i++) {
+            float gi = scale * g[i];
+            float mi = o->beta1 * m[i] + (1 - o->beta1) * gi;
+            float vi = o->beta2 * v[i] + (1 - o->beta2) * gi * gi;
+            m[i] = fabsf(mi) < OPT_TINY ? 0 : mi;
+            v[i] = vi < OPT_TINY ? 0 : vi;
+            float d = lr * m[i] / (__builtin_sqrtf(v[i]) + o->eps);
+            w[i] -= d;
+            if (metrics) sq += d * d;
         }
+        break;
+    }
+    return sq;
+}
 
-        // Sum of probabilities should be 1.0, hopefully.
-        // Just debugging.
-        float total_prob = 0.0f;
-        for (int i = 0; i < 9; i++)
-            total_prob += nn->outputs[i];
-        printf("Sum of all probabilities: %.2f\n\n", total_prob);
+/* Start a new step, returning the learning rate to pass to the kernel. */
+float optimizer_step(Optimizer *o) {
+    o->step++;
+    if (o->type != OPT_ADAM) return o->learning_rate;
+    return o->learning_rate * sqrtf(1 - powf(o->beta2, o->step)) /
+           (1 - powf(o->beta1, o->step));
+}
+
+/* One pass of optimizer_backprop(), see optimizer_kernel() for 'metrics'. */
+static inline __attribute__((always_inline))
+float optimizer_backprop_pass(Optimizer *o, NeuralNetwork *nn, float lr,
+                              float *output_deltas, float *hidden_deltas,
+                              float scale, int metrics)
+{
+    float one = 1, sq = 0;
+    float *w = nn->weights_ih, *m = o->state, *v = o->state + OPT_STRIDE;
+
+#define OPT_UPDATE(field, off, scale, grad, n) \
+    sq += optimizer_kernel(o, lr, w + OPT_OFFSET(field) + (off), \
+                           m + OPT_OFFSET(field) + (off), \
+                           v + OPT_OFFSET(field) + (off), scale, grad, n, \
+                           metrics)
+    for (int i = 0; i < NN_HIDDEN_SIZE; i++)
+        OPT_UPDATE(weights_ho, i*NN_OUTPUT_SIZE, scale * nn->hidden[i],
+                   output_deltas, NN_OUTPUT_SIZE);
+    OPT_UPDATE(biases_o, 0, scale, output_deltas, NN_OUTPUT_SIZE);
+    OPT_UPDATE(weights_hv, 0, scale * nn->value_error, nn->hidden, NN_HIDDEN_SIZE);
+    OPT_UPDATE(bias_v, 0, scale * nn->value_error, &one, 1);
+    /* The rows of the empty tiles have no gradient: they are left alone
+     * (a lazy update, like sparse optimizers do), which is also half of
+     * the work skipped. */
+    for (int i = 0; i < NN_INPUT_SIZE; i++) {
+        if (nn->inputs[i] == 0) continue;
+        OPT_UPDATE(weights_ih, i*NN_HIDDEN_SIZE, scale * nn->inputs[i],
+                   hidden_deltas, NN_HIDDEN_SIZE);
     }
-    return best_move;
+    OPT_UPDATE(biases_h, 0, scale, hidden_deltas, NN_HIDDEN_SIZE);
+#undef OPT_UPDATE
+    return sq;
+}
+
+/* The update of backprop(), with the gradients computed on the fly from
+ * the deltas and the activations of the last forward pass. The optimizer
+ * has its own learning rate: the caller's one, relative to LEARNING_RATE,
+ * becomes 'scale', that multiplies the gradients, so that the callers
+ * changing it (learn_symmetric(), the parameter server averaging pushes)
+ * keep working the same. */
+void optimizer_backprop(Optimizer *o, NeuralNetwork *nn, float *output_deltas,
+                        float *hidden_deltas, float scale)
+{
+    float lr = optimizer_step(o);
+    if (thread_metrics)
+        metrics_update(sqrtf(optimizer_backprop_pass(o, nn, lr, output_deltas,
+                                                     hidden_deltas, scale, 1)));
+    else
+        optimizer_backprop_pass(o, nn, lr, output_deltas, hidden_deltas,
+                                scale, 0);
+}
+
+/* The update of apply_gradients(): the layouts match, so a single loop.
+ * 'scale' as in optimizer_backprop(). */
+void optimizer_apply(Optimizer *o, NeuralNetwork *nn, NeuralGradients *grad,
+                     float scale)
+{
+    float lr = optimizer_step(o);
+    float *w = nn->weights_ih, *m = o->state, *v = o->state + OPT_STRIDE;
+    if (thread_metrics)
+        metrics_update(sqrtf(optimizer_kernel(o, lr, w, m, v, scale,
+                                              (float*)grad, OPT_PARAMS, 1)));
+    else
+        optimizer_kernel(o, lr, w, m, v, scale, (float*)grad, OPT_PARAMS, 0);
 }
 
-/* Backpropagation function.
+/* Compute the output and hidden layer deltas for the last forward pass.
  * The only difference here from vanilla backprop is that we have
  * a 'reward_scaling' argument that makes the output error more/less
  * dramatic, so that we can adjust the weights proportionally to the
  * reward we want to provide. */
-void backprop(NeuralNetwork *nn, float *target_probs, float learning_rate, float reward_scaling) {
-    float output_deltas[NN_OUTPUT_SIZE];
-    float hidden_deltas[NN_HIDDEN_SIZE];
-
-    /* === STEP 1: Compute deltas === */
-
+void compute_deltas(NeuralNetwork *nn, float *target_probs, float reward_scaling,
+                    float *output_deltas, float *hidden_deltas)
+{
     /* Calculate output layer deltas:
      * Note what's going on here: we are technically using softmax
      * as output function and cross entropy as loss, but we never use
@@ -318,19 +1065,34 @@ void backprop(NeuralNetwork *nn, float *target_probs, float learning_rate, float
      *
      * LEARNING OPPORTUNITY: This is a well established and fundamental
      * result in neural networks, you may want to read more about it. */
-    for (int i = 0; i < NN_OUTPUT_SIZE; i++) {
-        output_deltas[i] =
-            (nn->outputs[i] - target_probs[i]) * fabsf(reward_scaling);
-    }
+    softmax_xent_delta(nn->raw_logits, target_probs, fabsf(reward_scaling),
+                       output_deltas, NN_OUTPUT_SIZE);
 
-    // Backpropagate error to hidden layer.
+    // Backpropagate error to hidden layer, from both heads.
     for (int i = 0; i < NN_HIDDEN_SIZE; i++) {
-        float error = 0;
+        float error = nn->value_error * nn->weights_hv[i];
         for (int j = 0; j < NN_OUTPUT_SIZE; j++) {
             error += output_deltas[j] * nn->weights_ho[i * NN_OUTPUT_SIZE + j];
         }
         hidden_deltas[i] = error * relu_derivative(nn->hidden[i]);
     }
+}
+
+/* Backpropagation function: compute the deltas and update the weights
+ * right away (plain online SGD). */
+void backprop(NeuralNetwork *nn, float *target_probs, float learning_rate, float reward_scaling) {
+    float output_deltas[NN_OUTPUT_SIZE];
+    float hidden_deltas[NN_HIDDEN_SIZE];
+
+    /* === STEP 1: Compute deltas === */
+    compute_deltas(nn, target_probs, reward_scaling, output_deltas, hidden_deltas);
+
+    /* With --optimizer, its fused update replaces all the following. */
+    if (optimizer && optimizer->nn == nn) {
+        optimizer_backprop(optimizer, nn, output_deltas, hidden_deltas,
+                           learning_rate / LEARNING_RATE);
+        return;
+    }
 
     /* === STEP 2: Weights updating === */
 
@@ -345,6 +1107,13 @@ void backprop(NeuralNetwork *nn, float *target_probs, float learning_rate, float
         nn->biases_o[j] -= learning_rate * output_deltas[j];
     }
 
+    // Value head, if there is a value error.
+    if (nn->value_error != 0) {
+        for (int i = 0; i < NN_HIDDEN_SIZE; i++)
+            nn->weights_hv[i] -= learning_rate * nn->value_error * nn->hidden[i];
+        nn->bias_v -= learning_rate * nn->value_error;
+    }
+
     // Hidden layer weights and biases.
     for (int i = 0; i < NN_INPUT_SIZE; i++) {
         for (int j = 0; j < NN_HIDDEN_SIZE; j++) {
@@ -355,32 +1124,265 @@ void backprop(NeuralNetwork *nn, float *target_probs, float learning_rate, float
     for (int j = 0; j < NN_HIDDEN_SIZE; j++) {
         nn->biases_h[j] -= learning_rate * hidden_deltas[j];
     }
+
+    /* Every layer update is an outer product (plus the biases), so the
+     * norm of the whole update comes from the norms of the deltas and of
+     * the activations, without a pass over the weights. */
+    if (thread_metrics) {
+        float out = 0, hid = 0, act_h = 1, act_in = 1;
+        for (int j = 0; j < NN_OUTPUT_SIZE; j++) out += output_deltas[j] * output_deltas[j];
+        for (int j = 0; j < NN_HIDDEN_SIZE; j++) {
+            hid += hidden_deltas[j] * hidden_deltas[j];
+            act_h += nn->hidden[j] * nn->hidden[j];
+        }
+        for (int i = 0; i < NN_INPUT_SIZE; i++) act_in += nn->inputs[i] * nn->inputs[i];
+        float value = nn->value_error * nn->value_error;
+        metrics_update(learning_rate *
+                       sqrtf((out + value) * act_h + hid * act_in));
+    }
 }
 
-/* Train the neural network based on game outcome.
- *
- * The move_history is just an integer array with the index of all the
- * moves. This function is designed so that you can specify if the
- * game was started by the move by the NN or human, but actually the
- * code always let the human move first. */
-void learn_from_game(NeuralNetwork *nn, int *move_history, int num_moves, int nn_moves_even, char winner) {
-    // Determine reward based on game outcome
-    float reward;
-    char nn_symbol = nn_moves_even ? 'O' : 'X';
+/* Like backprop(), but instead of updating the weights, add the gradients
+ * of the last forward pass to 'grad'. The weights are left untouched, so
+ * many calls against the same weights can be summed, possibly by
+ * different threads on their own copy of the network. */
+void accumulate_gradients(NeuralNetwork *nn, NeuralGradients *grad,
+                          float *target_probs, float reward_scaling)
+{
+    float output_deltas[NN_OUTPUT_SIZE];
+    float hidden_deltas[NN_HIDDEN_SIZE];
 
-    if (winner == 'T') {
-        reward = 0.3f;  // Small reward for draw
-    } else if (winner == nn_symbol) {
-        reward = 1.0f;  // Large reward for win
-    } else {
-        reward = -2.0f; // Negative reward for loss
+    compute_deltas(nn, target_probs, reward_scaling, output_deltas, hidden_deltas);
+
+    for (int i = 0; i < NN_HIDDEN_SIZE; i++) {
+        for (int j = 0; j < NN_OUTPUT_SIZE; j++) {
+            grad->weights_ho[i * NN_OUTPUT_SIZE + j] +=
+                output_deltas[j] * nn->hidden[i];
+        }
     }
+    for (int j = 0; j < NN_OUTPUT_SIZE; j++)
+        grad->biases_o[j] += output_deltas[j];
 
-    GameState state;
-    float target_probs[NN_OUTPUT_SIZE];
+    if (nn->value_error != 0) {
+        for (int i = 0; i < NN_HIDDEN_SIZE; i++)
+            grad->weights_hv[i] += nn->value_error * nn->hidden[i];
+        grad->bias_v += nn->value_error;
+    }
 
-    // Process each move the neural network made.
-    for (int move_idx = 0; move_idx < num_moves; move_idx++) {
+    for (int i = 0; i < NN_INPUT_SIZE; i++) {
+        /* Inputs are 0/1 and mostly zero (empty tiles), skipping them
+         * saves most of the work. */
+        if (nn->inputs[i] == 0) continue;
+        for (int j = 0; j < NN_HIDDEN_SIZE; j++) {
+            grad->weights_ih[i * NN_HIDDEN_SIZE + j] +=
+                hidden_deltas[j] * nn->inputs[i];
+        }
+    }
+    for (int j = 0; j < NN_HIDDEN_SIZE; j++)
+        grad->biases_h[j] += hidden_deltas[j];
+}
+
+/* Add 'src' gradients to 'dst'. */
+void merge_gradients(NeuralGradients *dst, NeuralGradients *src) {
+    float *d = (float*)dst, *s = (float*)src;
+    int count = sizeof(NeuralGradients) / sizeof(float);
+    for (int i = 0; i < count; i++) d[i] += s[i];
+}
+
+/* Update the weights with the accumulated gradients. Weights and
+ * gradients have the same layout, so this is a single loop. */
+void apply_gradients(NeuralNetwork *nn, NeuralGradients *grad, float learning_rate) {
+    if (optimizer && optimizer->nn == nn) {
+        optimizer_apply(optimizer, nn, grad, learning_rate / LEARNING_RATE);
+        return;
+    }
+
+    float *w = nn->weights_ih, *g = (float*)grad;
+    int count = sizeof(NeuralGradients) / sizeof(float);
+    for (int i = 0; i < count; i++) w[i] -= learning_rate * g[i];
+
+    if (thread_metrics) {
+        float sq = 0;
+        for (int i = 0; i < count; i++) sq += g[i] * g[i];
+        metrics_update(learning_rate * sqrtf(sq));
+    }
+}
+
+/* Reward of a finished game for the player using 'nn_symbol'. */
+float game_reward(const LearnParams *lp, char winner, char nn_symbol) {
+    if (winner == 'T') {
+        return lp->reward_draw;     // Small reward for draw
+    } else if (winner == nn_symbol) {
+        return lp->reward_win;      // Large reward for win
+    } else {
+        return lp->reward_loss;     // Negative reward for loss
+    }
+}
+
+/* Fill 'target_probs' with the training target for 'move', played as
+ * move number 'move_idx' on the board 'state' (before the move). */
+void move_targets(GameState *state, int move, int move_idx,
+                  float scaled_reward, float *target_probs)
+{
+    /* Create target probability distribution:
+     * let's start with the logits all set to 0. */
+    for (int i = 0; i < NN_OUTPUT_SIZE; i++)
+        target_probs[i] = 0;
+
+    /* Set the target for the chosen move based on reward: */
+    if (scaled_reward >= 0) {
+        /* For positive reward, set probability of the chosen move to
+         * 1, with all the rest set to 0. */
+        target_probs[move] = 1;
+    } else {
+        /* For negative reward, distribute probability to OTHER
+         * valid moves, which is conceptually the same as discouraging
+         * the move that we want to discourage. */
+        int valid_moves_left = 9-move_idx-1;
+        float other_prob = 1.0f / valid_moves_left;
+        for (int i = 0; i < 9; i++) {
+            if (state->board[i] == '.' && i != move) {
+                target_probs[i] = other_prob;
+            }
+        }
+    }
+}
+
+/* Temporal difference learning (--td lambda). Without it every move of
+ * a game is pushed toward or away from by the final reward, weighted by
+ * how late in the game it was (see learn_from_game()). With it the value
+ * head learns to predict the reward from a position, and each move is
+ * judged by its advantage: how much better things went after it than the
+ * value head expected before it. A good move in a lost game is then no
+ * longer punished, and a lucky one in a won game no longer rewarded.
+ *
+ * The value target of the position before the NN move 'k' is the
+ * lambda-return, computed backward from the end of the game:
+ *
+ *     G[last] = reward
+ *     G[k] = (1-lambda) * V(next position) + lambda * G[k+1]
+ *
+ * lambda = 0 is TD(0), bootstrapping only from the next value estimate,
+ * lambda = 1 is the plain final reward (Monte Carlo). The value error is
+ * backpropagated together with the policy error, through the same hidden
+ * layer, scaled by TD_VALUE_WEIGHT. */
+#define TD_VALUE_WEIGHT 0.1f
+float td_lambda = -1;       // Negative: TD disabled.
+
+/* Fill 'values' and 'returns' (indexed by move, like move_history) for
+ * the NN moves of a game, see above. */
+void td_returns(NeuralNetwork *nn, int *move_history, int num_moves,
+                int nn_moves_even, float reward, float *values,
+                float *returns)
+{
+    GameState state;
+    float inputs[NN_INPUT_SIZE];
+    int last = -1;
+
+    init_game(&state);
+    for (int move_idx = 0; move_idx < num_moves; move_idx++) {
+        if ((move_idx & 1) == (nn_moves_even ? 1 : 0)) {
+            board_to_inputs(&state, inputs);
+            forward_logits(nn, inputs);
+            values[move_idx] = nn->value;
+        }
+        make_move(&state, move_history[move_idx]);
+    }
+    for (int move_idx = num_moves-1; move_idx >= 0; move_idx--) {
+        if ((move_idx & 1) != (nn_moves_even ? 1 : 0)) continue;
+        if (last == -1)
+            returns[move_idx] = reward;
+        else
+            returns[move_idx] = (1 - td_lambda) * values[last] +
+                                td_lambda * returns[last];
+        last = move_idx;
+    }
+}
+
+/* Symmetry augmentation (--symmetry): the board has 8 symmetries, 4
+ * rotations and 4 reflections, and a good move stays good on the rotated
+ * or reflected board. So every (position, target) pair learned is also
+ * learned in its 7 symmetric variants, for 8 times the training signal
+ * per game played.
+ *
+ * board_symmetries[k][i] is where tile 'i' goes under symmetry 'k'. */
+int learn_symmetries = 0;
+
+const int board_symmetries[8][9] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8},    // Identity.
+    {2, 5, 8, 1, 4, 7, 0, 3, 6},    // Rotate 90 degrees.
+    {8, 7, 6, 5, 4, 3, 2, 1, 0},    // Rotate 180 degrees.
+    {6, 3, 0, 7, 4, 1, 8, 5, 2},    // Rotate 270 degrees.
+    {2, 1, 0, 5, 4, 3, 8, 7, 6},    // Mirror left/right.
+    {6, 7, 8, 3, 4, 5, 0, 1, 2},    // Mirror top/bottom.
+    {0, 3, 6, 1, 4, 7, 2, 5, 8},    // Main diagonal.
+    {8, 5, 2, 7, 4, 1, 6, 3, 0}     // Anti diagonal.
+};
+
+/* Learn 'inputs' -> 'target_probs' and its 7 symmetric variants as one
+ * batch: the gradients of the 8 are summed and scaled by SYMMETRY_SCALE.
+ * So a position moves the weights about 4 times as much as without
+ * augmentation: unscaled training diverges, with 1/8 it is slower than
+ * without symmetries. The scaled sum is applied in a single step, or if
+ * 'grad' is not NULL added there, see learn_from_game(), so that both
+ * paths move the weights by the same amount. */
+#define SYMMETRY_SCALE 0.5f
+
+void learn_symmetric(NeuralNetwork *nn, NeuralGradients *grad, float *inputs,
+                     float *target_probs, float learning_rate,
+                     float reward_scaling, float value_target)
+{
+    NeuralGradients batch;
+    float sym_inputs[NN_INPUT_SIZE], sym_target[NN_OUTPUT_SIZE];
+
+    memset(&batch, 0, sizeof(batch));
+    for (int k = 0; k < 8; k++) {
+        const int *map = board_symmetries[k];
+        for (int i = 0; i < 9; i++) {
+            sym_inputs[map[i]*2] = inputs[i*2];
+            sym_inputs[map[i]*2+1] = inputs[i*2+1];
+            sym_target[map[i]] = target_probs[i];
+        }
+        forward_logits(nn, sym_inputs);
+        if (!isnan(value_target))
+            nn->value_error = TD_VALUE_WEIGHT * (nn->value - value_target);
+        accumulate_gradients(nn, &batch, sym_target, reward_scaling);
+    }
+    if (grad == NULL) {
+        apply_gradients(nn, &batch, learning_rate * SYMMETRY_SCALE);
+        return;
+    }
+    float *d = (float*)grad, *b = (float*)&batch;
+    int count = sizeof(NeuralGradients) / sizeof(float);
+    for (int i = 0; i < count; i++) d[i] += SYMMETRY_SCALE * b[i];
+}
+
+/* Train the neural network based on game outcome.
+ *
+ * The move_history is just an integer array with the index of all the
+ * moves. This function is designed so that you can specify if the
+ * game was started by the move by the NN or human, but actually the
+ * code always let the human move first.
+ *
+ * If 'grad' is NULL the weights are updated after every move, otherwise
+ * the gradients are accumulated into 'grad' and the weights are left
+ * alone, see accumulate_gradients(). 'lp' selects learning rate and
+ * rewards, NULL means default_learn_params. */
+void learn_from_game(NeuralNetwork *nn, NeuralGradients *grad, const LearnParams *lp, int *move_history, int num_moves, int nn_moves_even, char winner) {
+    // Determine reward based on game outcome
+    if (lp == NULL) lp = &default_learn_params;
+    float reward = game_reward(lp, winner, nn_moves_even ? 'O' : 'X');
+
+    GameState state;
+    float target_probs[NN_OUTPUT_SIZE];
+    float values[9], returns[9];
+    int td = td_lambda >= 0;
+
+    if (td) td_returns(nn, move_history, num_moves, nn_moves_even, reward,
+                       values, returns);
+
+    // Process each move the neural network made.
+    for (int move_idx = 0; move_idx < num_moves; move_idx++) {
         // Skip if this wasn't a move by the neural network.
         if ((nn_moves_even && move_idx % 2 != 1) ||
             (!nn_moves_even && move_idx % 2 != 0))
@@ -395,10 +1397,9 @@ void learn_from_game(NeuralNetwork *nn, int *move_history, int num_moves, int nn
             state.board[move_history[i]] = symbol;
         }
 
-        // Convert board to inputs and do forward pass.
+        // Convert board to inputs.
         float inputs[NN_INPUT_SIZE];
         board_to_inputs(&state, inputs);
-        forward_pass(nn, inputs);
 
         /* The move that was actually made by the NN, that is
          * the one we want to reward (positively or negatively). */
@@ -426,76 +1427,128 @@ void learn_from_game(NeuralNetwork *nn, int *move_history, int num_moves, int nn
         float move_importance = 0.5f + 0.5f * (float)move_idx/(float)num_moves;
         float scaled_reward = reward * move_importance;
 
-        /* Create target probability distribution:
-         * let's start with the logits all set to 0. */
-        for (int i = 0; i < NN_OUTPUT_SIZE; i++)
-            target_probs[i] = 0;
-
-        /* Set the target for the chosen move based on reward: */
-        if (scaled_reward >= 0) {
-            /* For positive reward, set probability of the chosen move to
-             * 1, with all the rest set to 0. */
-            target_probs[move] = 1;
-        } else {
-            /* For negative reward, distribute probability to OTHER
-             * valid moves, which is conceptually the same as discouraging
-             * the move that we want to discourage. */
-            int valid_moves_left = 9-move_idx-1;
-            float other_prob = 1.0f / valid_moves_left;
-            for (int i = 0; i < 9; i++) {
-                if (state.board[i] == '.' && i != move) {
-                    target_probs[i] = other_prob;
-                }
-            }
+        /* With --td, the advantage of the move replaces all the above. */
+        float value_target = NAN;
+        if (td) {
+            value_target = returns[move_idx];
+            scaled_reward = returns[move_idx] - values[move_idx];
         }
 
+        move_targets(&state, move, move_idx, scaled_reward, target_probs);
+
         /* Call the generic backpropagation function, using
          * our target logits as target. */
-        backprop(nn, target_probs, LEARNING_RATE, scaled_reward);
+        if (learn_symmetries) {
+            learn_symmetric(nn, grad, inputs, target_probs,
+                            lp->learning_rate, scaled_reward, value_target);
+            continue;
+        }
+        forward_logits(nn, inputs);
+        if (td) nn->value_error = TD_VALUE_WEIGHT * (nn->value - value_target);
+        if (grad)
+            accumulate_gradients(nn, grad, target_probs, scaled_reward);
+        else
+            backprop(nn, target_probs, lp->learning_rate, scaled_reward);
+    }
+}
+
+/* Pondering: while the human thinks, a background thread computes the
+ * reply to every legal human move, so that once the move is entered the
+ * answer is already there. The network is only read (predict_move() and
+ * the policy table), and it is never changed during a game, so the
+ * thread needs no locking: play_game() just joins it after reading the
+ * human move. */
+typedef struct {
+    pthread_t tid;
+    NeuralNetwork *nn;
+    GameState state;        // Human to move.
+    int reply[9];           // Per human move, -1 if illegal or game over.
+    int from_policy[9];     // Reply comes from the policy table.
+    float probs[9][9];      // Network probabilities for the reply.
+} Ponder;
+
+void *ponder_main(void *arg) {
+    Ponder *p = arg;
+    for (int h = 0; h < 9; h++) {
+        GameState s = p->state;
+        char winner;
+
+        p->reply[h] = -1;
+        if (s.board[h] != '.') continue;
+        make_move(&s, h);
+        if (check_move_over(&s, h, &winner)) continue;
+
+        p->from_policy[h] = policy_moves && policy_moves[board_hash(&s)] != -1;
+        if (p->from_policy[h])
+            p->reply[h] = policy_moves[board_hash(&s)];
+        else
+            p->reply[h] = predict_move(p->nn, &s, p->probs[h]);
     }
+    return NULL;
 }
 
-/* Play one game of Tic Tac Toe against the neural network. */
-void play_game(NeuralNetwork *nn) {
+/* Play one game of Tic Tac Toe against the neural network. With 'ponder'
+ * the replies are computed while waiting for the human, see Ponder. */
+void play_game(NeuralNetwork *nn, int ponder) {
     GameState state;
     char winner;
     int move_history[9]; // Maximum 9 moves in a game.
     int num_moves = 0;
+    Ponder p = {.nn = nn};
+    int pondered = 0;       // p.reply[] is valid for the next move.
 
     init_game(&state);
 
     printf("Welcome to Tic Tac Toe! You are X, the computer is O.\n");
     printf("Enter positions as numbers from 0 to 8 (see picture).\n");
 
-    while (!check_game_over(&state, &winner)) {
+    while (1) {
+        int move;
         display_board(&state);
 
         if (state.current_player == 0) {
             // Human turn.
-            int move;
             char movec;
+            int pondering = 0;
+            if (ponder) {
+                /* Without a thread we just don't ponder this move. */
+                p.state = state;
+                pondering = pthread_create(&p.tid, NULL, ponder_main, &p) == 0;
+            }
             printf("Your move (0-8): ");
             scanf(" %c", &movec);
             move = movec-'0'; // Turn character into number.
+            if (pondering) {
+                pthread_join(p.tid, NULL);
+                pondered = 1;
+            }
 
             // Check if move is valid.
             if (move < 0 || move > 8 || state.board[move] != '.') {
                 printf("Invalid move! Try again.\n");
                 continue;
             }
-
-            state.board[move] = 'X';
-            move_history[num_moves++] = move;
         } else {
             // Computer's turn
-            printf("Computer's move:\n");
-            int move = get_computer_move(&state, nn, 1);
-            state.board[move] = 'O';
+            int last = move_history[num_moves-1];
+            if (pondered && p.reply[last] != -1) {
+                move = p.reply[last];
+                printf("Computer's move (pondered):\n");
+                if (p.from_policy[last])
+                    printf("Move from the policy table: %d\n\n", move);
+                else
+                    display_move_probs(p.probs[last], move);
+            } else {
+                printf("Computer's move:\n");
+                move = get_computer_move(&state, nn, 1);
+            }
+            pondered = 0;
             printf("Computer placed O at position %d\n", move);
-            move_history[num_moves++] = move;
         }
 
-        state.current_player = !state.current_player;
+        make_move(&state, move);
+        move_history[num_moves++] = move;
+        if (check_move_over(&state, move, &winner)) break;
     }
 
     display_board(&state);
@@ -507,9 +1560,10 @@ void play_game(NeuralNetwork *nn) {
     } else {
         printf("It's a tie!\n");
     }
+    log_game(move_history, num_moves, winner);
 
     // Learn from this game
-    learn_from_game(nn, move_history, num_moves, 1, winner);
+    learn_from_game(nn, NULL, NULL, move_history, num_moves, 1, winner);
 }
 
 /* Get a random valid move, this is used for training
@@ -536,97 +1590,3887 @@ int get_random_move(GameState *state) {
  * technique, important results were recently obtained using
  * Montecarlo Tree Search (MCTS), where a tree structure repesents
  * potential future game states that are explored according to
- * some selection: you may want to learn about it. */
-char play_random_game(NeuralNetwork *nn, int *move_history, int *num_moves) {
+ * some selection: you may want to learn about it.
+ *
+ * The game itself is played by simulate_random_game(), that does not
+ * touch the weights, so it can also be used for evaluation. */
+char simulate_random_game(NeuralNetwork *nn, int *move_history, int *num_moves) {
     GameState state;
     char winner = 0;
     *num_moves = 0;
 
     init_game(&state);
 
-    while (!check_game_over(&state, &winner)) {
+    while (1) {
         int move;
 
         if (state.current_player == 0) {  // Random player's turn (X)
             move = get_random_move(&state);
         } else {  // Neural network's turn (O)
-            move = get_computer_move(&state, nn, 0);
+            move = predict_move(nn, &state, NULL);
         }
 
         /* Make the move and store it: we need the moves sequence
-         * during the learning stage. */
-        char symbol = (state.current_player == 0) ? 'X' : 'O';
-        state.board[move] = symbol;
+         * during the learning stage. make_move() also switches player. */
+        make_move(&state, move);
         move_history[(*num_moves)++] = move;
-
-        // Switch player.
-        state.current_player = !state.current_player;
+        if (check_move_over(&state, move, &winner)) break;
     }
+    return winner;
+}
+
+char play_random_game(NeuralNetwork *nn, int *move_history, int *num_moves) {
+    char winner = simulate_random_game(nn, move_history, num_moves);
 
     // Learn from this game - neural network is 'O' (even-numbered moves).
-    learn_from_game(nn, move_history, *num_moves, 1, winner);
+    learn_from_game(nn, NULL, NULL, move_history, *num_moves, 1, winner);
     return winner;
 }
 
+/* Play 'num_games' games against the random player without learning,
+ * and report how the network is doing. */
+void evaluate_against_random(NeuralNetwork *nn, int num_games) {
+    int move_history[9];
+    int num_moves;
+    int wins = 0, losses = 0, ties = 0;
+
+    for (int i = 0; i < num_games; i++) {
+        char winner = simulate_random_game(nn, move_history, &num_moves);
+        if (winner == 'O') wins++;
+        else if (winner == 'X') losses++;
+        else ties++;
+    }
+    printf("Evaluation over %d random games: Wins: %d (%.1f%%), "
+           "Losses: %d (%.1f%%), Ties: %d (%.1f%%)\n",
+           num_games, wins, (float)wins * 100 / num_games,
+           losses, (float)losses * 100 / num_games,
+           ties, (float)ties * 100 / num_games);
+}
+
+/* Statistics of the games played while training, provided to the
+ * user (it's fun). The network plays O. */
+typedef struct {
+    int total_games;
+    int played_games;   // Since the last progress report.
+    int wins, losses, ties;
+} TrainStats;
+
+void update_train_stats(TrainStats *ts, char winner) {
+    ts->total_games++;
+    ts->played_games++;
+    if (winner == 'O') {
+        ts->wins++; // Neural network won.
+    } else if (winner == 'X') {
+        ts->losses++; // Random player won.
+    } else {
+        ts->ties++; // Tie.
+    }
+
+    // Show progress every many games to avoid flooding the stdout.
+    if (ts->total_games % 10000 == 0) {
+        printf("Games: %d, Wins: %d (%.1f%%), "
+               "Losses: %d (%.1f%%), Ties: %d (%.1f%%)\n",
+              ts->total_games, ts->wins, (float)ts->wins * 100 / ts->played_games,
+              ts->losses, (float)ts->losses * 100 / ts->played_games,
+              ts->ties, (float)ts->ties * 100 / ts->played_games);
+        ts->played_games = 0;
+        ts->wins = 0;
+        ts->losses = 0;
+        ts->ties = 0;
+    }
+}
+
+/* When not NULL, train_against_random() snapshots the weights here every
+ * 'checkpoint_every' games, see checkpoint.h and --checkpoint. */
+Checkpointer *checkpointer = NULL;
+int checkpoint_every = 10000;
+
+/* When not NULL, the trainers against random hand a copy of the weights
+ * to the evaluator every 'eval_every' games, and stop early once it sets
+ * 'stop_training', see the Evaluator section and --eval. */
+typedef struct Evaluator Evaluator;
+Evaluator *evaluator = NULL;
+int eval_every = 5000;
+atomic_int stop_training;
+
+void evaluator_offer(Evaluator *ev, NeuralNetwork *nn, uint64_t games);
+
 /* Train the neural network against random moves. */
 void train_against_random(NeuralNetwork *nn, int num_games) {
     int move_history[9];
     int num_moves;
-    int wins = 0, losses = 0, ties = 0;
+    TrainStats ts = {0};
 
     printf("Training neural network against %d random games...\n", num_games);
 
-    int played_games = 0;
-    for (int i = 0; i < num_games; i++) {
+    metrics_register();
+    for (int i = 0; i < num_games && !atomic_load(&stop_training); i++) {
         char winner = play_random_game(nn, move_history, &num_moves);
-        played_games++;
+        log_game(move_history, num_moves, winner);
+        update_train_stats(&ts, winner);
+        metrics_game(num_moves, winner, 'O');
+        if (checkpointer && (i+1) % checkpoint_every == 0)
+            checkpoint_take(checkpointer, nn->weights_ih);
+        if (evaluator && (i+1) % eval_every == 0)
+            evaluator_offer(evaluator, nn, i+1);
+    }
+    printf("\nTraining complete!\n");
+}
 
-        // Accumulate statistics that are provided to the user (it's fun).
-        if (winner == 'O') {
-            wins++; // Neural network won.
-        } else if (winner == 'X') {
-            losses++; // Random player won.
-        } else {
-            ties++; // Tie.
+/* Same as train_against_random(), but 'pool_size' games are played in
+ * lockstep with an EnvPool: at every step all the games where the network
+ * is to move are evaluated with a single forward_batch() call, and all
+ * the others get a random move. Finished games are learned as usual,
+ * one at a time, so the weights change while the other games are still
+ * running, exactly like they would between games in the serial loop. */
+void train_against_random_pool(NeuralNetwork *nn, int num_games, int pool_size) {
+    EnvPool *pool = envpool_create(pool_size);
+    int *moves = malloc(sizeof(int) * pool_size);
+    int *idx = malloc(sizeof(int) * pool_size);
+    float *inputs = malloc(sizeof(float) * NN_INPUT_SIZE * pool_size);
+    float *logits = malloc(sizeof(float) * NN_OUTPUT_SIZE * pool_size);
+    TrainStats ts = {0};
+
+    printf("Training neural network against %d random games "
+           "(%d games in parallel)...\n", num_games, pool_size);
+
+    metrics_register();
+    while (ts.total_games < num_games && !atomic_load(&stop_training)) {
+        // Random player's turn (X) in the games where X is to move.
+        int count = envpool_gather(pool, 0, idx);
+        for (int b = 0; b < count; b++)
+            moves[idx[b]] = envpool_random_move(pool, idx[b], rand());
+
+        // Neural network's turn (O): one batched inference for all.
+        count = envpool_gather(pool, 1, idx);
+        envpool_encode(pool, idx, count, inputs);
+        forward_batch(nn, inputs, count, logits);
+        for (int b = 0; b < count; b++) {
+            unsigned legal = envpool_legal(pool, idx[b]);
+            float *l = logits + b*NN_OUTPUT_SIZE;
+            int best = -1;
+            for (int k = 0; k < 9; k++) {
+                if (!(legal & (1<<k))) continue;
+                if (best == -1 || l[k] > l[best]) best = k;
+            }
+            moves[idx[b]] = best;
         }
 
-        // Show progress every many games to avoid flooding the stdout.
-        if ((i + 1) % 10000 == 0) {
-            printf("Games: %d, Wins: %d (%.1f%%), "
-                   "Losses: %d (%.1f%%), Ties: %d (%.1f%%)\n",
-                  i + 1, wins, (float)wins * 100 / played_games,
-                  losses, (float)losses * 100 / played_games,
-                  ties, (float)ties * 100 / played_games);
-            played_games = 0;
-            wins = 0;
-            losses = 0;
-            ties = 0;
+        envpool_step(pool, moves);
+        for (int f = 0; f < pool->num_finished; f++) {
+            EnvPoolResult *res = &pool->finished[f];
+            if (ts.total_games == num_games) break;
+            learn_from_game(nn, NULL, NULL, res->moves, res->num_moves, 1, res->winner);
+            log_game(res->moves, res->num_moves, res->winner);
+            update_train_stats(&ts, res->winner);
+            metrics_game(res->num_moves, res->winner, 'O');
+            if (evaluator && ts.total_games % eval_every == 0)
+                evaluator_offer(evaluator, nn, ts.total_games);
         }
     }
     printf("\nTraining complete!\n");
+
+    free(moves);
+    free(idx);
+    free(inputs);
+    free(logits);
+    envpool_free(pool);
 }
 
-int main(int argc, char **argv) {
-    int random_games = 150000; // Fast and enough to play in a decent way.
+/* ============================== Model files ===============================
+ * A model file is just a small header (magic and layer sizes, so that we
+ * refuse to load a model trained with different defines) followed by the
+ * weights and biases as native floats, in the NeuralNetwork order. */
 
-    if (argc > 1) random_games = atoi(argv[1]);
-    srand(time(NULL));
+#define NN_FILE_MAGIC "TTTNN002"
+#define NN_FILE_MAGIC_V1 "TTTNN001"     // Before the value head.
 
-    // Initialize neural network.
-    NeuralNetwork nn;
-    init_neural_network(&nn);
+/* The header: magic, then the layer sizes. */
+#define NN_FILE_HEADER_SIZE (8 + 3*sizeof(int))
 
-    // Train against random moves.
-    if (random_games > 0) train_against_random(&nn, random_games);
+void neural_network_header(unsigned char *header) {
+    int sizes[3] = {NN_INPUT_SIZE, NN_HIDDEN_SIZE, NN_OUTPUT_SIZE};
+    memcpy(header, NN_FILE_MAGIC, 8);
+    memcpy(header + 8, sizes, sizeof(sizes));
+}
 
-    // Play game with human and learn more.
+int save_neural_network(NeuralNetwork *nn, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return -1;
+
+    unsigned char header[NN_FILE_HEADER_SIZE];
+    neural_network_header(header);
+    int ok = fwrite(header, sizeof(header), 1, fp) == 1 &&
+             fwrite(nn->weights_ih, sizeof(NeuralGradients), 1, fp) == 1;
+    if (fclose(fp) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+/* Checkpoints of a network are compressed model files, written in the
+ * background (see checkpoint.h); load_neural_network() reads both. */
+Checkpointer *checkpoint_neural_network(const char *path) {
+    unsigned char header[NN_FILE_HEADER_SIZE];
+    neural_network_header(header);
+    return checkpoint_create(path, header, sizeof(header), sizeof(NeuralGradients));
+}
+
+int load_neural_network(NeuralNetwork *nn, const char *path) {
+    FILE *fp = checkpoint_fopen(path);
+    if (fp == NULL) return -1;
+
+    /* Files without the value head are still accepted: its weights are
+     * then left as they are. */
+    char magic[8];
+    int sizes[3];
+    size_t len = sizeof(NeuralGradients);
+    int ok = fread(magic, 8, 1, fp) == 1;
+    if (ok && memcmp(magic, NN_FILE_MAGIC_V1, 8) == 0)
+        len = offsetof(NeuralGradients, weights_hv);
+    else if (ok && memcmp(magic, NN_FILE_MAGIC, 8) != 0)
+        ok = 0;
+    ok = ok && fread(sizes, sizeof(sizes), 1, fp) == 1 &&
+         sizes[0] == NN_INPUT_SIZE &&
+         sizes[1] == NN_HIDDEN_SIZE &&
+         sizes[2] == NN_OUTPUT_SIZE &&
+         fread(nn->weights_ih, len, 1, fp) == 1;
+    fclose(fp);
+    if (!ok) errno = EINVAL;
+    return ok ? 0 : -1;
+}
+
+/* ============================ Offline training ============================
+ * Train from a game log recorded with --log, instead of playing games
+ * with the network in the loop. The log is split into mini batches of
+ * 'batch' games. Every batch is sharded across the worker threads: each
+ * one copies the current weights into its private network (forward_pass()
+ * stores the activations in the structure, so a network can't be shared),
+ * replays its games with learn_from_game() accumulating the gradients,
+ * and then the main thread merges the per thread gradients and applies
+ * their average to the master network.
+ *
+ * Note that the recorded moves were chosen by whatever policy was playing
+ * when the log was written, so this is off policy: it works well with
+ * logs of the network playing against random, and it is a way to retrain
+ * or tune hyper parameters over a fixed dataset at memory bandwidth. */
+
+typedef struct {
+    pthread_t tid;
+    int id;
+    struct OfflineTrainer *ot;
+    NeuralNetwork nn;           // Private copy of the master weights.
+    NeuralGradients grad;       // Gradients accumulated this batch.
+    uint64_t invalid;           // Invalid records skipped, all epochs.
+} OfflineWorker;
+
+typedef struct OfflineTrainer {
+    GameLogReader *log;
+    NeuralNetwork *master;
+    int nn_moves_even;          // 1 to learn O moves, 0 to learn X moves.
+    int num_threads;
+    uint64_t batch_first;       // First record of the current batch.
+    uint64_t batch_len;         // Records in the current batch.
+    int done;                   // Set by the main thread to stop workers.
+    pthread_barrier_t start, end;
+    OfflineWorker *workers;
+} OfflineTrainer;
+
+/* Replay this worker's share of the current batch. */
+void offline_worker_batch(OfflineWorker *w) {
+    OfflineTrainer *ot = w->ot;
+    uint64_t lo = ot->batch_first + ot->batch_len * w->id / ot->num_threads;
+    uint64_t hi = ot->batch_first + ot->batch_len * (w->id+1) / ot->num_threads;
+    GameLogIter it;
+    int moves[9];
+    char winner;
+
+    memcpy(w->nn.weights_ih, ot->master->weights_ih, sizeof(NeuralGradients));
+    memset(&w->grad, 0, sizeof(w->grad));
+    gamelog_iter_seek(&it, ot->log, lo);
+    for (uint64_t i = lo; i < hi; i++) {
+        const unsigned char *rec = gamelog_next(&it);
+        int num_moves = gamelog_decode(rec, moves, &winner);
+        if (num_moves == -1) {          // Bad moves, see gamelog_decode().
+            w->invalid++;
+            continue;
+        }
+        if (winner == '?') continue;    // Unfinished or corrupted game.
+        learn_from_game(&w->nn, &w->grad, NULL, moves, num_moves,
+                        ot->nn_moves_even, winner);
+    }
+}
+
+void *offline_worker_main(void *arg) {
+    OfflineWorker *w = arg;
     while(1) {
-        char play_again;
-        play_game(&nn);
+        pthread_barrier_wait(&w->ot->start);
+        if (w->ot->done) break;
+        offline_worker_batch(w);
+        pthread_barrier_wait(&w->ot->end);
+    }
+    return NULL;
+}
 
-        printf("Play again? (y/n): ");
-        scanf(" %c", &play_again);
-        if (play_again != 'y' && play_again != 'Y') break;
+/* Train 'nn' for 'epochs' passes over the log at 'path'. Batches are
+ * visited in a different random order every epoch. Returns -1 if the
+ * log can't be opened. */
+int train_from_log(NeuralNetwork *nn, const char *path, int num_threads,
+                   int batch, int epochs, float learning_rate, int nn_moves_even)
+{
+    OfflineTrainer ot;
+    ot.log = gamelog_open(path, 1);
+    if (ot.log == NULL) return -1;
+    if (num_threads < 1) num_threads = 1;
+    if (batch < 1) batch = 1;
+
+    ot.master = nn;
+    ot.nn_moves_even = nn_moves_even;
+    ot.num_threads = num_threads;
+    ot.done = 0;
+    ot.workers = malloc(sizeof(OfflineWorker) * num_threads);
+    pthread_barrier_init(&ot.start, NULL, num_threads+1);
+    pthread_barrier_init(&ot.end, NULL, num_threads+1);
+    for (int j = 0; j < num_threads; j++) {
+        ot.workers[j].id = j;
+        ot.workers[j].ot = &ot;
+        ot.workers[j].invalid = 0;
+        pthread_create(&ot.workers[j].tid, NULL, offline_worker_main,
+                       &ot.workers[j]);
     }
+
+    uint64_t num_records = ot.log->num_records;
+    uint64_t num_batches = (num_records + batch - 1) / batch;
+    uint64_t *order = malloc(sizeof(uint64_t) * (num_batches ? num_batches : 1));
+    for (uint64_t b = 0; b < num_batches; b++) order[b] = b;
+
+    printf("Training from %s: %llu games, %d threads, batch %d, "
+           "%d epochs, learning rate %g\n", path,
+           (unsigned long long)num_records, num_threads, batch, epochs,
+           learning_rate);
+
+    for (int epoch = 0; epoch < epochs; epoch++) {
+        clock_t t0 = clock();
+        for (uint64_t b = num_batches; b > 1; b--) {
+            uint64_t k = (((uint64_t)rand() << 31) ^ rand()) % b;
+            uint64_t tmp = order[b-1]; order[b-1] = order[k]; order[k] = tmp;
+        }
+
+        for (uint64_t b = 0; b < num_batches; b++) {
+            ot.batch_first = order[b] * batch;
+            ot.batch_len = num_records - ot.batch_first;
+            if (ot.batch_len > (uint64_t)batch) ot.batch_len = batch;
+
+            pthread_barrier_wait(&ot.start);
+            pthread_barrier_wait(&ot.end);
+
+            /* Average over the games of the batch, so that the learning
+             * rate does not need to change with the batch size. */
+            for (int j = 1; j < num_threads; j++)
+                merge_gradients(&ot.workers[0].grad, &ot.workers[j].grad);
+            apply_gradients(nn, &ot.workers[0].grad,
+                            learning_rate / ot.batch_len);
+        }
+
+        double elapsed = (double)(clock() - t0) / CLOCKS_PER_SEC;
+        printf("Epoch %d done (%.2f sec CPU). ", epoch+1, elapsed);
+        evaluate_against_random(nn, 10000);
+    }
+
+    ot.done = 1;
+    pthread_barrier_wait(&ot.start);
+    uint64_t invalid = 0;
+    for (int j = 0; j < num_threads; j++) {
+        pthread_join(ot.workers[j].tid, NULL);
+        invalid += ot.workers[j].invalid;
+    }
+    if (invalid)
+        printf("Skipped %llu invalid records per epoch.\n",
+               (unsigned long long)(invalid / epochs));
+    pthread_barrier_destroy(&ot.start);
+    pthread_barrier_destroy(&ot.end);
+    free(ot.workers);
+    free(order);
+    gamelog_release(ot.log);
     return 0;
-}
\ No newline at end of file
+}
+
+/* =========================== Actor / learner mode ==========================
+ * Game generation and learning run on different threads. Actor threads
+ * play against random using a read-only snapshot of the weights, and push
+ * the finished games into their own bounded queue. The learner (the main
+ * thread) drains the queues, runs learn_from_game() on its private
+ * network, and every 'publish_every' games publishes a new snapshot.
+ *
+ * Nothing here makes an actor wait for the learner:
+ *
+ * - Every actor has a single producer / single consumer ring, so pushing
+ *   a game is two atomic operations. If the ring is full the game is
+ *   dropped (and counted): actors going faster than the learner can
+ *   consume is a signal to lower the actor/learner ratio, not a reason
+ *   to stall.
+ *
+ * - Snapshots are published RCU style: the learner copies its weights
+ *   into a free snapshot buffer and swaps the 'published' pointer. Each
+ *   actor announces the snapshot it is reading in its 'reading' slot for
+ *   the duration of a game. A buffer can be reused only when it is not
+ *   published and no actor is reading it. With N actors at most N
+ *   buffers are being read and one is published, so N+2 buffers
+ *   guarantee the learner always finds a free one without waiting. */
+
+#define TRAJ_QUEUE_SIZE 64 // Must be a power of two. Small = fresher games.
+
+typedef struct {
+    int moves[9];
+    int num_moves;
+    char winner;
+} Trajectory;
+
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_ulong head; // Next slot to write (actor).
+    _Alignas(CACHE_LINE) atomic_ulong tail; // Next slot to read (learner).
+    Trajectory slots[TRAJ_QUEUE_SIZE];
+} TrajectoryQueue;
+
+typedef struct {
+    pthread_t tid;
+    struct ActorLearner *al;
+    unsigned seed;                          // For rand_r().
+    _Alignas(CACHE_LINE) NeuralNetwork *_Atomic reading;
+    atomic_ulong played;
+    atomic_ulong dropped;
+    TrajectoryQueue queue;
+} Actor;
+
+typedef struct ActorLearner {
+    NeuralNetwork *_Atomic published;       // Current snapshot.
+    NeuralNetwork *snapshots;               // num_actors+2 buffers.
+    int num_snapshots;
+    Actor *actors;
+    int num_actors;
+    atomic_int stop;
+} ActorLearner;
+
+/* Get a random valid move using the actor private seed. */
+int actor_random_move(GameState *state, unsigned *seed) {
+    while(1) {
+        int move = rand_r(seed) % 9;
+        if (state->board[move] == '.') return move;
+    }
+}
+
+/* Play a game against random with the snapshot 'nn', that is only read:
+ * predict_move() does not touch the network. */
+void actor_play_game(NeuralNetwork *nn, unsigned *seed, Trajectory *t) {
+    GameState state;
+
+    init_game(&state);
+    t->num_moves = 0;
+    while (1) {
+        int move;
+        if (state.current_player == 0) {
+            move = actor_random_move(&state, seed);
+        } else {
+            move = predict_move(nn, &state, NULL);
+        }
+        make_move(&state, move);
+        t->moves[t->num_moves++] = move;
+        if (check_move_over(&state, move, &t->winner)) break;
+    }
+}
+
+void *actor_main(void *arg) {
+    Actor *a = arg;
+    ActorLearner *al = a->al;
+
+    metrics_register();
+    while (!atomic_load(&al->stop)) {
+        /* Pin the current snapshot. Re-checking 'published' after the
+         * announcement closes the race with a learner that recycled the
+         * buffer between our load and our store. */
+        NeuralNetwork *nn;
+        do {
+            nn = atomic_load(&al->published);
+            atomic_store(&a->reading, nn);
+        } while (nn != atomic_load(&al->published));
+
+        unsigned long head = atomic_load_explicit(&a->queue.head, memory_order_relaxed);
+        unsigned long tail = atomic_load_explicit(&a->queue.tail, memory_order_acquire);
+        Trajectory *t = &a->queue.slots[head & (TRAJ_QUEUE_SIZE-1)];
+        Trajectory scratch;
+        int full = head - tail == TRAJ_QUEUE_SIZE;
+
+        Trajectory *played = full ? &scratch : t;
+        actor_play_game(nn, &a->seed, played);
+        atomic_store(&a->reading, NULL);
+        atomic_fetch_add_explicit(&a->played, 1, memory_order_relaxed);
+
+        /* Only the games the learner gets count in the metrics, the
+         * dropped ones are not training. */
+        if (full) {
+            atomic_fetch_add_explicit(&a->dropped, 1, memory_order_relaxed);
+        } else {
+            metrics_game(played->num_moves, played->winner, 'O');
+            atomic_store_explicit(&a->queue.head, head+1, memory_order_release);
+        }
+    }
+    return NULL;
+}
+
+/* Copy the learner weights into a free snapshot buffer and publish it. */
+void publish_snapshot(ActorLearner *al, NeuralNetwork *nn) {
+    NeuralNetwork *current = atomic_load(&al->published);
+    for (int s = 0; s < al->num_snapshots; s++) {
+        NeuralNetwork *buf = &al->snapshots[s];
+        if (buf == current) continue;
+        int busy = 0;
+        for (int j = 0; j < al->num_actors; j++)
+            if (atomic_load(&al->actors[j].reading) == buf) busy = 1;
+        if (busy) continue;
+
+        memcpy(buf->weights_ih, nn->weights_ih, sizeof(NeuralGradients));
+        atomic_store(&al->published, buf);
+        return;
+    }
+    /* Unreachable with num_actors+2 buffers, see the comment above. */
+    fprintf(stderr, "No free snapshot buffer\n");
+    abort();
+}
+
+/* Learn from 'num_games' games produced by 'num_actors' actor threads. */
+void train_actor_learner(NeuralNetwork *nn, int num_games, int num_actors,
+                         int publish_every)
+{
+    ActorLearner al;
+    TrainStats ts = {0};
+    int publications = 0;
+
+    if (num_actors < 1) num_actors = 1;
+    if (publish_every < 1) publish_every = 1;
+    al.num_actors = num_actors;
+    al.num_snapshots = num_actors+2;
+    al.snapshots = aligned_alloc(CACHE_LINE,
+        ((sizeof(NeuralNetwork)*al.num_snapshots) + CACHE_LINE-1) & ~(CACHE_LINE-1));
+    al.actors = aligned_alloc(CACHE_LINE, sizeof(Actor)*num_actors);
+    atomic_init(&al.stop, 0);
+    atomic_init(&al.published, NULL);
+    publish_snapshot(&al, nn);
+
+    printf("Training neural network against %d random games "
+           "(%d actors, publishing every %d games)...\n",
+           num_games, num_actors, publish_every);
+
+    metrics_register();     // The learner: updates only, actors play.
+    clock_t t0 = clock();
+    time_t wall0 = time(NULL);
+    for (int j = 0; j < num_actors; j++) {
+        Actor *a = &al.actors[j];
+        a->al = &al;
+        a->seed = rand();
+        atomic_init(&a->reading, NULL);
+        atomic_init(&a->played, 0);
+        atomic_init(&a->dropped, 0);
+        atomic_init(&a->queue.head, 0);
+        atomic_init(&a->queue.tail, 0);
+        pthread_create(&a->tid, NULL, actor_main, a);
+    }
+
+    int since_publish = 0;
+    while (ts.total_games < num_games && !atomic_load(&stop_training)) {
+        int consumed = 0;
+        for (int j = 0; j < num_actors && ts.total_games < num_games; j++) {
+            TrajectoryQueue *q = &al.actors[j].queue;
+            unsigned long tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+            unsigned long head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+            while (tail != head && ts.total_games < num_games) {
+                Trajectory *t = &q->slots[tail & (TRAJ_QUEUE_SIZE-1)];
+                learn_from_game(nn, NULL, NULL, t->moves, t->num_moves, 1, t->winner);
+                log_game(t->moves, t->num_moves, t->winner);
+                update_train_stats(&ts, t->winner);
+                tail++;
+                consumed++;
+                if (++since_publish == publish_every) {
+                    publish_snapshot(&al, nn);
+                    publications++;
+                    since_publish = 0;
+                }
+                if (evaluator && ts.total_games % eval_every == 0)
+                    evaluator_offer(evaluator, nn, ts.total_games);
+            }
+            atomic_store_explicit(&q->tail, tail, memory_order_release);
+        }
+        if (!consumed) sched_yield();
+    }
+
+    atomic_store(&al.stop, 1);
+    unsigned long played = 0, dropped = 0;
+    for (int j = 0; j < num_actors; j++) {
+        pthread_join(al.actors[j].tid, NULL);
+        played += atomic_load(&al.actors[j].played);
+        dropped += atomic_load(&al.actors[j].dropped);
+    }
+    printf("\nTraining complete! Actors played %lu games, %lu dropped "
+           "(queues full), %d snapshots published, %.2f sec CPU, %ld sec.\n",
+           played, dropped, publications,
+           (double)(clock() - t0) / CLOCKS_PER_SEC, (long)(time(NULL) - wall0));
+    free(al.actors);
+    free(al.snapshots);
+}
+
+/* ================================ Pruning =================================
+ * With random initialization and ReLU some hidden units end up never, or
+ * almost never, active on the boards the network can actually see. A
+ * unit that is never active contributes nothing to the output, yet costs
+ * a weights_ih column, a weights_ho row and their multiply-adds on every
+ * forward pass.
+ *
+ * --prune measures, over all the reachable boards that are not over, how
+ * often every unit is active and what its average activation is. Units
+ * active on at most 'min_freq' of the boards are removed, folding their
+ * average contribution into the output biases (exact for units that are
+ * never active, since it is 0). Weights smaller than 'min_weight' in
+ * absolute value are set to zero. The result is a CompactNetwork with
+ * only the units left, used by the serving path, and a report of the
+ * cost saved and of how often it picks the same move as the original. */
+
+typedef struct {
+    int hidden;             // Units kept.
+    float *weights_ih;      // NN_INPUT_SIZE rows of 'hidden' weights.
+    float *biases_h;
+    float *weights_ho;      // 'hidden' rows of NN_OUTPUT_SIZE weights.
+    float biases_o[NN_OUTPUT_SIZE];
+} CompactNetwork;
+
+/* Store in 'boards' every reachable board from 'state' with a move to
+ * play, once. Returns the number of boards added. */
+int collect_boards(GameState *state, unsigned char *seen, GameState *boards) {
+    int h = board_hash(state);
+    if (seen[h]) return 0;
+    seen[h] = 1;
+
+    char winner;
+    if (check_game_over(state, &winner)) return 0;
+
+    int count = 0;
+    boards[count++] = *state;
+    for (int i = 0; i < 9; i++) {
+        if (state->board[i] != '.') continue;
+        make_move(state, i);
+        count += collect_boards(state, seen, boards + count);
+        undo_move(state, i);
+    }
+    return count;
+}
+
+/* Like forward_batch(), for a compacted network. */
+void compact_forward_batch(CompactNetwork *cn, float *inputs, int count,
+                           float *logits)
+{
+    float hidden[NN_HIDDEN_SIZE];
+    int units = cn->hidden;
+
+    for (int b = 0; b < count; b++) {
+        float *in = inputs + b*NN_INPUT_SIZE;
+        float *out = logits + b*NN_OUTPUT_SIZE;
+
+        memcpy(hidden, cn->biases_h, sizeof(float)*units);
+        for (int i = 0; i < NN_INPUT_SIZE; i++) {
+            if (in[i] == 0) continue;
+            float *row = cn->weights_ih + i*units;
+            for (int j = 0; j < units; j++) hidden[j] += in[i] * row[j];
+        }
+
+        memcpy(out, cn->biases_o, sizeof(float)*NN_OUTPUT_SIZE);
+        for (int j = 0; j < units; j++) {
+            float h = relu(hidden[j]);
+            if (h == 0) continue;
+            float *row = cn->weights_ho + j*NN_OUTPUT_SIZE;
+            for (int k = 0; k < NN_OUTPUT_SIZE; k++) out[k] += h * row[k];
+        }
+    }
+}
+
+/* Best legal move of a compacted network, or -1 if the board is full. */
+int compact_predict_move(CompactNetwork *cn, GameState *state) {
+    float inputs[NN_INPUT_SIZE], logits[NN_OUTPUT_SIZE];
+    board_to_inputs(state, inputs);
+    compact_forward_batch(cn, inputs, 1, logits);
+
+    int best_move = -1;
+    for (int i = 0; i < 9; i++) {
+        if (state->board[i] != '.') continue;
+        if (best_move == -1 || logits[i] > logits[best_move]) best_move = i;
+    }
+    return best_move;
+}
+
+static inline float prune_weight(float w, float min_weight) {
+    return fabsf(w) < min_weight ? 0 : w;
+}
+
+/* Analyze 'nn' and return its compacted version, printing the report. */
+CompactNetwork *prune_network(NeuralNetwork *nn, float min_freq, float min_weight) {
+    unsigned char *seen = calloc(POLICY_ENTRIES, 1);
+    GameState *boards = malloc(sizeof(GameState) * POLICY_ENTRIES);
+    GameState state;
+    init_game(&state);
+    int num_boards = collect_boards(&state, seen, boards);
+    free(seen);
+
+    /* Activation frequency and average of every unit. */
+    int active[NN_HIDDEN_SIZE] = {0};
+    double mean[NN_HIDDEN_SIZE] = {0};
+    for (int b = 0; b < num_boards; b++) {
+        float inputs[NN_INPUT_SIZE];
+        board_to_inputs(&boards[b], inputs);
+        forward_logits(nn, inputs);
+        for (int j = 0; j < NN_HIDDEN_SIZE; j++) {
+            active[j] += nn->hidden[j] > 0;
+            mean[j] += nn->hidden[j];
+        }
+    }
+
+    CompactNetwork *cn = calloc(1, sizeof(*cn));
+    int keep[NN_HIDDEN_SIZE], dead = 0, rare = 0;
+    memcpy(cn->biases_o, nn->biases_o, sizeof(cn->biases_o));
+    for (int j = 0; j < NN_HIDDEN_SIZE; j++) {
+        mean[j] /= num_boards;
+        if (active[j] > min_freq * num_boards) {
+            keep[cn->hidden++] = j;
+            continue;
+        }
+        if (active[j]) rare++;
+        else dead++;
+        for (int k = 0; k < NN_OUTPUT_SIZE; k++)
+            cn->biases_o[k] += mean[j] * nn->weights_ho[j*NN_OUTPUT_SIZE + k];
+    }
+
+    int units = cn->hidden, zeroed = 0;
+    cn->weights_ih = malloc(sizeof(float) * NN_INPUT_SIZE * (units ? units : 1));
+    cn->biases_h = malloc(sizeof(float) * (units ? units : 1));
+    cn->weights_ho = malloc(sizeof(float) * (units ? units : 1) * NN_OUTPUT_SIZE);
+    for (int u = 0; u < units; u++) {
+        int j = keep[u];
+        cn->biases_h[u] = nn->biases_h[j];
+        for (int i = 0; i < NN_INPUT_SIZE; i++) {
+            float w = nn->weights_ih[i*NN_HIDDEN_SIZE + j];
+            cn->weights_ih[i*units + u] = prune_weight(w, min_weight);
+            zeroed += cn->weights_ih[i*units + u] != w;
+        }
+        for (int k = 0; k < NN_OUTPUT_SIZE; k++) {
+            float w = nn->weights_ho[j*NN_OUTPUT_SIZE + k];
+            cn->weights_ho[u*NN_OUTPUT_SIZE + k] = prune_weight(w, min_weight);
+            zeroed += cn->weights_ho[u*NN_OUTPUT_SIZE + k] != w;
+        }
+    }
+
+    /* Same move as the original network? */
+    int agree = 0;
+    for (int b = 0; b < num_boards; b++)
+        agree += predict_move(nn, &boards[b], NULL) ==
+                 compact_predict_move(cn, &boards[b]);
+    free(boards);
+
+    int weights = (NN_INPUT_SIZE + 1 + NN_OUTPUT_SIZE) * NN_HIDDEN_SIZE;
+    int kept = (NN_INPUT_SIZE + 1 + NN_OUTPUT_SIZE) * units;
+    printf("Pruning over %d reachable boards: %d dead units, %d active on "
+           "at most %.2f%% of the boards, %d of %d units kept, "
+           "%d small weights zeroed\n", num_boards, dead, rare,
+           min_freq * 100, units, NN_HIDDEN_SIZE, zeroed);
+    printf("Policy layers: %d -> %d weights (%d -> %d bytes), "
+           "%d -> %d multiply-adds per dense forward pass\n",
+           weights + NN_OUTPUT_SIZE, kept + NN_OUTPUT_SIZE,
+           (int)sizeof(float) * (weights + NN_OUTPUT_SIZE),
+           (int)sizeof(float) * (kept + NN_OUTPUT_SIZE),
+           (NN_INPUT_SIZE + NN_OUTPUT_SIZE) * NN_HIDDEN_SIZE,
+           (NN_INPUT_SIZE + NN_OUTPUT_SIZE) * units);
+    printf("Move agreement with the original network: %d/%d (%.2f%%)\n",
+           agree, num_boards, agree * 100.0 / num_boards);
+    return cn;
+}
+
+/* ================================ Serving =================================
+ * --serve turns the program into a daemon answering "what is the best
+ * move here?" over a Unix domain socket. The protocol is binary and
+ * uses the native byte order, since both ends are on the same host:
+ * clients send MoveRequest structures and receive one MoveReply per
+ * request, in order. A client may pipeline many requests.
+ *
+ * A single thread runs an epoll loop over all the connections. Requests
+ * are not answered as soon as they are read: they are collected into a
+ * batch, and the batch is evaluated with one forward_batch() call when it
+ * is full, or when 'window_us' microseconds elapsed since its first
+ * request arrived. While a batch is open the loop polls without sleeping,
+ * so the window is honored at microsecond scale; with an empty batch it
+ * sleeps in epoll_wait(). Under load this coalesces the requests of many
+ * sessions into full batches, while the window bounds the latency added
+ * to each request. */
+
+#define SERVE_MAX_BATCH 256
+#define SERVE_MAX_EVENTS 256
+#define SERVE_FLAG_PROBS (1<<0)   // Fill MoveReply.probs.
+
+typedef struct {
+    uint32_t id;            // Opaque, echoed back in the reply.
+    uint8_t board[9];       // 0 empty, 1 X, 2 O.
+    uint8_t flags;          // SERVE_FLAG_*.
+    uint8_t reserved[2];
+} MoveRequest;
+
+typedef struct {
+    uint32_t id;
+    int8_t move;            // Best legal move, -1 if there is none.
+    uint8_t reserved[3];
+    float probs[9];         // Softmax of the network outputs, if requested.
+} MoveReply;
+
+typedef struct ServeClient {
+    int fd;
+    int closed;             // Peer gone, freed once 'pending' is zero.
+    int released;           // In the list of clients to free.
+    struct ServeClient *next_released;
+    int pending;            // Requests of this client in the open batch.
+    int want_write;         // EPOLLOUT is registered.
+    unsigned char inbuf[sizeof(MoveRequest) * 16];
+    size_t inlen;
+    unsigned char *outbuf;
+    size_t outlen, outpos, outcap;
+} ServeClient;
+
+typedef struct {
+    int epfd;
+    NeuralNetwork *nn;
+    CompactNetwork *compact;            // Used instead of nn if not NULL.
+    long window_ns;
+    int count;                          // Requests in the open batch.
+    uint64_t opened_ns;                 // When the batch was opened.
+    ServeClient *clients[SERVE_MAX_BATCH];
+    ServeClient *released;              // Closed clients to free.
+    MoveRequest requests[SERVE_MAX_BATCH];
+    float inputs[SERVE_MAX_BATCH * NN_INPUT_SIZE];
+    float logits[SERVE_MAX_BATCH * NN_OUTPUT_SIZE];
+    uint64_t served, batches;           // Stats.
+} MoveServer;
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Close the connection of a client. The client itself stays allocated,
+ * since the open batch or the events being processed may still reference
+ * it: see serve_release(). */
+void serve_close_client(MoveServer *srv, ServeClient *c) {
+    if (c->closed) return;
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->closed = 1;
+}
+
+/* Once 'c' is closed and not in the open batch, queue it to be freed by
+ * serve_free_released(), after the current epoll events are processed:
+ * a later event of the same round may still point to it. */
+void serve_release(MoveServer *srv, ServeClient *c) {
+    if (!c->closed || c->pending || c->released) return;
+    c->released = 1;
+    c->next_released = srv->released;
+    srv->released = c;
+}
+
+void serve_free_released(MoveServer *srv) {
+    while (srv->released) {
+        ServeClient *c = srv->released;
+        srv->released = c->next_released;
+        free(c->outbuf);
+        free(c);
+    }
+}
+
+/* Write as much of the output buffer as the socket accepts, and register
+ * for EPOLLOUT if something is left. */
+void serve_write(MoveServer *srv, ServeClient *c) {
+    while (c->outpos < c->outlen) {
+        ssize_t n = write(c->fd, c->outbuf + c->outpos, c->outlen - c->outpos);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            serve_close_client(srv, c);
+            return;
+        }
+        c->outpos += n;
+    }
+    if (c->outpos == c->outlen) c->outpos = c->outlen = 0;
+
+    int want = c->outlen != 0;
+    if (want != c->want_write) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(srv->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want;
+    }
+}
+
+/* Evaluate the open batch and queue the replies. */
+void serve_flush_batch(MoveServer *srv) {
+    if (srv->count == 0) return;
+
+    /* Boards found in the policy table (if any) are answered directly,
+     * only the others go through the network. */
+    int slot[SERVE_MAX_BATCH], num_eval = 0;
+    for (int b = 0; b < srv->count; b++) {
+        MoveRequest *req = &srv->requests[b];
+        int h = 0;
+        for (int i = 0; i < 9; i++) h = h*3 + (req->board[i] <= 2 ? req->board[i] : 0);
+        if (policy_moves && policy_moves[h] != -1 &&
+            (policy_probs || !(req->flags & SERVE_FLAG_PROBS)))
+        {
+            slot[b] = -1 - h;   // Negative: table hit, encodes the hash.
+            continue;
+        }
+
+        float *in = srv->inputs + num_eval*NN_INPUT_SIZE;
+        for (int i = 0; i < 9; i++) {
+            in[i*2] = req->board[i] == 1;
+            in[i*2+1] = req->board[i] == 2;
+        }
+        slot[b] = num_eval++;
+    }
+    if (num_eval && srv->compact)
+        compact_forward_batch(srv->compact, srv->inputs, num_eval, srv->logits);
+    else if (num_eval)
+        forward_batch(srv->nn, srv->inputs, num_eval, srv->logits);
+
+    for (int b = 0; b < srv->count; b++) {
+        MoveRequest *req = &srv->requests[b];
+        ServeClient *c = srv->clients[b];
+        MoveReply reply;
+
+        memset(&reply, 0, sizeof(reply));
+        reply.id = req->id;
+        if (slot[b] < 0) {
+            int h = -1 - slot[b];
+            reply.move = policy_moves[h];
+            if (req->flags & SERVE_FLAG_PROBS) {
+                for (int i = 0; i < 9; i++)
+                    reply.probs[i] = policy_probs[h*9+i] / 255.0f;
+            }
+        } else {
+            float *l = srv->logits + slot[b]*NN_OUTPUT_SIZE;
+            unsigned legal = 0;
+            reply.move = -1;
+            for (int i = 0; i < 9; i++) {
+                if (req->board[i] != 0) continue;
+                legal |= 1 << i;
+                if (reply.move == -1 || l[i] > l[(int)reply.move]) reply.move = i;
+            }
+            /* Clients can only play the empty tiles, so the probabilities
+             * are over those. */
+            if ((req->flags & SERVE_FLAG_PROBS) && legal)
+                softmax_masked(l, legal, reply.probs, 9);
+        }
+
+        if (c->closed) continue;
+        if (c->outlen + sizeof(reply) > c->outcap) {
+            c->outcap = (c->outlen + sizeof(reply)) * 2;
+            c->outbuf = realloc(c->outbuf, c->outcap);
+        }
+        memcpy(c->outbuf + c->outlen, &reply, sizeof(reply));
+        c->outlen += sizeof(reply);
+    }
+
+    /* Write after building all the replies, so that a client with many
+     * pipelined requests in this batch gets a single write(2). */
+    for (int b = 0; b < srv->count; b++) {
+        ServeClient *c = srv->clients[b];
+        if (c->closed) continue;
+        if (c->outlen && c->outpos == 0 && !c->want_write) serve_write(srv, c);
+    }
+
+    /* Only now the batch lets go of its clients: the closed ones it was
+     * the last reference to can be freed. */
+    for (int b = 0; b < srv->count; b++) {
+        ServeClient *c = srv->clients[b];
+        c->pending--;
+        serve_release(srv, c);
+    }
+    srv->served += srv->count;
+    srv->batches++;
+    srv->count = 0;
+}
+
+/* Flush the full batch while reading from 'c'. The flush may close 'c'
+ * (a failed write), so it holds a reference to keep 'c' allocated. */
+void serve_flush_from(MoveServer *srv, ServeClient *c) {
+    c->pending++;
+    serve_flush_batch(srv);
+    c->pending--;
+}
+
+/* Read requests from a client and add them to the open batch. */
+void serve_read(MoveServer *srv, ServeClient *c) {
+    while(1) {
+        if (srv->count == SERVE_MAX_BATCH) serve_flush_from(srv, c);
+        if (c->closed) {
+            serve_release(srv, c);
+            return;
+        }
+
+        ssize_t n = read(c->fd, c->inbuf + c->inlen, sizeof(c->inbuf) - c->inlen);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+            serve_close_client(srv, c);
+            serve_release(srv, c);
+            return;
+        }
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return; // EAGAIN: drained.
+        }
+        c->inlen += n;
+
+        size_t off = 0;
+        while (c->inlen - off >= sizeof(MoveRequest)) {
+            if (srv->count == SERVE_MAX_BATCH) serve_flush_from(srv, c);
+            if (srv->count == 0) srv->opened_ns = monotonic_ns();
+            memcpy(&srv->requests[srv->count], c->inbuf + off, sizeof(MoveRequest));
+            srv->clients[srv->count] = c;
+            srv->count++;
+            c->pending++;
+            off += sizeof(MoveRequest);
+        }
+        memmove(c->inbuf, c->inbuf + off, c->inlen - off);
+        c->inlen -= off;
+    }
+}
+
+/* Serve moves with network 'nn' on the Unix socket at 'path'. Never
+ * returns unless the socket can't be created. */
+int serve_moves(NeuralNetwork *nn, CompactNetwork *compact, const char *path,
+                long window_us)
+{
+    int lfd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0);
+    if (lfd == -1) return -1;
+
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sa.sun_path, path);
+    unlink(path);
+    if (bind(lfd, (struct sockaddr*)&sa, sizeof(sa)) == -1 ||
+        listen(lfd, 511) == -1) return -1;
+
+    MoveServer *srv = calloc(1, sizeof(*srv));
+    srv->nn = nn;
+    srv->compact = compact;
+    srv->window_ns = window_us * 1000;
+    srv->epfd = epoll_create1(0);
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;     // NULL marks the listening socket.
+    epoll_ctl(srv->epfd, EPOLL_CTL_ADD, lfd, &ev);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving moves on %s (batch window %ld us, max batch %d)\n",
+           path, window_us, SERVE_MAX_BATCH);
+    fflush(stdout);
+
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    uint64_t last_report = monotonic_ns();
+    uint64_t last_served = 0, last_batches = 0;
+    while(1) {
+        int n = epoll_wait(srv->epfd, events, SERVE_MAX_EVENTS,
+                           srv->count ? 0 : 1000);
+        for (int j = 0; j < n; j++) {
+            ServeClient *c = events[j].data.ptr;
+            if (c == NULL) {
+                int fd;
+                while ((fd = accept(lfd, NULL, NULL)) != -1) {
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    c = calloc(1, sizeof(*c));
+                    c->fd = fd;
+                    struct epoll_event cev = {0};
+                    cev.events = EPOLLIN;
+                    cev.data.ptr = c;
+                    epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &cev);
+                }
+                continue;
+            }
+            if (events[j].events & EPOLLOUT) serve_write(srv, c);
+            if (c->closed)
+                serve_release(srv, c);
+            else if (events[j].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+                serve_read(srv, c);
+        }
+
+        uint64_t now = monotonic_ns();
+        if (srv->count && now - srv->opened_ns >= (uint64_t)srv->window_ns)
+            serve_flush_batch(srv);
+        serve_free_released(srv);
+
+        if (now - last_report >= 5000000000ULL) {
+            uint64_t served = srv->served - last_served;
+            uint64_t batches = srv->batches - last_batches;
+            if (served) {
+                printf("%.0f requests/sec, average batch %.1f\n",
+                       served / ((now - last_report) / 1e9),
+                       (double)served / batches);
+                fflush(stdout);
+            }
+            last_report = now;
+            last_served = srv->served;
+            last_batches = srv->batches;
+        }
+    }
+    return 0;
+}
+
+/* ============================= Load generator =============================
+ * --loadgen connects 'clients' sessions to a --serve daemon, each sending
+ * 'depth' pipelined requests at a time with random positions (O to move),
+ * and reports throughput and latency percentiles. */
+
+typedef struct {
+    pthread_t tid;
+    const char *path;
+    int requests, depth, flags;
+    unsigned seed;
+    uint64_t *latency;      // One entry per request, in ns.
+    int errors;
+} LoadClient;
+
+int loadgen_io(int fd, void *buf, size_t len, int writing) {
+    unsigned char *p = buf;
+    while (len) {
+        ssize_t n = writing ? write(fd, p, len) : read(fd, p, len);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void *loadgen_client(void *arg) {
+    LoadClient *lc = arg;
+    struct sockaddr_un sa;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, lc->path, sizeof(sa.sun_path)-1);
+    if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+        lc->errors = lc->requests;
+        close(fd);
+        return NULL;
+    }
+
+    MoveRequest *req = calloc(lc->depth, sizeof(MoveRequest));
+    MoveReply *reply = calloc(lc->depth, sizeof(MoveReply));
+    uint64_t *sent = calloc(lc->depth, sizeof(uint64_t));
+    for (int done = 0; done < lc->requests; ) {
+        int burst = lc->requests - done;
+        if (burst > lc->depth) burst = lc->depth;
+
+        for (int b = 0; b < burst; b++) {
+            memset(&req[b], 0, sizeof(MoveRequest));
+            req[b].id = done + b;
+            req[b].flags = lc->flags;
+            int plies = 1 + 2 * (rand_r(&lc->seed) % 4); // O to move.
+            for (int p = 0; p < plies; p++) {
+                int pos;
+                do pos = rand_r(&lc->seed) % 9; while (req[b].board[pos]);
+                req[b].board[pos] = (p & 1) ? 2 : 1;
+            }
+            sent[b] = monotonic_ns();
+        }
+        if (loadgen_io(fd, req, sizeof(MoveRequest)*burst, 1) == -1 ||
+            loadgen_io(fd, reply, sizeof(MoveReply)*burst, 0) == -1)
+        {
+            lc->errors += lc->requests - done;
+            break;
+        }
+        uint64_t now = monotonic_ns();
+        for (int b = 0; b < burst; b++) {
+            if (reply[b].id != req[b].id || reply[b].move < 0 ||
+                req[b].board[(int)reply[b].move] != 0) lc->errors++;
+            lc->latency[done + b] = now - sent[b];
+        }
+        done += burst;
+    }
+    free(req);
+    free(reply);
+    free(sent);
+    close(fd);
+    return NULL;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+int run_loadgen(const char *path, int clients, int requests, int depth, int probs) {
+    if (clients < 1) clients = 1;
+    if (depth < 1) depth = 1;
+    LoadClient *lc = calloc(clients, sizeof(LoadClient));
+    int per_client = requests / clients;
+    uint64_t start = monotonic_ns();
+
+    for (int j = 0; j < clients; j++) {
+        lc[j].path = path;
+        lc[j].requests = per_client;
+        lc[j].depth = depth;
+        lc[j].flags = probs ? SERVE_FLAG_PROBS : 0;
+        lc[j].seed = rand();
+        lc[j].latency = calloc(per_client ? per_client : 1, sizeof(uint64_t));
+        pthread_create(&lc[j].tid, NULL, loadgen_client, &lc[j]);
+    }
+
+    uint64_t total = (uint64_t)per_client * clients;
+    uint64_t *all = malloc(sizeof(uint64_t) * (total ? total : 1));
+    int errors = 0;
+    for (int j = 0; j < clients; j++) {
+        pthread_join(lc[j].tid, NULL);
+        memcpy(all + (uint64_t)j*per_client, lc[j].latency,
+               sizeof(uint64_t) * per_client);
+        errors += lc[j].errors;
+        free(lc[j].latency);
+    }
+    double elapsed = (monotonic_ns() - start) / 1e9;
+
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+    printf("%llu requests, %d clients, depth %d: %.0f requests/sec, %d errors\n",
+           (unsigned long long)total, clients, depth, total / elapsed, errors);
+    if (total) {
+        printf("Latency us: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+               all[total*50/100] / 1e3, all[total*90/100] / 1e3,
+               all[total*99/100] / 1e3, all[total*999/1000] / 1e3,
+               all[total-1] / 1e3);
+    }
+    free(all);
+    free(lc);
+    return errors ? 1 : 0;
+}
+
+/* ================================ Tournament ==============================
+ * --tournament N plays a round robin among all the available agents,
+ * N games per pairing and per color, on all the cores, and reports
+ * win/draw/loss with a 95% confidence interval and Elo ratings. The
+ * agents are:
+ *
+ * random   Uniformly random legal moves.
+ * perfect  Exhaustive negamax (see solve()), random among optimal moves.
+ * nn       The network loaded or trained by this run.
+ * qtable   A v1.c Q-table saved with ./v1 --save, if --qtable is given.
+ *          It plays greedily: v1 explores 20% of the time only to train.
+ * <file>   Any other network given with --model: a file saved with --save
+ *          by another run of this program, e.g. trained with other flags.
+ *
+ * There is no v2.c agent: v2.c does not build as it stands (it uses a
+ * raw_logits field its network lacks, among other errors) and it has no
+ * way to save its network. Its network has the same 18-100-9 shape as
+ * ours, so once it can write a file in our --save format it can play
+ * here through --model.
+ *
+ * Network and Q-table agents are deterministic, so --epsilon makes every
+ * agent play a random move with that probability, to get a spread of
+ * games instead of the same game replayed millions of times.
+ *
+ * Games are split in chunks taken from a shared atomic counter, and every
+ * thread accumulates its results privately: the only shared write in the
+ * hot loop is one atomic increment per chunk. */
+
+#define TOURNAMENT_CHUNK 4096
+#define MAX_AGENTS 16
+
+/* Value of every reachable board for the side to move: 1 win, 0 draw,
+ * -1 loss, with perfect play from both sides. */
+signed char solver_value[POLICY_ENTRIES];
+unsigned char solver_known[POLICY_ENTRIES];
+
+int solve(GameState *state) {
+    int h = board_hash(state);
+    if (solver_known[h]) return solver_value[h];
+
+    int best = -2;
+    for (int i = 0; i < 9; i++) {
+        if (state->board[i] != '.') continue;
+        char winner;
+        int v;
+        make_move(state, i);
+        if (check_move_over(state, i, &winner))
+            v = (winner == 'T') ? 0 : 1; // Only the mover can win.
+        else
+            v = -solve(state);
+        undo_move(state, i);
+        if (v > best) best = v;
+    }
+    solver_known[h] = 1;
+    solver_value[h] = best;
+    return best;
+}
+
+/* Fill the solver table. Must be called before any thread uses it. */
+void init_solver(void) {
+    GameState state;
+    init_game(&state);
+    solve(&state);
+}
+
+/* Value of playing 'move' for the side to move, from the solver table. */
+int solver_move_value(GameState *state, int move) {
+    char winner;
+    int v;
+    make_move(state, move);
+    if (check_move_over(state, move, &winner))
+        v = (winner == 'T') ? 0 : 1;
+    else
+        v = -solver_value[board_hash(state)];
+    undo_move(state, move);
+    return v;
+}
+
+/* Pick one of the optimal moves at random. */
+int solver_move(GameState *state, unsigned *seed) {
+    int best[9], count = 0, best_value = -2;
+    for (int i = 0; i < 9; i++) {
+        if (state->board[i] != '.') continue;
+        int v = solver_move_value(state, i);
+        if (v > best_value) {
+            best_value = v;
+            count = 0;
+        }
+        if (v == best_value) best[count++] = i;
+    }
+    return best[rand_r(seed) % count];
+}
+
+typedef enum {
+    AGENT_RANDOM,
+    AGENT_PERFECT,
+    AGENT_NN,
+    AGENT_QTABLE,
+    AGENT_MLP
+} AgentType;
+
+typedef struct {
+    char name[32];
+    AgentType type;
+    NeuralNetwork *nn;
+    float *qtable;          // 19683*9 Q-values, indexed by board_hash().
+    Mlp *mlp;
+} Agent;
+
+/* Load a Q-table written by v1.c save_qtable(), or a checkpoint. */
+float *load_qtable(const char *path) {
+    FILE *fp = checkpoint_fopen(path);
+    if (fp == NULL) return NULL;
+
+    char magic[8];
+    float *q = malloc(sizeof(float) * POLICY_ENTRIES * 9);
+    int ok = fread(magic, 8, 1, fp) == 1 &&
+             memcmp(magic, "TTTQT001", 8) == 0 &&
+             fread(q, sizeof(float) * POLICY_ENTRIES * 9, 1, fp) == 1;
+    fclose(fp);
+    if (!ok) {
+        free(q);
+        errno = EINVAL;
+        return NULL;
+    }
+    return q;
+}
+
+int agent_move(Agent *a, GameState *state, unsigned *seed, float epsilon) {
+    if (a->type == AGENT_RANDOM ||
+        (epsilon > 0 && rand_r(seed) < epsilon * ((float)RAND_MAX + 1)))
+        return actor_random_move(state, seed);
+
+    switch(a->type) {
+    case AGENT_PERFECT:
+        return solver_move(state, seed);
+    case AGENT_NN:
+        return predict_move(a->nn, state, NULL);
+    case AGENT_MLP:
+        return mlp_predict_move(a->mlp, state);
+    case AGENT_QTABLE: {
+        float *q = a->qtable + board_hash(state) * 9;
+        int best = -1;
+        for (int i = 0; i < 9; i++) {
+            if (state->board[i] != '.') continue;
+            if (best == -1 || q[i] > q[best]) best = i;
+        }
+        return best;
+    }
+    default:
+        return actor_random_move(state, seed);
+    }
+}
+
+/* Results of a pairing from the point of view of its first agent. */
+typedef struct {
+    uint64_t wins, draws, losses;
+} MatchResult;
+
+typedef struct {
+    Agent *agents;
+    int num_agents;
+    int num_pairs;
+    int pairs[MAX_AGENTS*MAX_AGENTS][2];
+    uint64_t games;             // Per pairing and per color.
+    uint64_t chunks_per_job;    // Jobs are (pairing, color) couples.
+    uint64_t num_chunks;
+    atomic_ulong next_chunk;
+    float epsilon;
+} Tournament;
+
+typedef struct {
+    pthread_t tid;
+    Tournament *t;
+    unsigned seed;
+    MatchResult *results;       // num_pairs*2 entries, private.
+} TournamentWorker;
+
+/* Play a game between 'x' and 'o' and return the winner symbol. */
+char tournament_game(Agent *x, Agent *o, unsigned *seed, float epsilon) {
+    GameState state;
+    char winner;
+
+    init_game(&state);
+    while(1) {
+        Agent *a = (state.current_player == 0) ? x : o;
+        int move = agent_move(a, &state, seed, epsilon);
+        make_move(&state, move);
+        if (check_move_over(&state, move, &winner)) return winner;
+    }
+}
+
+void *tournament_worker(void *arg) {
+    TournamentWorker *w = arg;
+    Tournament *t = w->t;
+
+    while(1) {
+        uint64_t c = atomic_fetch_add(&t->next_chunk, 1);
+        if (c >= t->num_chunks) break;
+
+        uint64_t job = c / t->chunks_per_job;
+        uint64_t first = (c % t->chunks_per_job) * TOURNAMENT_CHUNK;
+        uint64_t count = t->games - first;
+        if (count > TOURNAMENT_CHUNK) count = TOURNAMENT_CHUNK;
+
+        int pair = job / 2, a_is_x = (job % 2) == 0;
+        Agent *a = &t->agents[t->pairs[pair][0]];
+        Agent *b = &t->agents[t->pairs[pair][1]];
+        char a_symbol = a_is_x ? 'X' : 'O';
+        MatchResult *r = &w->results[job];
+        for (uint64_t g = 0; g < count; g++) {
+            char winner = a_is_x ? tournament_game(a, b, &w->seed, t->epsilon) :
+                                   tournament_game(b, a, &w->seed, t->epsilon);
+            if (winner == 'T') r->draws++;
+            else if (winner == a_symbol) r->wins++;
+            else r->losses++;
+        }
+    }
+    return NULL;
+}
+
+/* Elo difference corresponding to an expected score. */
+double score_to_elo(double score) {
+    if (score < 1e-6) score = 1e-6;
+    if (score > 1-1e-6) score = 1-1e-6;
+    return -400.0 * log10(1.0/score - 1.0);
+}
+
+/* Play the round robin and print the report. */
+void run_tournament(Agent *agents, int num_agents, uint64_t games,
+                    int num_threads, float epsilon)
+{
+    Tournament t;
+    t.agents = agents;
+    t.num_agents = num_agents;
+    t.games = games;
+    t.epsilon = epsilon;
+    t.num_pairs = 0;
+    for (int i = 0; i < num_agents; i++) {
+        for (int j = i+1; j < num_agents; j++) {
+            t.pairs[t.num_pairs][0] = i;
+            t.pairs[t.num_pairs][1] = j;
+            t.num_pairs++;
+        }
+    }
+    t.chunks_per_job = (games + TOURNAMENT_CHUNK - 1) / TOURNAMENT_CHUNK;
+    t.num_chunks = t.chunks_per_job * t.num_pairs * 2;
+    atomic_init(&t.next_chunk, 0);
+    if (num_threads < 1) num_threads = 1;
+
+    init_solver();
+    printf("Tournament: %d agents, %d pairings, %llu games per pairing "
+           "and color, %d threads, epsilon %.2f\n", num_agents, t.num_pairs,
+           (unsigned long long)games, num_threads, epsilon);
+
+    uint64_t start = monotonic_ns();
+    TournamentWorker *workers = calloc(num_threads, sizeof(TournamentWorker));
+    for (int j = 0; j < num_threads; j++) {
+        workers[j].t = &t;
+        workers[j].seed = rand();
+        workers[j].results = calloc(t.num_pairs * 2, sizeof(MatchResult));
+        pthread_create(&workers[j].tid, NULL, tournament_worker, &workers[j]);
+    }
+
+    MatchResult *res = calloc(t.num_pairs, sizeof(MatchResult));
+    for (int j = 0; j < num_threads; j++) {
+        pthread_join(workers[j].tid, NULL);
+        for (int p = 0; p < t.num_pairs * 2; p++) {
+            res[p/2].wins += workers[j].results[p].wins;
+            res[p/2].draws += workers[j].results[p].draws;
+            res[p/2].losses += workers[j].results[p].losses;
+        }
+        free(workers[j].results);
+    }
+    free(workers);
+    double elapsed = (monotonic_ns() - start) / 1e9;
+    uint64_t total = games * 2 * t.num_pairs;
+    printf("%llu games in %.2f sec, %.0f games/sec\n\n",
+           (unsigned long long)total, elapsed, total / elapsed);
+
+    /* Per pairing report. The score is (wins + draws/2) / games, and its
+     * confidence interval comes from the per game variance of the score
+     * (normal approximation, fine with this many games). */
+    printf("%-12s %-12s %10s %10s %10s %16s %18s\n", "Agent", "Opponent",
+           "Win", "Draw", "Loss", "Score (95% CI)", "Elo diff (95% CI)");
+    for (int p = 0; p < t.num_pairs; p++) {
+        MatchResult *r = &res[p];
+        double n = r->wins + r->draws + r->losses;
+        double score = (r->wins + 0.5 * r->draws) / n;
+        double var = (r->wins + 0.25 * r->draws) / n - score * score;
+        double ci = 1.96 * sqrt(var / n);
+        printf("%-12s %-12s %9.2f%% %9.2f%% %9.2f%% %7.4f +- %.4f "
+               "%7.0f [%.0f, %.0f]\n",
+               agents[t.pairs[p][0]].name, agents[t.pairs[p][1]].name,
+               r->wins * 100 / n, r->draws * 100 / n, r->losses * 100 / n,
+               score, ci, score_to_elo(score),
+               score_to_elo(score - ci), score_to_elo(score + ci));
+    }
+
+    /* Ratings: Bradley-Terry fit with the minorization-maximization
+     * iteration, draws counting as half a win for each side. A virtual
+     * draw per pairing keeps the ratings finite when an agent never loses
+     * (the perfect player), and the random agent is anchored at 0. */
+    double gamma[MAX_AGENTS], points[MAX_AGENTS] = {0};
+    for (int i = 0; i < num_agents; i++) gamma[i] = 1;
+    for (int p = 0; p < t.num_pairs; p++) {
+        points[t.pairs[p][0]] += res[p].wins + 0.5 * res[p].draws + 0.5;
+        points[t.pairs[p][1]] += res[p].losses + 0.5 * res[p].draws + 0.5;
+    }
+    for (int iter = 0; iter < 1000; iter++) {
+        double next[MAX_AGENTS];
+        for (int i = 0; i < num_agents; i++) {
+            double denom = 0;
+            for (int p = 0; p < t.num_pairs; p++) {
+                int a = t.pairs[p][0], b = t.pairs[p][1];
+                if (a != i && b != i) continue;
+                double n = games * 2 + 1;
+                denom += n / (gamma[a] + gamma[b]);
+            }
+            next[i] = points[i] / denom;
+        }
+        for (int i = 0; i < num_agents; i++) gamma[i] = next[i] / next[0];
+    }
+    printf("\nElo ratings (random = 0):\n");
+    for (int i = 0; i < num_agents; i++)
+        printf("  %-12s %7.0f\n", agents[i].name, 400.0 * log10(gamma[i]));
+    free(res);
+}
+
+/* ================================ Evaluator ===============================
+ * With --eval the number of training games is only a maximum: training
+ * stops as soon as the network is good enough. Every 'eval_every' games
+ * the trainer hands a copy of its weights to the evaluator thread, which
+ * plays 'games' games with it as O (the side it learns) against random
+ * or the perfect player. The games are split among 'threads' threads, so
+ * the trainer keeps its own core meanwhile. The score is the no loss
+ * rate, (wins + draws) / games: 1 against the perfect player means it
+ * always draws.
+ *
+ * After 'patience' evaluations in a row score at least 'target', the
+ * evaluator sets 'stop_training', that the training loops check between
+ * games. The best snapshot seen (the latest one, between equal scores)
+ * replaces the trained weights at the end, so --save and the rest of
+ * main() get it even if training went past it or never reached the
+ * target.
+ *
+ * Handing over a snapshot is a memcpy under an uncontended mutex, like
+ * checkpoint_take(). If the previous snapshot is still being evaluated
+ * the new one is skipped: the trainer never waits for the evaluator. */
+
+struct Evaluator {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Agent opponent;
+    Agent player;               // Plays 'snapshot'.
+    int games, threads, patience;
+    float target;
+    unsigned seed;
+    NeuralNetwork snapshot;     // Being evaluated while 'pending'.
+    uint64_t snapshot_games;    // Training games played when taken.
+    int pending;
+    int stop;
+    NeuralNetwork best;
+    uint64_t best_games;
+    double best_score;          // -1 until the first evaluation.
+    int streak;                 // Evaluations in a row on target.
+    int evaluations, skipped;
+    uint64_t eval_ns;
+};
+
+typedef struct {
+    pthread_t tid;
+    Evaluator *ev;
+    int games;
+    unsigned seed;
+    MatchResult result;         // Of the snapshot.
+} EvalWorker;
+
+void *eval_worker_main(void *arg) {
+    EvalWorker *w = arg;
+    for (int g = 0; g < w->games; g++) {
+        char winner = tournament_game(&w->ev->opponent, &w->ev->player,
+                                      &w->seed, 0);
+        if (winner == 'O') w->result.wins++;
+        else if (winner == 'T') w->result.draws++;
+        else w->result.losses++;
+    }
+    return NULL;
+}
+
+/* Score the snapshot, on the calling thread and threads-1 more. */
+MatchResult evaluate_snapshot(Evaluator *ev) {
+    EvalWorker workers[ev->threads];
+    MatchResult r = {0, 0, 0};
+
+    for (int j = 0; j < ev->threads; j++) {
+        workers[j].ev = ev;
+        workers[j].games = ev->games / ev->threads +
+                           (j < ev->games % ev->threads);
+        workers[j].seed = rand_r(&ev->seed);
+        memset(&workers[j].result, 0, sizeof(MatchResult));
+        if (j) pthread_create(&workers[j].tid, NULL, eval_worker_main, &workers[j]);
+    }
+    eval_worker_main(&workers[0]);
+    for (int j = 0; j < ev->threads; j++) {
+        if (j) pthread_join(workers[j].tid, NULL);
+        r.wins += workers[j].result.wins;
+        r.draws += workers[j].result.draws;
+        r.losses += workers[j].result.losses;
+    }
+    return r;
+}
+
+void *evaluator_main(void *arg) {
+    Evaluator *ev = arg;
+
+    pthread_mutex_lock(&ev->lock);
+    while (1) {
+        while (!ev->pending && !ev->stop) pthread_cond_wait(&ev->cond, &ev->lock);
+        if (!ev->pending) break;
+        pthread_mutex_unlock(&ev->lock);
+
+        /* The snapshot is ours until 'pending' is cleared. */
+        uint64_t start = monotonic_ns();
+        MatchResult r = evaluate_snapshot(ev);
+        uint64_t elapsed = monotonic_ns() - start;
+        double score = (double)(r.wins + r.draws) / ev->games;
+
+        ev->evaluations++;
+        ev->eval_ns += elapsed;
+        if (score >= ev->best_score) {
+            memcpy(ev->best.weights_ih, ev->snapshot.weights_ih,
+                   sizeof(NeuralGradients));
+            ev->best_score = score;
+            ev->best_games = ev->snapshot_games;
+        }
+        ev->streak = score >= ev->target ? ev->streak + 1 : 0;
+        printf("Evaluation after %llu games vs %s: Wins: %.1f%%, "
+               "Losses: %.1f%%, Ties: %.1f%%, no loss %.2f%% (%.0f ms)\n",
+               (unsigned long long)ev->snapshot_games, ev->opponent.name,
+               r.wins * 100.0 / ev->games, r.losses * 100.0 / ev->games,
+               r.draws * 100.0 / ev->games, score * 100, elapsed / 1e6);
+        if (ev->streak == ev->patience && !atomic_load(&stop_training)) {
+            printf("Target %.2f%% reached %d times in a row: "
+                   "stopping training.\n", ev->target * 100, ev->patience);
+            atomic_store(&stop_training, 1);
+        }
+
+        pthread_mutex_lock(&ev->lock);
+        ev->pending = 0;
+        pthread_cond_broadcast(&ev->cond);
+    }
+    pthread_mutex_unlock(&ev->lock);
+    return NULL;
+}
+
+/* Start the evaluator thread. 'opponent' is "random" or "perfect". */
+Evaluator *evaluator_create(const char *opponent, int games, float target,
+                            int patience, int threads)
+{
+    Evaluator *ev = calloc(1, sizeof(*ev));
+    if (!strcmp(opponent, "random")) {
+        ev->opponent.type = AGENT_RANDOM;
+    } else if (!strcmp(opponent, "perfect")) {
+        ev->opponent.type = AGENT_PERFECT;
+        init_solver();
+    } else {
+        free(ev);
+        return NULL;
+    }
+    snprintf(ev->opponent.name, sizeof(ev->opponent.name), "%s", opponent);
+    strcpy(ev->player.name, "nn");
+    ev->player.type = AGENT_NN;
+    ev->player.nn = &ev->snapshot;
+    ev->games = games > 0 ? games : 1;
+    ev->target = target;
+    ev->patience = patience > 0 ? patience : 1;
+    ev->threads = threads > 0 ? threads : 1;
+    ev->seed = rand();
+    ev->best_score = -1;
+    pthread_mutex_init(&ev->lock, NULL);
+    pthread_cond_init(&ev->cond, NULL);
+    pthread_create(&ev->tid, NULL, evaluator_main, ev);
+    return ev;
+}
+
+/* Called by the trainer after 'games' games: evaluate the current weights
+ * unless the previous snapshot is still being evaluated. */
+void evaluator_offer(Evaluator *ev, NeuralNetwork *nn, uint64_t games) {
+    pthread_mutex_lock(&ev->lock);
+    if (ev->pending) {
+        ev->skipped++;
+    } else {
+        memcpy(ev->snapshot.weights_ih, nn->weights_ih, sizeof(NeuralGradients));
+        ev->snapshot_games = games;
+        ev->pending = 1;
+        pthread_cond_signal(&ev->cond);
+    }
+    pthread_mutex_unlock(&ev->lock);
+}
+
+/* Called when training is over, after 'games' games: evaluate the final
+ * weights too, unless training was stopped by the evaluator, then stop
+ * the thread and replace the weights of 'nn' with the best snapshot. */
+void evaluator_finish(Evaluator *ev, NeuralNetwork *nn, uint64_t games) {
+    pthread_mutex_lock(&ev->lock);
+    while (ev->pending) pthread_cond_wait(&ev->cond, &ev->lock);
+    if (!atomic_load(&stop_training) && ev->snapshot_games != games) {
+        memcpy(ev->snapshot.weights_ih, nn->weights_ih, sizeof(NeuralGradients));
+        ev->snapshot_games = games;
+        ev->pending = 1;
+    }
+    ev->stop = 1;
+    pthread_cond_signal(&ev->cond);
+    pthread_mutex_unlock(&ev->lock);
+    pthread_join(ev->tid, NULL);
+
+    printf("%d evaluations (%d skipped, still busy), %.2f sec total.\n",
+           ev->evaluations, ev->skipped, ev->eval_ns / 1e9);
+    if (ev->best_score >= 0) {
+        printf("Keeping the snapshot after %llu games: no loss %.2f%% "
+               "vs %s.\n", (unsigned long long)ev->best_games,
+               ev->best_score * 100, ev->opponent.name);
+        memcpy(nn->weights_ih, ev->best.weights_ih, sizeof(NeuralGradients));
+    }
+    pthread_mutex_destroy(&ev->lock);
+    pthread_cond_destroy(&ev->cond);
+    free(ev);
+}
+
+/* =============================== Curriculum ===============================
+ * With --curriculum the network (still playing O) trains against a mix
+ * of X opponents instead of random only:
+ *
+ * random    Uniformly random moves, the usual training.
+ * snapshot  One of the last CURRICULUM_SNAPSHOTS copies of the network,
+ *           taken every 'snapshot_every' games.
+ * self      The current network.
+ * solver    The perfect player.
+ *
+ * Network and solver opponents play a random move with probability
+ * 'epsilon', otherwise the deterministic ones would replay the same few
+ * games.
+ *
+ * The opponent of every game is drawn with probability proportional to
+ * CURRICULUM_MIN_SHARE plus the recent loss rate against it (a moving
+ * average over about CURRICULUM_WINDOW games). Opponents that still beat
+ * the network get most of the games, those it no longer loses to just
+ * the minimum share, so that it does not forget them. */
+
+#define CURRICULUM_SNAPSHOTS 8
+#define CURRICULUM_MIN_SHARE 0.05
+#define CURRICULUM_WINDOW 500
+
+typedef enum {
+    OPP_RANDOM,
+    OPP_SNAPSHOT,
+    OPP_SELF,
+    OPP_SOLVER,
+    OPP_COUNT
+} OpponentType;
+
+const char *opponent_names[OPP_COUNT] = {"random", "snapshot", "self", "solver"};
+
+typedef struct {
+    double loss_rate;           // Moving average, starts at 0.5.
+    int games, wins, losses, ties;  // Since the last report.
+} OpponentStats;
+
+typedef struct {
+    NeuralNetwork *snapshots;   // CURRICULUM_SNAPSHOTS, a ring.
+    int num_snapshots, next_snapshot;
+    int snapshot_every;
+    float epsilon;
+    unsigned seed;
+    OpponentStats stats[OPP_COUNT];
+} Curriculum;
+
+/* Draw the opponent of the next game. */
+OpponentType curriculum_pick(Curriculum *c) {
+    double weight[OPP_COUNT], total = 0;
+    for (int k = 0; k < OPP_COUNT; k++) {
+        weight[k] = CURRICULUM_MIN_SHARE + c->stats[k].loss_rate;
+        if (k == OPP_SNAPSHOT && c->num_snapshots == 0) weight[k] = 0;
+        total += weight[k];
+    }
+    double r = rand_r(&c->seed) / ((double)RAND_MAX + 1) * total;
+    for (int k = 0; k < OPP_COUNT - 1; k++) {
+        if (r < weight[k]) return k;
+        r -= weight[k];
+    }
+    return OPP_COUNT - 1;
+}
+
+/* Play a game of 'nn' (O) against 'opp' (X), without learning. */
+char curriculum_game(Curriculum *c, NeuralNetwork *nn, OpponentType opp,
+                     int *move_history, int *num_moves)
+{
+    GameState state;
+    char winner;
+    NeuralNetwork *x = nn;
+
+    if (opp == OPP_SNAPSHOT)
+        x = &c->snapshots[rand_r(&c->seed) % c->num_snapshots];
+    init_game(&state);
+    *num_moves = 0;
+    while (1) {
+        int move;
+        if (state.current_player == 1)
+            move = predict_move(nn, &state, NULL);
+        else if (opp == OPP_RANDOM ||
+                 rand_r(&c->seed) < c->epsilon * ((float)RAND_MAX + 1))
+            move = actor_random_move(&state, &c->seed);
+        else if (opp == OPP_SOLVER)
+            move = solver_move(&state, &c->seed);
+        else
+            move = predict_move(x, &state, NULL);
+
+        make_move(&state, move);
+        move_history[(*num_moves)++] = move;
+        if (check_move_over(&state, move, &winner)) return winner;
+    }
+}
+
+void curriculum_report(Curriculum *c, int games) {
+    double total = 0;
+    for (int k = 0; k < OPP_COUNT; k++) total += c->stats[k].games;
+    printf("Curriculum after %d games:", games);
+    for (int k = 0; k < OPP_COUNT; k++) {
+        OpponentStats *s = &c->stats[k];
+        if (s->games == 0) continue;
+        printf(" %s %.0f%% (L %.1f%% T %.1f%%)", opponent_names[k],
+               s->games * 100 / total, s->losses * 100.0 / s->games,
+               s->ties * 100.0 / s->games);
+        s->games = s->wins = s->losses = s->ties = 0;
+    }
+    printf("\n");
+}
+
+/* Train the network against the curriculum opponents. */
+void train_curriculum(NeuralNetwork *nn, int num_games, int snapshot_every,
+                      float epsilon)
+{
+    Curriculum c;
+    int move_history[9];
+    int num_moves;
+    TrainStats ts = {0};
+
+    memset(&c, 0, sizeof(c));
+    c.snapshots = malloc(sizeof(NeuralNetwork) * CURRICULUM_SNAPSHOTS);
+    c.snapshot_every = snapshot_every > 0 ? snapshot_every : 1;
+    c.epsilon = epsilon;
+    c.seed = rand();
+    for (int k = 0; k < OPP_COUNT; k++) c.stats[k].loss_rate = 0.5;
+    init_solver();
+
+    printf("Training neural network against %d curriculum games "
+           "(epsilon %.2f)...\n", num_games, epsilon);
+
+    metrics_register();
+    for (int i = 0; i < num_games && !atomic_load(&stop_training); i++) {
+        OpponentType opp = curriculum_pick(&c);
+        char winner = curriculum_game(&c, nn, opp, move_history, &num_moves);
+        learn_from_game(nn, NULL, NULL, move_history, num_moves, 1, winner);
+
+        OpponentStats *s = &c.stats[opp];
+        s->games++;
+        if (winner == 'O') s->wins++;
+        else if (winner == 'X') s->losses++;
+        else s->ties++;
+        s->loss_rate += ((winner == 'X') - s->loss_rate) / CURRICULUM_WINDOW;
+
+        log_game(move_history, num_moves, winner);
+        update_train_stats(&ts, winner);
+        metrics_game(num_moves, winner, 'O');
+        if ((i+1) % c.snapshot_every == 0) {
+            NeuralNetwork *snap = &c.snapshots[c.next_snapshot];
+            memcpy(snap->weights_ih, nn->weights_ih, sizeof(NeuralGradients));
+            c.next_snapshot = (c.next_snapshot + 1) % CURRICULUM_SNAPSHOTS;
+            if (c.num_snapshots < CURRICULUM_SNAPSHOTS) c.num_snapshots++;
+        }
+        if ((i+1) % 10000 == 0) curriculum_report(&c, i+1);
+        if (checkpointer && (i+1) % checkpoint_every == 0)
+            checkpoint_take(checkpointer, nn->weights_ih);
+        if (evaluator && (i+1) % eval_every == 0)
+            evaluator_offer(evaluator, nn, i+1);
+    }
+    printf("\nTraining complete!\n");
+    free(c.snapshots);
+}
+
+/* =========================== Configurable network =========================
+ * --hidden 64,64 trains an Mlp (see mlp.h) with the given hidden layers
+ * instead of the fixed NeuralNetwork, using the same games, rewards and
+ * targets, then evaluates it against random and perfect play. With
+ * --mlp-bench it also times the forward pass with the specialized kernels
+ * against the generic one, and with --tournament the Mlp joins a round
+ * robin with random and perfect play. */
+
+/* Same as learn_from_game() for an Mlp. */
+void mlp_learn_from_game(Mlp *m, const LearnParams *lp, int *move_history,
+                         int num_moves, int nn_moves_even, char winner)
+{
+    if (lp == NULL) lp = &default_learn_params;
+    float reward = game_reward(lp, winner, nn_moves_even ? 'O' : 'X');
+    float inputs[NN_INPUT_SIZE], target_probs[NN_OUTPUT_SIZE];
+    GameState state;
+
+    init_game(&state);
+    for (int move_idx = 0; move_idx < num_moves; move_idx++) {
+        int move = move_history[move_idx];
+        if ((move_idx & 1) == (nn_moves_even ? 1 : 0)) {
+            float move_importance = 0.5f + 0.5f * (float)move_idx/(float)num_moves;
+            float scaled_reward = reward * move_importance;
+            board_to_inputs(&state, inputs);
+            mlp_forward(m, inputs);
+            move_targets(&state, move, move_idx, scaled_reward, target_probs);
+            mlp_backward(m, target_probs, lp->learning_rate, scaled_reward, NULL);
+        }
+        make_move(&state, move);
+    }
+}
+
+/* Play a game as O against random, learning from it if 'learn'. */
+char mlp_random_game(Mlp *m, int learn) {
+    int move_history[9], num_moves = 0;
+    GameState state;
+    char winner;
+
+    init_game(&state);
+    while (1) {
+        int move = state.current_player == 0 ? get_random_move(&state) :
+                                               mlp_predict_move(m, &state);
+        make_move(&state, move);
+        move_history[num_moves++] = move;
+        if (check_move_over(&state, move, &winner)) break;
+    }
+    if (learn) mlp_learn_from_game(m, NULL, move_history, num_moves, 1, winner);
+    return winner;
+}
+
+/* Time 'iterations' forward passes over random reachable positions. */
+double mlp_bench_forward(Mlp *m, float *inputs, int positions, int iterations) {
+    volatile float sink = 0;
+    uint64_t start = monotonic_ns();
+    for (int i = 0; i < iterations; i++)
+        sink += mlp_forward(m, inputs + (i % positions) * NN_INPUT_SIZE)[0];
+    (void)sink;
+    return (double)(monotonic_ns() - start) / iterations;
+}
+
+void mlp_bench(Mlp *m) {
+    const int positions = 1024, iterations = 2000000;
+    float *inputs = malloc(sizeof(float) * NN_INPUT_SIZE * positions);
+    for (int p = 0; p < positions; p++) {
+        GameState state;
+        init_game(&state);
+        for (int k = rand() % 8; k > 0; k--) make_move(&state, get_random_move(&state));
+        board_to_inputs(&state, inputs + p * NN_INPUT_SIZE);
+    }
+
+    int specialized = m->specialized;
+    double fast = mlp_bench_forward(m, inputs, positions, iterations);
+    mlp_specialize(m, 0);
+    double generic = mlp_bench_forward(m, inputs, positions, iterations);
+    mlp_specialize(m, 1);
+    printf("Forward pass: %.1f ns with %d/%d specialized layers, "
+           "%.1f ns generic (%.2fx)\n", fast, specialized, m->num_layers,
+           generic, generic / fast);
+    free(inputs);
+}
+
+/* Parse "64,64" into the hidden sizes of 'sizes', adding the input and
+ * output layers. Returns the number of sizes, or -1 on error. */
+int parse_hidden_sizes(const char *spec, int *sizes) {
+    int n = 0;
+    sizes[n++] = NN_INPUT_SIZE;
+    while (*spec) {
+        char *end;
+        long units = strtol(spec, &end, 10);
+        if (end == spec || units <= 0 || n == MLP_MAX_LAYERS) return -1;
+        sizes[n++] = units;
+        spec = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') return -1;
+    }
+    sizes[n++] = NN_OUTPUT_SIZE;
+    return n;
+}
+
+int train_mlp(const char *spec, int num_games, int bench,
+              uint64_t tournament_games, int num_threads, float epsilon)
+{
+    int sizes[MLP_MAX_LAYERS+1];
+    int num_sizes = parse_hidden_sizes(spec, sizes);
+    Mlp *m = num_sizes == -1 ? NULL : mlp_create(sizes, num_sizes);
+    if (m == NULL) {
+        fprintf(stderr, "Invalid hidden layers '%s'\n", spec);
+        return -1;
+    }
+
+    printf("Network");
+    for (int l = 0; l < num_sizes; l++) printf(" %d", sizes[l]);
+    printf(": %zu parameters (with padding), %d/%d specialized layers\n",
+           m->num_params, m->specialized, m->num_layers);
+
+    TrainStats ts = {0};
+    printf("Training against %d random games...\n", num_games);
+    for (int i = 0; i < num_games; i++) update_train_stats(&ts, mlp_random_game(m, 1));
+
+    int eval = 10000, wins = 0, losses = 0;
+    for (int i = 0; i < eval; i++) {
+        char winner = mlp_random_game(m, 0);
+        wins += winner == 'O';
+        losses += winner == 'X';
+    }
+    printf("Evaluation over %d random games: Wins: %.1f%%, Losses: %.1f%%, "
+           "Ties: %.1f%%\n", eval, wins * 100.0 / eval, losses * 100.0 / eval,
+           (eval - wins - losses) * 100.0 / eval);
+
+    if (bench) mlp_bench(m);
+    if (tournament_games) {
+        Agent agents[3] = {
+            {"random", AGENT_RANDOM, NULL, NULL, NULL},
+            {"perfect", AGENT_PERFECT, NULL, NULL, NULL},
+            {"mlp", AGENT_MLP, NULL, NULL, m}
+        };
+        run_tournament(agents, 3, tournament_games, num_threads, epsilon);
+    }
+    mlp_free(m);
+    return 0;
+}
+
+/* ============================== Other games ===============================
+ * --env connect4 trains an Mlp on any GameEnv (see env.h) the same way
+ * the rest of this file trains on tic tac toe: the network plays second
+ * against random, picking the best legal logit, and every finished game
+ * is learned with the usual rewards and targets. --env tictactoe runs the
+ * same code on our usual game, as a reference. */
+
+/* Best legal action of 'm' in 's'. */
+int env_predict_move(const GameEnv *env, Mlp *m, const EnvState *s) {
+    float inputs[ENV_MAX_INPUTS];
+    env->encode(s, inputs);
+    float *logits = mlp_forward(m, inputs);
+
+    uint64_t legal = env->legal(s);
+    int best = -1;
+    for (int a = 0; a < env->num_actions; a++) {
+        if (!(legal >> a & 1)) continue;
+        if (best == -1 || logits[a] > logits[best]) best = a;
+    }
+    return best;
+}
+
+/* learn_from_game() for any game: the network played the odd plies. */
+void env_learn_from_game(const GameEnv *env, Mlp *m, const int *moves,
+                         int num_moves, char winner)
+{
+    float reward = game_reward(&default_learn_params, winner, 'O');
+    float inputs[ENV_MAX_INPUTS], target[ENV_MAX_ACTIONS];
+    EnvState s;
+
+    env->reset(&s);
+    for (int i = 0; i < num_moves; i++) {
+        if (i & 1) {
+            float scaled_reward = reward * (0.5f + 0.5f * i / num_moves);
+            uint64_t legal = env->legal(&s);
+            memset(target, 0, sizeof(target));
+            if (scaled_reward >= 0) {
+                target[moves[i]] = 1;
+            } else {
+                /* Spread the target over the other legal moves. */
+                float other = 1.0f / (__builtin_popcountll(legal) - 1);
+                for (int a = 0; a < env->num_actions; a++)
+                    if ((legal >> a & 1) && a != moves[i]) target[a] = other;
+            }
+            env->encode(&s, inputs);
+            mlp_forward(m, inputs);
+            mlp_backward(m, target, LEARNING_RATE, scaled_reward, NULL);
+        }
+        env->apply(&s, moves[i]);
+    }
+}
+
+/* Play a game against random as the second player. Moves go in 'moves',
+ * that must hold env->max_moves entries. */
+char env_random_game(const GameEnv *env, Mlp *m, int *moves, int *num_moves,
+                     unsigned *seed)
+{
+    EnvState s;
+    char winner;
+
+    env->reset(&s);
+    *num_moves = 0;
+    do {
+        int move = (s.ply & 1) ? env_predict_move(env, m, &s) :
+                                 env_random_move(env, &s, rand_r(seed));
+        env->apply(&s, move);
+        moves[(*num_moves)++] = move;
+    } while (!env_terminal(env, &s, &winner));
+    return winner;
+}
+
+int train_env(const char *name, const char *spec, int num_games) {
+    const GameEnv *env = env_by_name(name);
+    if (env == NULL) {
+        fprintf(stderr, "Unknown game '%s'\n", name);
+        return -1;
+    }
+
+    int sizes[MLP_MAX_LAYERS+1];
+    int num_sizes = parse_hidden_sizes(spec, sizes);
+    Mlp *m = NULL;
+    if (num_sizes != -1) {
+        sizes[0] = env->num_inputs;
+        sizes[num_sizes-1] = env->num_actions;
+        m = mlp_create(sizes, num_sizes);
+    }
+    if (m == NULL) {
+        fprintf(stderr, "Invalid hidden layers '%s'\n", spec);
+        return -1;
+    }
+
+    printf("Training on %s: %d inputs, %d actions, hidden %s, "
+           "%zu parameters, %d games against random\n", env->name,
+           env->num_inputs, env->num_actions, spec, m->num_params, num_games);
+
+    int *moves = malloc(sizeof(int) * env->max_moves);
+    int num_moves, wins = 0, losses = 0, ties = 0;
+    uint64_t total_moves = 0;
+    unsigned seed = rand();
+    uint64_t start = monotonic_ns();
+    for (int g = 1; g <= num_games; g++) {
+        char winner = env_random_game(env, m, moves, &num_moves, &seed);
+        env_learn_from_game(env, m, moves, num_moves, winner);
+        total_moves += num_moves;
+        wins += winner == 'O';
+        losses += winner == 'X';
+        ties += winner == 'T';
+        if (g % 10000 == 0 || g == num_games) {
+            int played = wins + losses + ties;
+            double secs = (monotonic_ns() - start) / 1e9;
+            printf("Games: %d, Wins: %.1f%%, Losses: %.1f%%, Ties: %.1f%%, "
+                   "%.1f moves/game, %.0f games/s\n", g,
+                   wins * 100.0 / played, losses * 100.0 / played,
+                   ties * 100.0 / played, (double)total_moves / g, g / secs);
+            fflush(stdout);
+            wins = losses = ties = 0;
+        }
+    }
+    free(moves);
+    mlp_free(m);
+    return 0;
+}
+
+/* ======================= Population based training ========================
+ * --pbt K trains K networks at once, each with its own learning rate and
+ * rewards (LearnParams), and every --pbt-interval games per network:
+ *
+ * 1. Evaluates all of them against the random and the perfect player.
+ * 2. Exploit: the worst quarter is replaced by copies (weights and hyper
+ *    parameters) of networks from the best quarter.
+ * 3. Explore: the copied hyper parameters are perturbed by a random factor
+ *    of 0.8 or 1.25.
+ *
+ * So a single job searches hyper parameters while training. The whole
+ * population lives in one cache line aligned arena: members are padded
+ * to a multiple of the cache line, so threads training neighbor members
+ * never share a line, and copying a member is a single memcpy(). Members
+ * are split across the threads, and every thread uses its own seed. */
+
+typedef struct {
+    _Alignas(CACHE_LINE) NeuralNetwork nn;
+    LearnParams params;
+    unsigned seed;
+    double fitness;
+    int wins, losses, ties;     // Training games since the last round.
+    int id;                     // Changes when the member is replaced.
+} PBTMember;
+
+typedef struct {
+    pthread_t tid;
+    PBTMember *members;
+    int first, step, count;     // Members first, first+step, ... < count.
+    int games;                  // Training games per member this round.
+    int eval_games;
+} PBTWorker;
+
+/* Random float in [lo, hi) from a rand_r() seed. */
+float rand_uniform(unsigned *seed, float lo, float hi) {
+    return lo + (hi - lo) * ((float)rand_r(seed) / ((float)RAND_MAX + 1));
+}
+
+/* Score of a member: average score as O against random and against the
+ * perfect player. Against perfect the best possible score is 0.5 (all
+ * draws), so losses, the thing we care about the most, dominate. */
+double pbt_fitness(PBTMember *m, int games) {
+    Agent self = {"nn", AGENT_NN, &m->nn, NULL, NULL};
+    Agent random = {"random", AGENT_RANDOM, NULL, NULL, NULL};
+    Agent perfect = {"perfect", AGENT_PERFECT, NULL, NULL, NULL};
+    double score = 0;
+
+    for (int g = 0; g < games; g++) {
+        char w = tournament_game(&random, &self, &m->seed, 0);
+        score += (w == 'O') ? 1 : (w == 'T' ? 0.5 : 0);
+        w = tournament_game(&perfect, &self, &m->seed, 0);
+        score += (w == 'O') ? 1 : (w == 'T' ? 0.5 : 0);
+    }
+    return score / (games * 2);
+}
+
+void *pbt_worker(void *arg) {
+    PBTWorker *w = arg;
+    Trajectory t;
+
+    for (int i = w->first; i < w->count; i += w->step) {
+        PBTMember *m = &w->members[i];
+        m->wins = m->losses = m->ties = 0;
+        for (int g = 0; g < w->games; g++) {
+            actor_play_game(&m->nn, &m->seed, &t);
+            learn_from_game(&m->nn, NULL, &m->params, t.moves, t.num_moves,
+                            1, t.winner);
+            if (t.winner == 'O') m->wins++;
+            else if (t.winner == 'X') m->losses++;
+            else m->ties++;
+        }
+        m->fitness = pbt_fitness(m, w->eval_games);
+    }
+    return NULL;
+}
+
+int compare_pbt_fitness(const void *a, const void *b) {
+    const PBTMember *x = *(PBTMember**)a, *y = *(PBTMember**)b;
+    return (x->fitness < y->fitness) - (x->fitness > y->fitness);
+}
+
+/* Train a population of 'size' networks for 'num_games' games each, and
+ * copy the best one into 'nn'. */
+void train_population(NeuralNetwork *nn, int size, int num_games, int interval,
+                      int num_threads)
+{
+    if (size < 2) size = 2;
+    if (interval < 1) interval = 1;
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > size) num_threads = size;
+
+    PBTMember *members = aligned_alloc(CACHE_LINE, sizeof(PBTMember) * size);
+    PBTMember **rank = malloc(sizeof(PBTMember*) * size);
+    PBTWorker *workers = malloc(sizeof(PBTWorker) * num_threads);
+    int next_id = 0;
+
+    init_solver();
+    for (int i = 0; i < size; i++) {
+        PBTMember *m = &members[i];
+        init_neural_network(&m->nn);
+        m->seed = rand();
+        m->id = next_id++;
+        /* Learning rate is sampled log uniform in [0.01, 0.5]. */
+        m->params.learning_rate = 0.01f * powf(50.0f, rand_uniform(&m->seed, 0, 1));
+        m->params.reward_win = rand_uniform(&m->seed, 0.5f, 2.0f);
+        m->params.reward_draw = rand_uniform(&m->seed, 0.0f, 1.0f);
+        m->params.reward_loss = rand_uniform(&m->seed, -4.0f, -0.5f);
+    }
+
+    printf("Population training: %d networks, %d games each, "
+           "exploit/explore every %d games, %d threads\n",
+           size, num_games, interval, num_threads);
+
+    for (int done = 0; done < num_games; done += interval) {
+        int games = num_games - done < interval ? num_games - done : interval;
+        for (int j = 0; j < num_threads; j++) {
+            workers[j] = (PBTWorker){0, members, j, num_threads, size, games, 500};
+            pthread_create(&workers[j].tid, NULL, pbt_worker, &workers[j]);
+        }
+        for (int j = 0; j < num_threads; j++) pthread_join(workers[j].tid, NULL);
+
+        for (int i = 0; i < size; i++) rank[i] = &members[i];
+        qsort(rank, size, sizeof(PBTMember*), compare_pbt_fitness);
+
+        printf("\nAfter %d games per network:\n", done + games);
+        printf("  %4s %8s %8s %6s %6s %6s %7s %7s\n", "id", "fitness",
+               "lr", "win", "draw", "loss", "loss%", "tie%");
+        for (int i = 0; i < size; i++) {
+            PBTMember *m = rank[i];
+            printf("  %4d %8.4f %8.4f %6.2f %6.2f %6.2f %6.1f%% %6.1f%%\n",
+                   m->id, m->fitness, m->params.learning_rate,
+                   m->params.reward_win, m->params.reward_draw,
+                   m->params.reward_loss, m->losses * 100.0 / games,
+                   m->ties * 100.0 / games);
+        }
+        if (done + games >= num_games) break;
+
+        /* Exploit and explore. */
+        int quarter = size / 4 ? size / 4 : 1;
+        for (int i = 0; i < quarter; i++) {
+            PBTMember *loser = rank[size-1-i];
+            PBTMember *winner = rank[rand() % quarter];
+            unsigned seed = loser->seed;
+            memcpy(loser, winner, sizeof(PBTMember));
+            loser->seed = seed;
+            loser->id = next_id++;
+            float *hp = (float*)&loser->params;
+            for (size_t k = 0; k < sizeof(LearnParams)/sizeof(float); k++)
+                hp[k] *= (rand_r(&seed) & 1) ? 1.25f : 0.8f;
+            loser->seed = seed;
+        }
+    }
+
+    memcpy(nn, &rank[0]->nn, sizeof(NeuralNetwork));
+    printf("\nBest network: id %d, learning rate %.4f, rewards "
+           "win %.2f draw %.2f loss %.2f\n", rank[0]->id,
+           rank[0]->params.learning_rate, rank[0]->params.reward_win,
+           rank[0]->params.reward_draw, rank[0]->params.reward_loss);
+    free(members);
+    free(rank);
+    free(workers);
+}
+
+/* ========================= Evolution strategies ===========================
+ * --es G trains without backprop: every generation draws --es-pop
+ * perturbations of the weights, theta + sigma*eps, plays --es-games games
+ * with each of them, and moves theta toward the perturbations that did
+ * better:
+ *
+ *     theta += lr / (pop * sigma) * sum(utility[i] * eps[i])
+ *
+ * Perturbations come in antithetic pairs (+eps, -eps), and the utilities
+ * are centered ranks of the fitness values, so the step does not depend
+ * on the scale of the fitness.
+ *
+ * The noise eps[i] is generated from a 64 bit seed, so the only thing the
+ * workers need to agree on is the generation seed, and the only thing
+ * they report back is one float per perturbation. Every worker keeps its
+ * own copy of theta and applies the same update, so a generation costs a
+ * few hundred bytes of communication no matter how big the network is.
+ * Local threads share theta with the master; worker processes connect
+ * to the --es-listen Unix socket (./template --es-worker path) and get
+ * a copy of theta once, when they connect. */
+
+#define ES_PARAMS (sizeof(NeuralGradients)/sizeof(float))
+#define ES_MAX_WORKERS 64
+#define ES_MAGIC 0x31305345     // "ES01"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t games;             // Games per perturbation.
+    float sigma;
+    float lr;
+} EsHello;                      // Followed by ES_PARAMS floats of theta.
+
+typedef struct {
+    uint64_t seed;              // Generation seed.
+    uint64_t prev_seed;         // Seed of the generation 'prev' refers to.
+    uint32_t pop;               // Perturbations in the generation.
+    uint32_t first, count;      // The ones this worker evaluates.
+    uint32_t num_prev;          // Utilities of the previous generation that
+                                // follow, 0 if there is nothing to apply.
+} EsTask;
+
+typedef struct {
+    float sigma, lr;
+    int games;
+    float *theta;               // ES_PARAMS floats, a NeuralNetwork prefix.
+} EsState;
+
+typedef struct {
+    pthread_t tid;
+    EsState *es;
+    uint64_t seed;
+    int first, count;
+    float *fitness;             // Indexed by perturbation.
+} EsWorker;
+
+static inline uint64_t splitmix64(uint64_t *s) {
+    uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Fill 'eps' with the normal noise of pair 'pair' of the generation with
+ * the given seed. Box-Muller, two values per pair of uniforms. */
+void es_noise(uint64_t seed, int pair, float *eps) {
+    uint64_t s = seed ^ ((uint64_t)pair * 0xd1b54a32d192ed03ULL);
+    for (size_t i = 0; i < ES_PARAMS; i += 2) {
+        uint64_t r = splitmix64(&s);
+        float u1 = ((r >> 40) + 1) * (1.0f / 16777217.0f);  // (0, 1)
+        float u2 = ((r >> 16) & 0xffffff) * (1.0f / 16777216.0f);
+        float mag = sqrtf(-2 * logf(u1));
+        eps[i] = mag * cosf(2 * M_PI * u2);
+        if (i + 1 < ES_PARAMS) eps[i+1] = mag * sinf(2 * M_PI * u2);
+    }
+}
+
+/* Score of the network as O: half the games against random, half against
+ * the perfect player. 1 for a win, 0.5 for a draw. The opponent seed is
+ * the same for every perturbation of a generation, so they are compared
+ * on the same games as far as possible. */
+float es_fitness(NeuralNetwork *nn, int games, uint64_t seed) {
+    Agent self = {"nn", AGENT_NN, nn, NULL, NULL};
+    Agent random = {"random", AGENT_RANDOM, NULL, NULL, NULL};
+    Agent perfect = {"perfect", AGENT_PERFECT, NULL, NULL, NULL};
+    unsigned s = (unsigned)(seed ^ (seed >> 32));
+    float score = 0;
+
+    for (int g = 0; g < games; g++) {
+        char w = tournament_game((g & 1) ? &perfect : &random, &self, &s, 0);
+        score += (w == 'O') ? 1 : (w == 'T' ? 0.5f : 0);
+    }
+    return score / games;
+}
+
+/* Evaluate perturbations [first, first+count) of the generation. */
+void es_evaluate(EsState *es, uint64_t seed, int first, int count,
+                 float *fitness)
+{
+    NeuralNetwork nn;
+    float eps[ES_PARAMS];
+    float *w = (float*)&nn;
+
+    for (int i = first; i < first + count; i++) {
+        float sign = (i & 1) ? -es->sigma : es->sigma;
+        es_noise(seed, i / 2, eps);
+        for (size_t k = 0; k < ES_PARAMS; k++)
+            w[k] = es->theta[k] + sign * eps[k];
+        fitness[i - first] = es_fitness(&nn, es->games, seed);
+    }
+}
+
+void *es_worker_main(void *arg) {
+    EsWorker *w = arg;
+    es_evaluate(w->es, w->seed, w->first, w->count, w->fitness + w->first);
+    return NULL;
+}
+
+/* Turn fitness values into centered ranks in [-0.5, 0.5]. */
+void es_utilities(const float *fitness, float *util, int pop) {
+    for (int i = 0; i < pop; i++) {
+        int rank = 0;
+        for (int j = 0; j < pop; j++)
+            if (fitness[j] < fitness[i] || (fitness[j] == fitness[i] && j < i))
+                rank++;
+        util[i] = pop > 1 ? (float)rank / (pop - 1) - 0.5f : 0;
+    }
+}
+
+/* Apply the update of a generation. Every process runs this on its own
+ * theta, in the same order, so all the copies stay identical. */
+void es_update(EsState *es, uint64_t seed, const float *util, int pop) {
+    float eps[ES_PARAMS];
+    float step = es->lr / (pop * es->sigma);
+
+    for (int p = 0; p < pop / 2; p++) {
+        float u = util[p*2] - util[p*2+1];
+        if (u == 0) continue;
+        es_noise(seed, p, eps);
+        for (size_t k = 0; k < ES_PARAMS; k++)
+            es->theta[k] += step * u * eps[k];
+    }
+}
+
+/* Connect to a --es-listen master and evaluate the perturbations it asks
+ * for until it goes away. */
+int es_worker(const char *path, int num_threads) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, path, sizeof(sa.sun_path)-1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1)
+        return -1;
+
+    EsHello hello;
+    NeuralNetwork nn;
+    if (loadgen_io(fd, &hello, sizeof(hello), 0) == -1 ||
+        hello.magic != ES_MAGIC ||
+        loadgen_io(fd, &nn, ES_PARAMS * sizeof(float), 0) == -1)
+    {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    EsState es = {hello.sigma, hello.lr, hello.games, (float*)&nn};
+    if (num_threads < 1) num_threads = 1;
+    EsWorker *workers = malloc(sizeof(EsWorker) * num_threads);
+    printf("ES worker connected to %s, %d threads\n", path, num_threads);
+
+    EsTask task;
+    int generations = 0;
+    while (loadgen_io(fd, &task, sizeof(task), 0) == 0) {
+        float *util = malloc(sizeof(float) * (task.num_prev + 1));
+        float *fitness = malloc(sizeof(float) * (task.count + 1));
+        if (loadgen_io(fd, util, sizeof(float) * task.num_prev, 0) == -1) {
+            free(util);
+            free(fitness);
+            break;
+        }
+        if (task.num_prev) es_update(&es, task.prev_seed, util, task.num_prev);
+
+        /* Split the chunk across the local threads. */
+        for (int j = 0; j < num_threads; j++) {
+            int first = task.count * j / num_threads;
+            int last = task.count * (j+1) / num_threads;
+            workers[j] = (EsWorker){0, &es, task.seed, task.first + first,
+                                    last - first, fitness - task.first};
+            pthread_create(&workers[j].tid, NULL, es_worker_main, &workers[j]);
+        }
+        for (int j = 0; j < num_threads; j++) pthread_join(workers[j].tid, NULL);
+
+        int err = loadgen_io(fd, fitness, sizeof(float) * task.count, 1);
+        free(util);
+        free(fitness);
+        if (err == -1) break;
+        generations++;
+    }
+    printf("ES worker done after %d generations\n", generations);
+    free(workers);
+    close(fd);
+    return 0;
+}
+
+/* Train 'nn' for the given number of generations on 'num_threads' local
+ * threads, plus any worker process connecting to 'listen_path' (which
+ * may be NULL). */
+void train_evolution(NeuralNetwork *nn, int generations, int pop, int games,
+                     float sigma, float lr, int num_threads,
+                     const char *listen_path)
+{
+    if (pop < 2) pop = 2;
+    pop &= ~1;              // Antithetic pairs.
+    if (num_threads < 1) num_threads = 1;
+
+    EsState es = {sigma, lr, games, (float*)nn};
+    float *fitness = malloc(sizeof(float) * pop);
+    float *util = malloc(sizeof(float) * pop);
+    EsWorker *workers = malloc(sizeof(EsWorker) * num_threads);
+    int remote[ES_MAX_WORKERS], synced[ES_MAX_WORKERS], num_remote = 0;
+    int lfd = -1;
+    uint64_t prev_seed = 0;
+
+    if (listen_path) {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strncpy(sa.sun_path, listen_path, sizeof(sa.sun_path)-1);
+        unlink(listen_path);
+        lfd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0);
+        if (lfd == -1 || bind(lfd, (struct sockaddr*)&sa, sizeof(sa)) == -1 ||
+            listen(lfd, 16) == -1)
+        {
+            perror("Listening for ES workers");
+            if (lfd != -1) close(lfd);
+            lfd = -1;
+        }
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    init_solver();
+    printf("Evolution strategies: %d generations, population %d, "
+           "%d games each, sigma %g, lr %g, %d threads%s%s\n",
+           generations, pop, games, sigma, lr, num_threads,
+           lfd != -1 ? ", workers on " : "", lfd != -1 ? listen_path : "");
+
+    for (int gen = 0; gen < generations; gen++) {
+        uint64_t seed = ((uint64_t)rand() << 32) ^ rand() ^ gen;
+
+        /* Welcome the workers that connected since the last generation. */
+        int fd;
+        while (lfd != -1 && num_remote < ES_MAX_WORKERS &&
+               (fd = accept(lfd, NULL, NULL)) != -1)
+        {
+            EsHello hello = {ES_MAGIC, games, sigma, lr};
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            if (loadgen_io(fd, &hello, sizeof(hello), 1) == -1 ||
+                loadgen_io(fd, es.theta, ES_PARAMS * sizeof(float), 1) == -1)
+            {
+                close(fd);
+                continue;
+            }
+            synced[num_remote] = 1;
+            remote[num_remote++] = fd;
+            printf("ES worker %d connected\n", num_remote);
+        }
+
+        /* Hand out the work: one share per local thread and one per
+         * worker process. */
+        int shares = num_threads + num_remote;
+        for (int r = 0; r < num_remote; r++) {
+            int first = pop * (num_threads + r) / shares;
+            int last = pop * (num_threads + r + 1) / shares;
+            EsTask task = {seed, prev_seed, pop, first, last - first,
+                           synced[r] ? 0 : (gen ? pop : 0)};
+            if (loadgen_io(remote[r], &task, sizeof(task), 1) == -1 ||
+                loadgen_io(remote[r], util, sizeof(float) * task.num_prev, 1) == -1)
+            {
+                close(remote[r]);
+                remote[r] = -1;
+            }
+            synced[r] = 0;
+        }
+        for (int j = 0; j < num_threads; j++) {
+            int first = pop * j / shares, last = pop * (j+1) / shares;
+            workers[j] = (EsWorker){0, &es, seed, first, last - first, fitness};
+            pthread_create(&workers[j].tid, NULL, es_worker_main, &workers[j]);
+        }
+        for (int j = 0; j < num_threads; j++) pthread_join(workers[j].tid, NULL);
+
+        /* Collect the remote results. A worker that went away has its
+         * share evaluated here instead. */
+        for (int r = 0; r < num_remote; r++) {
+            int first = pop * (num_threads + r) / shares;
+            int last = pop * (num_threads + r + 1) / shares;
+            if (remote[r] != -1 &&
+                loadgen_io(remote[r], fitness + first,
+                           sizeof(float) * (last - first), 0) == -1)
+            {
+                close(remote[r]);
+                remote[r] = -1;
+            }
+            if (remote[r] == -1) {
+                printf("ES worker %d went away\n", r + 1);
+                es_evaluate(&es, seed, first, last - first, fitness + first);
+            }
+        }
+        int alive = 0;
+        for (int r = 0; r < num_remote; r++) {
+            if (remote[r] == -1) continue;
+            synced[alive] = synced[r];
+            remote[alive++] = remote[r];
+        }
+        num_remote = alive;
+
+        es_utilities(fitness, util, pop);
+        es_update(&es, seed, util, pop);
+        prev_seed = seed;
+
+        if ((gen + 1) % 10 == 0 || gen + 1 == generations) {
+            float mean = 0;
+            for (int i = 0; i < pop; i++) mean += fitness[i];
+            printf("Generation %d: mean fitness %.4f, theta fitness %.4f, "
+                   "%d workers\n", gen + 1, mean / pop,
+                   es_fitness(nn, 1000, seed), num_remote);
+            fflush(stdout);
+        }
+    }
+
+    for (int r = 0; r < num_remote; r++) close(remote[r]);
+    if (lfd != -1) {
+        close(lfd);
+        unlink(listen_path);
+    }
+    free(fitness);
+    free(util);
+    free(workers);
+}
+
+/* ============================ Parameter server ============================
+ * --ps addr trains with self-play worker processes instead of threads.
+ * The server owns the weights; workers (./template --ps-worker addr, or
+ * --ps-workers n to fork them locally) pull the weights, play a batch of
+ * games against random, and push back either the summed gradients of the
+ * batch or, with --ps-traj, the games themselves, which the server then
+ * learns from. 'addr' is a Unix socket path, or [host]:port for TCP,
+ * by default on the loopback interface.
+ *
+ * Every update bumps the weights version, and every push carries the
+ * version it was computed from. With --ps-staleness S a push that is more
+ * than S versions old is rejected, and workers pull again as soon as
+ * their copy is more than S versions behind (bounded staleness, S = 0 is
+ * close to synchronous training). Without it updates are fully
+ * asynchronous: pushes are always applied, and workers pull after every
+ * push.
+ *
+ * Gradient pushes are averaged over the games of the batch, like in
+ * train_from_log(), and the default --ps-lr is 0.3 for them; learning
+ * from trajectories uses the usual per move learning rate. */
+
+#define PS_PULL 1
+#define PS_PUSH_GRAD 2
+#define PS_PUSH_TRAJ 3
+
+#define PS_FLAG_DONE 1          // Training is over, disconnect.
+#define PS_FLAG_REJECTED 2      // The push was too stale.
+#define PS_FLAG_TRAJ 4          // Push trajectories, not gradients.
+
+typedef struct {
+    uint32_t type;
+    uint32_t version;           // Weights version the push comes from.
+    uint32_t count;             // Games in the push.
+    uint32_t wins, losses, ties;
+} PSRequest;                    // Push: followed by gradients/trajectories.
+
+typedef struct {
+    uint32_t version;           // Current weights version.
+    uint32_t flags;
+    int32_t staleness;          // -1 for asynchronous.
+    uint32_t batch;             // Games per push.
+} PSReply;                      // Pull: followed by the weights.
+
+typedef struct {
+    pthread_mutex_t lock;
+    NeuralNetwork *nn;
+    uint32_t version;
+    int staleness;
+    int batch;
+    int traj;
+    float lr;
+    uint64_t target_games;
+    uint64_t games, wins, losses, ties;
+    uint64_t pushes, rejected, pulls, lag;
+    int workers;
+} ParamServer;
+
+typedef struct {
+    ParamServer *ps;
+    int fd;
+} PSConnection;
+
+/* Parse a Unix socket path or [host]:port into 'sa'. Returns the address
+ * length, or -1 on error. */
+socklen_t ps_address(const char *addr, struct sockaddr_storage *sa) {
+    const char *colon = strrchr(addr, ':');
+    memset(sa, 0, sizeof(*sa));
+
+    if (colon == NULL) {
+        struct sockaddr_un *un = (struct sockaddr_un*)sa;
+        if (strlen(addr) >= sizeof(un->sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, addr);
+        return sizeof(*un);
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in*)sa;
+    char host[64] = "127.0.0.1";
+    size_t hostlen = colon - addr;
+    if (hostlen >= sizeof(host)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (hostlen) {
+        memcpy(host, addr, hostlen);
+        host[hostlen] = '\0';
+    }
+    in->sin_family = AF_INET;
+    in->sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &in->sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return sizeof(*in);
+}
+
+/* A trajectory pushed by a worker is peer data: learn_from_game() uses
+ * its moves as indexes, so only accept complete legal games of 1 to 9
+ * distinct moves with a known result. */
+int ps_valid_trajectory(const Trajectory *t) {
+    if (t->num_moves < 1 || t->num_moves > 9) return 0;
+    if (t->winner != 'X' && t->winner != 'O' && t->winner != 'T') return 0;
+    unsigned seen = 0;
+    for (int i = 0; i < t->num_moves; i++) {
+        if (t->moves[i] < 0 || t->moves[i] > 8 || seen & (1u << t->moves[i]))
+            return 0;
+        seen |= 1u << t->moves[i];
+    }
+    return 1;
+}
+
+/* Serve one worker until it disconnects. */
+void *ps_connection_main(void *arg) {
+    PSConnection *c = arg;
+    ParamServer *ps = c->ps;
+    NeuralGradients *grad = malloc(sizeof(NeuralGradients));
+    Trajectory *traj = malloc(sizeof(Trajectory) * ps->batch);
+    PSRequest req;
+    PSReply reply;
+
+    while (loadgen_io(c->fd, &req, sizeof(req), 0) == 0) {
+        reply.flags = ps->traj ? PS_FLAG_TRAJ : 0;
+        reply.staleness = ps->staleness;
+        reply.batch = ps->batch;
+
+        if (req.type == PS_PULL) {
+            /* Copy under the lock, send without it. */
+            pthread_mutex_lock(&ps->lock);
+            memcpy(grad, ps->nn, sizeof(NeuralGradients));
+            reply.version = ps->version;
+            if (ps->games >= ps->target_games) reply.flags |= PS_FLAG_DONE;
+            ps->pulls++;
+            pthread_mutex_unlock(&ps->lock);
+            if (loadgen_io(c->fd, &reply, sizeof(reply), 1) == -1 ||
+                loadgen_io(c->fd, grad, sizeof(NeuralGradients), 1) == -1)
+                break;
+            continue;
+        }
+
+        /* Push: read the payload first, then update under the lock. The
+         * gradients are averaged over 'count' games, so it can't be 0. */
+        if (req.type == PS_PUSH_GRAD && req.count > 0 &&
+            req.count <= (uint32_t)ps->batch)
+        {
+            if (loadgen_io(c->fd, grad, sizeof(NeuralGradients), 0) == -1)
+                break;
+        } else if (req.type == PS_PUSH_TRAJ && req.count <= (uint32_t)ps->batch) {
+            if (loadgen_io(c->fd, traj, sizeof(Trajectory) * req.count, 0) == -1)
+                break;
+            uint32_t i = 0;
+            while (i < req.count && ps_valid_trajectory(&traj[i])) i++;
+            if (i < req.count) break;   // Protocol error.
+        } else {
+            break;  // Protocol error.
+        }
+
+        pthread_mutex_lock(&ps->lock);
+        uint32_t lag = ps->version - req.version;
+        if (ps->staleness >= 0 && lag > (uint32_t)ps->staleness) {
+            reply.flags |= PS_FLAG_REJECTED;
+            ps->rejected++;
+        } else {
+            if (req.type == PS_PUSH_GRAD) {
+                apply_gradients(ps->nn, grad, ps->lr / req.count);
+            } else {
+                LearnParams lp = default_learn_params;
+                lp.learning_rate = ps->lr;
+                for (uint32_t i = 0; i < req.count; i++)
+                    learn_from_game(ps->nn, NULL, &lp, traj[i].moves,
+                                    traj[i].num_moves, 1, traj[i].winner);
+            }
+            ps->version++;
+            ps->pushes++;
+            ps->lag += lag;
+        }
+        /* Games count toward the target even when rejected: they are
+         * the work the workers did. */
+        ps->games += req.count;
+        ps->wins += req.wins;
+        ps->losses += req.losses;
+        ps->ties += req.ties;
+        reply.version = ps->version;
+        if (ps->games >= ps->target_games) reply.flags |= PS_FLAG_DONE;
+        pthread_mutex_unlock(&ps->lock);
+
+        if (loadgen_io(c->fd, &reply, sizeof(reply), 1) == -1) break;
+    }
+
+    pthread_mutex_lock(&ps->lock);
+    ps->workers--;
+    pthread_mutex_unlock(&ps->lock);
+    close(c->fd);
+    free(grad);
+    free(traj);
+    free(c);
+    return NULL;
+}
+
+/* Pull the weights into 'nn'. Returns the reply, with PS_FLAG_DONE also
+ * set on I/O errors. */
+PSReply ps_pull(int fd, NeuralNetwork *nn) {
+    PSRequest req = {PS_PULL, 0, 0, 0, 0, 0};
+    PSReply reply = {0, PS_FLAG_DONE, 0, 0};
+    if (loadgen_io(fd, &req, sizeof(req), 1) == -1 ||
+        loadgen_io(fd, &reply, sizeof(reply), 0) == -1 ||
+        loadgen_io(fd, nn, sizeof(NeuralGradients), 0) == -1)
+        reply.flags = PS_FLAG_DONE;
+    return reply;
+}
+
+/* Self-play worker: connect to the server at 'addr' and play batches of
+ * games until the server says it's done. */
+int ps_worker(const char *addr) {
+    struct sockaddr_storage sa;
+    socklen_t salen = ps_address(addr, &sa);
+    if (salen == (socklen_t)-1) return -1;
+    int fd = socket(sa.ss_family, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&sa, salen) == -1) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    if (sa.ss_family == AF_INET) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    NeuralNetwork *nn = malloc(sizeof(NeuralNetwork));
+    NeuralGradients *grad = malloc(sizeof(NeuralGradients));
+    PSReply reply = ps_pull(fd, nn);
+    Trajectory *traj = calloc(reply.batch ? reply.batch : 1, sizeof(Trajectory));
+    uint32_t version = reply.version;
+    unsigned seed = time(NULL) ^ getpid();
+    uint64_t pushes = 0, pulls = 1, rejected = 0;
+
+    while (!(reply.flags & PS_FLAG_DONE)) {
+        PSRequest req = {0, version, reply.batch, 0, 0, 0};
+        int traj_mode = reply.flags & PS_FLAG_TRAJ;
+
+        memset(grad, 0, sizeof(NeuralGradients));
+        for (uint32_t g = 0; g < reply.batch; g++) {
+            Trajectory *t = &traj[g];
+            actor_play_game(nn, &seed, t);
+            if (!traj_mode)
+                learn_from_game(nn, grad, NULL, t->moves, t->num_moves, 1,
+                                t->winner);
+            if (t->winner == 'O') req.wins++;
+            else if (t->winner == 'X') req.losses++;
+            else req.ties++;
+        }
+        req.type = traj_mode ? PS_PUSH_TRAJ : PS_PUSH_GRAD;
+        if (loadgen_io(fd, &req, sizeof(req), 1) == -1 ||
+            (traj_mode ?
+             loadgen_io(fd, traj, sizeof(Trajectory) * req.count, 1) :
+             loadgen_io(fd, grad, sizeof(NeuralGradients), 1)) == -1 ||
+            loadgen_io(fd, &reply, sizeof(reply), 0) == -1)
+            break;
+        pushes++;
+        if (reply.flags & PS_FLAG_REJECTED) rejected++;
+        if (reply.flags & PS_FLAG_DONE) break;
+
+        /* Refresh the weights when they are too stale, or always if
+         * updates are asynchronous. */
+        if (reply.staleness < 0 || (reply.flags & PS_FLAG_REJECTED) ||
+            reply.version - version > (uint32_t)reply.staleness)
+        {
+            reply = ps_pull(fd, nn);
+            version = reply.version;
+            pulls++;
+        }
+    }
+    printf("Worker %d: %llu pushes (%llu rejected), %llu pulls\n",
+           (int)getpid(), (unsigned long long)pushes,
+           (unsigned long long)rejected, (unsigned long long)pulls);
+    close(fd);
+    free(nn);
+    free(grad);
+    free(traj);
+    return 0;
+}
+
+/* Run the parameter server on 'addr' until 'num_games' games have been
+ * played by the workers. If 'spawn' > 0 that many workers are forked. */
+int train_param_server(NeuralNetwork *nn, const char *addr, int num_games,
+                       int batch, int staleness, int traj, float lr, int spawn)
+{
+    struct sockaddr_storage sa;
+    socklen_t salen = ps_address(addr, &sa);
+    if (salen == (socklen_t)-1) return -1;
+    int lfd = socket(sa.ss_family, SOCK_STREAM, 0);
+    if (lfd == -1) return -1;
+    if (sa.ss_family == AF_UNIX) {
+        unlink(addr);
+    } else {
+        int one = 1;
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(lfd, (struct sockaddr*)&sa, salen) == -1 ||
+        listen(lfd, 64) == -1)
+    {
+        close(lfd);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    ParamServer ps = {0};
+    pthread_mutex_init(&ps.lock, NULL);
+    ps.nn = nn;
+    ps.staleness = staleness;
+    ps.batch = batch > 0 ? batch : 1;
+    ps.traj = traj;
+    ps.lr = lr > 0 ? lr : (traj ? LEARNING_RATE : 0.3f);
+    ps.target_games = num_games;
+
+    printf("Parameter server on %s: %d games, %d per push, %s updates "
+           "(staleness %d), pushing %s, learning rate %g\n", addr,
+           num_games, ps.batch,
+           staleness < 0 ? "asynchronous" : "bounded staleness", staleness,
+           traj ? "trajectories" : "gradients", ps.lr);
+    fflush(stdout);
+
+    for (int i = 0; i < spawn; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(lfd);
+            exit(ps_worker(addr) == -1 ? 1 : 0);
+        }
+    }
+
+    uint64_t last_games = 0;
+    uint64_t last_report = monotonic_ns();
+    int seen_workers = 0;
+    while (1) {
+        struct pollfd pfd = {lfd, POLLIN, 0};
+        if (poll(&pfd, 1, 100) == 1) {
+            int fd = accept(lfd, NULL, NULL);
+            if (fd != -1) {
+                if (sa.ss_family == AF_INET) {
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                }
+                PSConnection *c = malloc(sizeof(*c));
+                c->ps = &ps;
+                c->fd = fd;
+                pthread_t tid;
+                pthread_mutex_lock(&ps.lock);
+                ps.workers++;
+                pthread_mutex_unlock(&ps.lock);
+                seen_workers++;
+                pthread_create(&tid, NULL, ps_connection_main, c);
+                pthread_detach(tid);
+            }
+        }
+
+        pthread_mutex_lock(&ps.lock);
+        int finished = ps.games >= ps.target_games && ps.workers == 0 &&
+                       seen_workers;
+        uint64_t now = monotonic_ns();
+        if (now - last_report >= 1000000000ULL || finished) {
+            uint64_t played = ps.games - last_games;
+            printf("Version %u: %llu games (%.0f games/s), %d workers, "
+                   "%llu pushes, %llu rejected, avg lag %.2f, "
+                   "losses %.2f%%\n", ps.version,
+                   (unsigned long long)ps.games,
+                   played * 1e9 / (now - last_report), ps.workers,
+                   (unsigned long long)ps.pushes,
+                   (unsigned long long)ps.rejected,
+                   ps.pushes ? (double)ps.lag / ps.pushes : 0,
+                   ps.games ? ps.losses * 100.0 / ps.games : 0);
+            fflush(stdout);
+            last_games = ps.games;
+            last_report = now;
+        }
+        pthread_mutex_unlock(&ps.lock);
+        if (finished) break;
+    }
+
+    while (spawn > 0 && wait(NULL) > 0);
+    close(lfd);
+    if (sa.ss_family == AF_UNIX) unlink(addr);
+    pthread_mutex_destroy(&ps.lock);
+    return 0;
+}
+
+/* ============================== Live metrics ==============================
+ * With --metrics, a publisher thread wakes up every interval, sums the
+ * TrainMetrics slots of the training threads (see metrics_register()) and
+ * writes them in the Prometheus text format to a file, replaced with a
+ * rename so readers never see a partial one. A node exporter textfile
+ * collector can pick it up, or anything can just read it; a path under
+ * /dev/shm keeps it in memory. Besides the counters it computes the rates
+ * over the last interval and the win rate and average update norm over
+ * the last METRICS_WINDOW intervals.
+ *
+ * The training threads never wait for the publisher: they only do relaxed
+ * stores to their own cache line, and a sum that is read while they are
+ * updating is at most one game or update behind. */
+
+#define METRICS_WINDOW 10
+
+typedef struct {
+    uint64_t time_ns;
+    unsigned long games, moves, wins, losses, ties, updates;
+    double update_norm;
+} MetricsSample;
+
+typedef struct {
+    pthread_t tid;
+    const char *path;
+    long interval_ms;
+    atomic_int stop;
+    MetricsSample window[METRICS_WINDOW+1];     // Ring of samples.
+    int samples;
+} MetricsPublisher;
+
+MetricsPublisher metrics_publisher;
+
+void metrics_sample(MetricsSample *s) {
+    memset(s, 0, sizeof(*s));
+    s->time_ns = monotonic_ns();
+    int used = atomic_load(&metrics_used);
+    if (used > METRICS_MAX_THREADS) used = METRICS_MAX_THREADS;
+    for (int t = 0; t < used; t++) {
+        TrainMetrics *m = &metrics_slots[t];
+        s->games += atomic_load_explicit(&m->games, memory_order_relaxed);
+        s->moves += atomic_load_explicit(&m->moves, memory_order_relaxed);
+        s->wins += atomic_load_explicit(&m->wins, memory_order_relaxed);
+        s->losses += atomic_load_explicit(&m->losses, memory_order_relaxed);
+        s->ties += atomic_load_explicit(&m->ties, memory_order_relaxed);
+        s->updates += atomic_load_explicit(&m->updates, memory_order_relaxed);
+        s->update_norm += atomic_load_explicit(&m->update_norm, memory_order_relaxed);
+    }
+}
+
+void metrics_write_counter(FILE *fp, const char *name, const char *help,
+                           const char *type, double value)
+{
+    fprintf(fp, "# HELP ttt_%s %s\n# TYPE ttt_%s %s\nttt_%s %.15g\n",
+            name, help, name, type, name, value);
+}
+
+/* Take a sample and write the metrics file. Returns -1 on error. */
+int metrics_publish(MetricsPublisher *p) {
+    MetricsSample *cur = &p->window[p->samples % (METRICS_WINDOW+1)];
+    metrics_sample(cur);
+    int oldest = p->samples > METRICS_WINDOW ? p->samples - METRICS_WINDOW : 0;
+    MetricsSample *last = &p->window[(p->samples ? p->samples - 1 : 0) % (METRICS_WINDOW+1)];
+    MetricsSample *first = &p->window[oldest % (METRICS_WINDOW+1)];
+    p->samples++;
+
+    double secs = (cur->time_ns - last->time_ns) / 1e9;
+    if (secs <= 0) secs = 1;
+    unsigned long games = cur->games - first->games;
+    unsigned long updates = cur->updates - first->updates;
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", p->path);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) return -1;
+    metrics_write_counter(fp, "games_total", "Training games played.",
+                          "counter", cur->games);
+    metrics_write_counter(fp, "moves_total", "Moves of the training games.",
+                          "counter", cur->moves);
+    metrics_write_counter(fp, "updates_total", "Weight updates.",
+                          "counter", cur->updates);
+    metrics_write_counter(fp, "games_per_second", "Games per second.",
+                          "gauge", (cur->games - last->games) / secs);
+    metrics_write_counter(fp, "moves_per_second", "Moves per second.",
+                          "gauge", (cur->moves - last->moves) / secs);
+    metrics_write_counter(fp, "updates_per_second", "Weight updates per second.",
+                          "gauge", (cur->updates - last->updates) / secs);
+    metrics_write_counter(fp, "win_rate", "Wins of the network, recent games.",
+                          "gauge", games ? (double)(cur->wins - first->wins) / games : 0);
+    metrics_write_counter(fp, "loss_rate", "Losses of the network, recent games.",
+                          "gauge", games ? (double)(cur->losses - first->losses) / games : 0);
+    metrics_write_counter(fp, "tie_rate", "Ties, recent games.",
+                          "gauge", games ? (double)(cur->ties - first->ties) / games : 0);
+    metrics_write_counter(fp, "update_norm", "Average L2 norm of the recent "
+                          "weight updates.", "gauge",
+                          updates ? (cur->update_norm - first->update_norm) / updates : 0);
+    metrics_write_counter(fp, "threads", "Training threads reporting.",
+                          "gauge", atomic_load(&metrics_used));
+    if (fclose(fp) == EOF) return -1;
+    return rename(tmp, p->path);
+}
+
+void *metrics_main(void *arg) {
+    MetricsPublisher *p = arg;
+    struct timespec ts = {p->interval_ms / 1000, (p->interval_ms % 1000) * 1000000};
+
+    while (!atomic_load(&p->stop)) {
+        nanosleep(&ts, NULL);
+        if (metrics_publish(p) == -1) perror(p->path);
+    }
+    return NULL;
+}
+
+/* Enable the metrics and start publishing to 'path' every 'interval_ms'.
+ * Must be called before the training threads start. */
+void metrics_start(const char *path, long interval_ms) {
+    MetricsPublisher *p = &metrics_publisher;
+    memset(p, 0, sizeof(*p));
+    p->path = path;
+    p->interval_ms = interval_ms > 0 ? interval_ms : 1000;
+    atomic_store(&metrics_enabled, 1);
+    metrics_sample(&p->window[0]);
+    p->samples = 1;
+    pthread_create(&p->tid, NULL, metrics_main, p);
+}
+
+/* Stop the publisher, writing the final values. */
+void metrics_stop(void) {
+    MetricsPublisher *p = &metrics_publisher;
+    atomic_store(&p->stop, 1);
+    pthread_join(p->tid, NULL);
+    if (metrics_publish(p) == -1) perror(p->path);
+}
+
+/* ============================== Softmax check =============================
+ * softmax(), softmax_masked() and softmax_xent_delta() use fast_expf()
+ * instead of expf(). --check-softmax measures what that costs in accuracy
+ * against expf() and a double precision softmax, and what it gains in
+ * speed against the previous expf() softmax. Exits with an error if the
+ * errors are above the bounds below. */
+
+#define CHECK_EXP_MAX_REL 1e-6          // fast_expf() vs expf().
+#define CHECK_SOFTMAX_MAX_ABS 1e-6      // Any probability or delta.
+
+/* The previous softmax, as the reference for timings. */
+void softmax_expf(float *input, float *output, int size) {
+    float max_val = input[0];
+    for (int i = 1; i < size; i++) {
+        if (input[i] > max_val) max_val = input[i];
+    }
+    float sum = 0.0f;
+    for (int i = 0; i < size; i++) {
+        output[i] = expf(input[i] - max_val);
+        sum += output[i];
+    }
+    for (int i = 0; i < size; i++) output[i] /= sum;
+}
+
+/* Softmax in double over the moves in 'legal'. */
+void softmax_reference(const float *input, unsigned legal, double *output,
+                       int size)
+{
+    double max_val = -INFINITY, sum = 0;
+    for (int i = 0; i < size; i++)
+        if ((legal >> i) & 1 && input[i] > max_val) max_val = input[i];
+    for (int i = 0; i < size; i++) {
+        output[i] = (legal >> i) & 1 ? exp(input[i] - max_val) : 0;
+        sum += output[i];
+    }
+    for (int i = 0; i < size; i++) output[i] /= sum;
+}
+
+int check_softmax(void) {
+    const int samples = 1000000;
+    int failed = 0;
+
+    /* fast_expf() over its whole range, with the worst relative error. */
+    double exp_err = 0;
+    float exp_worst = 0;
+    for (int i = 0; i <= samples; i++) {
+        float x = -87.0f + 175.0f * i / samples;
+        double err = fabs((double)fast_expf(x) - expf(x)) / expf(x);
+        if (err > exp_err) {
+            exp_err = err;
+            exp_worst = x;
+        }
+    }
+    printf("fast_expf: max relative error %.3g at x = %g (bound %g)\n",
+           exp_err, exp_worst, CHECK_EXP_MAX_REL);
+    failed |= exp_err > CHECK_EXP_MAX_REL;
+
+    /* Random logits, in the range a trained network produces and beyond,
+     * and random legal masks and targets. */
+    float *logits = malloc(sizeof(float) * NN_OUTPUT_SIZE * samples);
+    unsigned *legal = malloc(sizeof(unsigned) * samples);
+    float target[NN_OUTPUT_SIZE] = {0};
+    for (int s = 0; s < samples; s++) {
+        float range = (s % 4 + 1) * 10.0f;
+        for (int i = 0; i < NN_OUTPUT_SIZE; i++)
+            logits[s*NN_OUTPUT_SIZE+i] = range * (2.0f * rand() / RAND_MAX - 1);
+        legal[s] = rand() & 0x1ff;
+        if (legal[s] == 0) legal[s] = 1 << (rand() % 9);
+    }
+
+    double err_full = 0, err_masked = 0, err_delta = 0, sum_err = 0;
+    int illegal_nonzero = 0;
+    for (int s = 0; s < samples; s++) {
+        float *l = logits + s*NN_OUTPUT_SIZE;
+        float out[NN_OUTPUT_SIZE], delta[NN_OUTPUT_SIZE];
+        double ref[NN_OUTPUT_SIZE], sum = 0;
+
+        target[s % NN_OUTPUT_SIZE] = 1;
+        softmax_reference(l, 0x1ff, ref, NN_OUTPUT_SIZE);
+        softmax(l, out, NN_OUTPUT_SIZE);
+        softmax_xent_delta(l, target, 1, delta, NN_OUTPUT_SIZE);
+        for (int i = 0; i < NN_OUTPUT_SIZE; i++) {
+            err_full = fmax(err_full, fabs(out[i] - ref[i]));
+            err_delta = fmax(err_delta, fabs(delta[i] - (ref[i] - target[i])));
+        }
+        target[s % NN_OUTPUT_SIZE] = 0;
+
+        softmax_reference(l, legal[s], ref, NN_OUTPUT_SIZE);
+        softmax_masked(l, legal[s], out, NN_OUTPUT_SIZE);
+        for (int i = 0; i < NN_OUTPUT_SIZE; i++) {
+            err_masked = fmax(err_masked, fabs(out[i] - ref[i]));
+            if (!((legal[s] >> i) & 1) && out[i] != 0) illegal_nonzero++;
+            sum += out[i];
+        }
+        sum_err = fmax(sum_err, fabs(sum - 1));
+    }
+    printf("softmax: max abs error %.3g\n", err_full);
+    printf("softmax_masked: max abs error %.3g, max |sum-1| %.3g, "
+           "%d illegal moves with p > 0\n", err_masked, sum_err,
+           illegal_nonzero);
+    printf("softmax_xent_delta: max abs error %.3g (bound %g)\n",
+           err_delta, CHECK_SOFTMAX_MAX_ABS);
+    failed |= err_full > CHECK_SOFTMAX_MAX_ABS ||
+              err_masked > CHECK_SOFTMAX_MAX_ABS ||
+              err_delta > CHECK_SOFTMAX_MAX_ABS ||
+              sum_err > CHECK_SOFTMAX_MAX_ABS || illegal_nonzero;
+
+    /* Timings, over the same logits. */
+    float out[NN_OUTPUT_SIZE];
+    volatile float sink = 0;
+    uint64_t start = monotonic_ns();
+    for (int s = 0; s < samples; s++) {
+        softmax_expf(logits + s*NN_OUTPUT_SIZE, out, NN_OUTPUT_SIZE);
+        sink += out[0];
+    }
+    double t_expf = (double)(monotonic_ns() - start) / samples;
+    start = monotonic_ns();
+    for (int s = 0; s < samples; s++) {
+        softmax(logits + s*NN_OUTPUT_SIZE, out, NN_OUTPUT_SIZE);
+        sink += out[0];
+    }
+    double t_fast = (double)(monotonic_ns() - start) / samples;
+    start = monotonic_ns();
+    for (int s = 0; s < samples; s++) {
+        softmax_masked(logits + s*NN_OUTPUT_SIZE, legal[s], out, NN_OUTPUT_SIZE);
+        sink += out[0];
+    }
+    double t_masked = (double)(monotonic_ns() - start) / samples;
+    printf("Time per softmax: %.1f ns with expf(), %.1f ns fast, "
+           "%.1f ns masked\n", t_expf, t_fast, t_masked);
+
+    free(logits);
+    free(legal);
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed;
+}
+
+/* Print statistics about a game log, reading it back with the mmap
+ * reader. Useful to check what a dataset contains before training on it. */
+int dump_game_log(const char *path) {
+    GameLogReader *r = gamelog_open(path, 1);
+    if (r == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    GameLogIter it;
+    const unsigned char *rec;
+    uint64_t results[128] = {0};
+    uint64_t total_moves = 0, invalid = 0;
+    int moves[9];
+    char winner;
+
+    gamelog_iter_init(&it, r);
+    while ((rec = gamelog_next(&it)) != NULL) {
+        int num_moves = gamelog_decode(rec, moves, &winner);
+        if (num_moves == -1) {
+            invalid++;
+            continue;
+        }
+        total_moves += num_moves;
+        results[(unsigned char)winner & 127]++;
+    }
+
+    uint64_t n = r->num_records;
+    printf("%s: %llu games in %llu blocks, %zu bytes, checksums %s\n",
+           path, (unsigned long long)n, (unsigned long long)r->num_blocks,
+           r->size, (r->flags & GAMELOG_FLAG_CHECKSUM) ? "on" : "off");
+    if (n) {
+        printf("X wins: %llu (%.1f%%), O wins: %llu (%.1f%%), "
+               "Ties: %llu (%.1f%%), Avg moves: %.2f\n",
+               (unsigned long long)results['X'], results['X'] * 100.0 / n,
+               (unsigned long long)results['O'], results['O'] * 100.0 / n,
+               (unsigned long long)results['T'], results['T'] * 100.0 / n,
+               n > invalid ? (double)total_moves / (n - invalid) : 0.0);
+    }
+    if (invalid)
+        printf("Invalid records (bad moves): %llu\n", (unsigned long long)invalid);
+    gamelog_release(r);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int random_games = 150000; // Fast and enough to play in a decent way.
+    int random_games_set = 0;
+    const char *log_path = NULL;
+    uint32_t log_flags = GAMELOG_FLAG_CHECKSUM;
+    const char *train_log = NULL;
+    const char *load_path = NULL;
+    const char *save_path = NULL;
+    int threads = 4, batch = 32, epochs = 1, learn_x = 0, interactive = 1;
+    int pool_size = 0, actors = 0, publish_every = 64;
+    const char *serve_path = NULL;
+    const char *policy_path = NULL, *export_path = NULL;
+    int export_c = 0, export_probs = 0;
+    int tournament_games = 0, threads_set = 0;
+    const char *qtable_path = NULL;
+    const char *model_paths[MAX_AGENTS];
+    int num_models = 0;
+    float epsilon = 0;
+    int population = 0, pbt_interval = 5000;
+    int es_generations = 0, es_pop = 64, es_games = 50;
+    float es_sigma = 0.05f, es_lr = 0.1f;
+    char *es_listen = NULL;
+    char *ps_addr = NULL;
+    char *hidden = NULL;
+    char *env_name = NULL;
+    int mlp_bench_set = 0;
+    int ponder = 0;
+    int ps_batch = 16, ps_staleness = -1, ps_traj = 0, ps_spawn = 0;
+    float ps_lr = 0;
+    long batch_window = 50;
+    const char *metrics_path = NULL;
+    const char *checkpoint_path = NULL;
+    const char *optimizer_name = NULL;
+    float optimizer_lr = 0;
+    const char *eval_opponent = NULL;
+    int eval_games = 10000, eval_patience = 3;
+    float eval_target = 1;
+    int curriculum = 0, snapshot_every = 5000;
+    float curriculum_epsilon = 0.1f;
+    float prune_freq = -1, prune_weight_min = 0;
+    long metrics_interval = 1000;
+    int clients = 8, requests = 100000, depth = 1, want_probs = 0;
+    float learning_rate = LEARNING_RATE;
+
+    for (int j = 1; j < argc; j++) {
+        int moreargs = j+1 < argc;
+        if (!strcmp(argv[j],"--log") && moreargs) {
+            log_path = argv[++j];
+        } else if (!strcmp(argv[j],"--log-no-checksum")) {
+            log_flags &= ~GAMELOG_FLAG_CHECKSUM;
+        } else if (!strcmp(argv[j],"--dump-log") && moreargs) {
+            return dump_game_log(argv[++j]);
+        } else if (!strcmp(argv[j],"--train-log") && moreargs) {
+            train_log = argv[++j];
+        } else if (!strcmp(argv[j],"--threads") && moreargs) {
+            threads = atoi(argv[++j]);
+            threads_set = 1;
+        } else if (!strcmp(argv[j],"--batch") && moreargs) {
+            batch = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--epochs") && moreargs) {
+            epochs = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--lr") && moreargs) {
+            learning_rate = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--learn-x")) {
+            learn_x = 1;
+        } else if (!strcmp(argv[j],"--load") && moreargs) {
+            load_path = argv[++j];
+        } else if (!strcmp(argv[j],"--save") && moreargs) {
+            save_path = argv[++j];
+        } else if (!strcmp(argv[j],"--pool") && moreargs) {
+            pool_size = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--actors") && moreargs) {
+            actors = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--publish-every") && moreargs) {
+            publish_every = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--serve") && moreargs) {
+            serve_path = argv[++j];
+        } else if (!strcmp(argv[j],"--batch-window") && moreargs) {
+            batch_window = atol(argv[++j]);
+        } else if (!strcmp(argv[j],"--loadgen") && moreargs) {
+            const char *path = argv[++j];
+            for (j++; j+1 < argc; j += 2) {
+                if (!strcmp(argv[j],"--clients")) clients = atoi(argv[j+1]);
+                else if (!strcmp(argv[j],"--requests")) requests = atoi(argv[j+1]);
+                else if (!strcmp(argv[j],"--depth")) depth = atoi(argv[j+1]);
+                else if (!strcmp(argv[j],"--probs")) want_probs = atoi(argv[j+1]);
+                else break;
+            }
+            srand(time(NULL));
+            return run_loadgen(path, clients, requests, depth, want_probs);
+        } else if (!strcmp(argv[j],"--policy") && moreargs) {
+            policy_path = argv[++j];
+        } else if (!strcmp(argv[j],"--export-policy") && moreargs) {
+            export_path = argv[++j];
+        } else if (!strcmp(argv[j],"--export-policy-c") && moreargs) {
+            export_path = argv[++j];
+            export_c = 1;
+        } else if (!strcmp(argv[j],"--policy-probs")) {
+            export_probs = 1;
+        } else if (!strcmp(argv[j],"--tournament") && moreargs) {
+            tournament_games = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--qtable") && moreargs) {
+            qtable_path = argv[++j];
+        } else if (!strcmp(argv[j],"--model") && moreargs) {
+            if (num_models < MAX_AGENTS-4) model_paths[num_models++] = argv[j+1];
+            j++;
+        } else if (!strcmp(argv[j],"--epsilon") && moreargs) {
+            epsilon = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--pbt") && moreargs) {
+            population = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--pbt-interval") && moreargs) {
+            pbt_interval = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--es") && moreargs) {
+            es_generations = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--es-pop") && moreargs) {
+            es_pop = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--es-games") && moreargs) {
+            es_games = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--es-sigma") && moreargs) {
+            es_sigma = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--es-lr") && moreargs) {
+            es_lr = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--es-listen") && moreargs) {
+            es_listen = argv[++j];
+        } else if (!strcmp(argv[j],"--es-worker") && moreargs) {
+            char *path = argv[++j];
+            if (!threads_set) threads = sysconf(_SC_NPROCESSORS_ONLN);
+            init_solver();
+            if (es_worker(path, threads) == -1) {
+                perror("ES worker");
+                return 1;
+            }
+            return 0;
+        } else if (!strcmp(argv[j],"--ps") && moreargs) {
+            ps_addr = argv[++j];
+        } else if (!strcmp(argv[j],"--ps-batch") && moreargs) {
+            ps_batch = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--ps-staleness") && moreargs) {
+            ps_staleness = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--ps-lr") && moreargs) {
+            ps_lr = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--ps-traj")) {
+            ps_traj = 1;
+        } else if (!strcmp(argv[j],"--ps-workers") && moreargs) {
+            ps_spawn = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--ps-worker") && moreargs) {
+            char *addr = argv[++j];
+            if (ps_worker(addr) == -1) {
+                perror(addr);
+                return 1;
+            }
+            return 0;
+        } else if (!strcmp(argv[j],"--hidden") && moreargs) {
+            hidden = argv[++j];
+        } else if (!strcmp(argv[j],"--env") && moreargs) {
+            env_name = argv[++j];
+        } else if (!strcmp(argv[j],"--mlp-bench")) {
+            mlp_bench_set = 1;
+        } else if (!strcmp(argv[j],"--td") && moreargs) {
+            td_lambda = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--symmetry")) {
+            learn_symmetries = 1;
+        } else if (!strcmp(argv[j],"--metrics") && moreargs) {
+            metrics_path = argv[++j];
+        } else if (!strcmp(argv[j],"--metrics-interval") && moreargs) {
+            metrics_interval = atol(argv[++j]);
+        } else if (!strcmp(argv[j],"--checkpoint") && moreargs) {
+            checkpoint_path = argv[++j];
+        } else if (!strcmp(argv[j],"--checkpoint-every") && moreargs) {
+            checkpoint_every = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--prune") && moreargs) {
+            prune_freq = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--prune-weights") && moreargs) {
+            prune_weight_min = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--optimizer") && moreargs) {
+            optimizer_name = argv[++j];
+        } else if (!strcmp(argv[j],"--opt-lr") && moreargs) {
+            optimizer_lr = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--eval") && moreargs) {
+            eval_opponent = argv[++j];
+        } else if (!strcmp(argv[j],"--eval-every") && moreargs) {
+            eval_every = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--eval-games") && moreargs) {
+            eval_games = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--eval-target") && moreargs) {
+            eval_target = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--eval-patience") && moreargs) {
+            eval_patience = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--curriculum")) {
+            curriculum = 1;
+        } else if (!strcmp(argv[j],"--curriculum-epsilon") && moreargs) {
+            curriculum_epsilon = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--snapshot-every") && moreargs) {
+            snapshot_every = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--check-softmax")) {
+            return check_softmax();
+        } else if (!strcmp(argv[j],"--ponder")) {
+            ponder = 1;
+        } else if (!strcmp(argv[j],"--no-play")) {
+            interactive = 0;
+        } else if (argv[j][0] != '-') {
+            random_games = atoi(argv[j]);
+            random_games_set = 1;
+        } else {
+            fprintf(stderr,
+                "Usage: %s [games] [--log file] [--log-no-checksum]\n"
+                "       [--dump-log file] [--load file] [--save file]\n"
+                "       [--train-log file [--threads n] [--batch n]\n"
+                "                         [--epochs n] [--lr rate] [--learn-x]]\n"
+                "       [--pool n] [--actors n [--publish-every n]]\n"
+                "       [--serve socket [--batch-window us]]\n"
+                "       [--loadgen socket [--clients n] [--requests n]\n"
+                "                         [--depth n] [--probs 0|1]]\n"
+                "       [--policy file] [--export-policy file]\n"
+                "       [--export-policy-c file] [--policy-probs]\n"
+                "       [--tournament games [--qtable file] [--model file]...\n"
+                "                           [--epsilon p] [--threads n]]\n"
+                "       [--pbt networks [--pbt-interval games] [--threads n]]\n"
+                "       [--es generations [--es-pop n] [--es-games n]\n"
+                "        [--es-sigma s] [--es-lr lr] [--es-listen path]]\n"
+                "       [--threads n] --es-worker path\n"
+                "       [--ps addr [--ps-workers n] [--ps-batch games]\n"
+                "        [--ps-staleness versions] [--ps-traj] [--ps-lr lr]]\n"
+                "       --ps-worker addr\n"
+                "       [games] --hidden units[,units...] [--mlp-bench]\n"
+                "       [games] --env tictactoe|connect4 [--hidden units,...]\n"
+                "       [--td lambda] [--symmetry] [--ponder] [--no-play]\n"
+                "       [--metrics file [--metrics-interval ms]]\n"
+                "       [--checkpoint file [--checkpoint-every games]]\n"
+                "       [--prune min_freq [--prune-weights min]]\n"
+                "       [--optimizer sgd|momentum|adam [--opt-lr rate]]\n"
+                "       [--eval random|perfect [--eval-every games]\n"
+                "        [--eval-games n] [--eval-target rate]\n"
+                "        [--eval-patience n] [--threads n]]\n"
+                "       [--curriculum [--curriculum-epsilon p]\n"
+                "                     [--snapshot-every games]]\n"
+                "       --check-softmax\n", argv[0]);
+            return 1;
+        }
+    }
+    srand(time(NULL));
+
+    /* --hidden and --env train an Mlp, which the options below reading or
+     * writing the fixed network and its games don't handle. */
+    if ((hidden || env_name) &&
+        (log_path || load_path || save_path || train_log || checkpoint_path ||
+         policy_path || export_path || serve_path))
+    {
+        fprintf(stderr, "--hidden and --env can't be used with --log, --load, "
+                "--save, --train-log, --checkpoint, --policy, --export-policy "
+                "or --serve\n");
+        return 1;
+    }
+
+    /* The curriculum is a mode of the single threaded trainer: the
+     * other training modes below would take over and ignore it. */
+    if (curriculum && (ps_addr || population > 0 || actors > 0 || pool_size > 0)) {
+        fprintf(stderr, "--curriculum can't be used with --ps, --pbt, "
+                "--actors or --pool\n");
+        return 1;
+    }
+
+    // Train on another game.
+    if (env_name)
+        return train_env(env_name, hidden ? hidden : "100", random_games) == -1;
+
+    // Train a network with a custom shape instead of the fixed one.
+    if (hidden) {
+        if (!threads_set) threads = sysconf(_SC_NPROCESSORS_ONLN);
+        return train_mlp(hidden, random_games, mlp_bench_set,
+                         tournament_games, threads, epsilon) == -1;
+    }
+
+    if (log_path) {
+        game_log = gamelog_create(log_path, log_flags);
+        if (game_log == NULL) {
+            perror(log_path);
+            return 1;
+        }
+    }
+
+    // Initialize neural network.
+    NeuralNetwork nn;
+    init_neural_network(&nn);
+    if (load_path && load_neural_network(&nn, load_path) == -1) {
+        perror(load_path);
+        return 1;
+    }
+    if (optimizer_name) {
+        optimizer = optimizer_create(optimizer_name, &nn);
+        if (optimizer == NULL) {
+            fprintf(stderr, "Unknown optimizer %s\n", optimizer_name);
+            return 1;
+        }
+        if (optimizer_lr > 0) optimizer->learning_rate = optimizer_lr;
+    }
+
+    // Use a precomputed policy table, loaded or built in, for playing.
+    if (policy_path && load_policy_table(policy_path) == -1) {
+        perror(policy_path);
+        return 1;
+    }
+#ifdef POLICY_BUILTIN
+    /* The built-in table is the answer of the network it was exported
+     * from: only use it when this run doesn't load or train a network,
+     * or it would answer for a stale one. */
+    int trains = random_games_set || train_log || es_generations > 0 ||
+                 ps_addr || population > 0 || actors > 0 || pool_size > 0 ||
+                 curriculum;
+    if (!policy_path && !load_path && !trains) {
+        policy_moves = policy_builtin_moves;
+#ifdef POLICY_BUILTIN_PROBS
+        policy_probs = policy_builtin_probs;
+#endif
+    }
+#endif
+
+    /* When a model or policy is loaded or trained from a log, don't train
+     * against random games unless explicitly requested. */
+    if ((load_path || train_log || policy_moves || es_generations) &&
+        !random_games_set)
+        random_games = 0;
+
+    // Train from recorded games.
+    if (train_log && train_from_log(&nn, train_log, threads, batch, epochs,
+                                    learning_rate, !learn_x) == -1)
+    {
+        perror(train_log);
+        return 1;
+    }
+
+    // Train with evolution strategies.
+    if (es_generations > 0) {
+        if (!threads_set) threads = sysconf(_SC_NPROCESSORS_ONLN);
+        train_evolution(&nn, es_generations, es_pop, es_games, es_sigma,
+                        es_lr, threads, es_listen);
+    }
+
+    // Train against random moves.
+    if (metrics_path) metrics_start(metrics_path, metrics_interval);
+    if (checkpoint_path) {
+        if (checkpoint_every < 1) checkpoint_every = 1;
+        checkpointer = checkpoint_neural_network(checkpoint_path);
+        if (checkpointer == NULL) {
+            perror(checkpoint_path);
+            return 1;
+        }
+    }
+    if (eval_opponent && random_games > 0) {
+        /* The trainer keeps one core, the evaluation gets the others. */
+        if (!threads_set) threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        if (eval_every < 1) eval_every = 1;
+        evaluator = evaluator_create(eval_opponent, eval_games, eval_target,
+                                     eval_patience, threads);
+        if (evaluator == NULL) {
+            fprintf(stderr, "Unknown opponent %s\n", eval_opponent);
+            return 1;
+        }
+    }
+    if (random_games > 0) {
+        if (ps_addr) {
+            if (train_param_server(&nn, ps_addr, random_games, ps_batch,
+                                   ps_staleness, ps_traj, ps_lr, ps_spawn) == -1)
+            {
+                perror(ps_addr);
+                return 1;
+            }
+        } else if (population > 0) {
+            if (!threads_set) threads = sysconf(_SC_NPROCESSORS_ONLN);
+            train_population(&nn, population, random_games, pbt_interval, threads);
+        } else if (actors > 0)
+            train_actor_learner(&nn, random_games, actors, publish_every);
+        else if (pool_size > 0)
+            train_against_random_pool(&nn, random_games, pool_size);
+        else if (curriculum)
+            train_curriculum(&nn, random_games, snapshot_every,
+                             curriculum_epsilon);
+        else
+            train_against_random(&nn, random_games);
+    }
+    if (evaluator) evaluator_finish(evaluator, &nn, random_games);
+    if (metrics_path) metrics_stop();
+    if (checkpointer && checkpoint_close(checkpointer) == -1) {
+        perror(checkpoint_path);
+        return 1;
+    }
+    if (game_log) gamelog_flush(game_log);
+
+    if (save_path && save_neural_network(&nn, save_path) == -1) {
+        perror(save_path);
+        return 1;
+    }
+
+    if (export_path && export_policy(&nn, export_path, export_c, export_probs) == -1) {
+        perror(export_path);
+        return 1;
+    }
+
+    // Measure the strength of the network against the other agents.
+    if (tournament_games > 0) {
+        Agent agents[MAX_AGENTS];
+        int num_agents = 0;
+        memset(agents, 0, sizeof(agents));
+        strcpy(agents[num_agents].name, "random");
+        agents[num_agents++].type = AGENT_RANDOM;
+        strcpy(agents[num_agents].name, "perfect");
+        agents[num_agents++].type = AGENT_PERFECT;
+        strcpy(agents[num_agents].name, "nn");
+        agents[num_agents].type = AGENT_NN;
+        agents[num_agents++].nn = &nn;
+        if (qtable_path) {
+            agents[num_agents].qtable = load_qtable(qtable_path);
+            if (agents[num_agents].qtable == NULL) {
+                perror(qtable_path);
+                return 1;
+            }
+            strcpy(agents[num_agents].name, "qtable");
+            agents[num_agents++].type = AGENT_QTABLE;
+        }
+        for (int m = 0; m < num_models; m++) {
+            Agent *a = &agents[num_agents++];
+            const char *base = strrchr(model_paths[m], '/');
+            a->type = AGENT_NN;
+            a->nn = malloc(sizeof(NeuralNetwork));
+            snprintf(a->name, sizeof(a->name), "%s", base ? base+1 : model_paths[m]);
+            if (load_neural_network(a->nn, model_paths[m]) == -1) {
+                perror(model_paths[m]);
+                return 1;
+            }
+        }
+        if (!threads_set) threads = sysconf(_SC_NPROCESSORS_ONLN);
+        run_tournament(agents, num_agents, tournament_games, threads, epsilon);
+        return 0;
+    }
+
+    // Remove the units that are (almost) never active, for serving.
+    CompactNetwork *compact = NULL;
+    if (prune_freq >= 0) compact = prune_network(&nn, prune_freq, prune_weight_min);
+
+    // Serve moves instead of playing with the human.
+    if (serve_path && serve_moves(&nn, compact, serve_path, batch_window) == -1) {
+        perror(serve_path);
+        return 1;
+    }
+
+    // Play game with human and learn more.
+    while(interactive) {
+        char play_again;
+        play_game(&nn, ponder);
+
+        printf("Play again? (y/n): ");
+        scanf(" %c", &play_again);
+        if (play_again != 'y' && play_again != 'Y') break;
+    }
+    if (game_log && gamelog_close(game_log) == -1) perror(log_path);
+    return 0;
+}
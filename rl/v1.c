@@ -2,113 +2,183 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include "gamelog.h"
+#include "env.h"
+#include "checkpoint.h"
 
-// the board- array of 9 integers
-#define EMPTY 0
-#define PLAYER_X 1
-#define PLAYER_O 2
+// the game being played- tic-tac-toe unless --env picks another one (see env.h)
+const GameEnv *env = &tictactoe_env;
 
 // the game board- stores the current snapshot of the board
-int board[9]; 
+// (bitboards plus the number of moves played, see env.h)
+EnvState state;
 
 // the q-table- stores learned move values
 // 3 choices of move (empty, X, O) * 9 cells = 3^9 possible states = 19683
+// indexed by env->key(), which for tic-tac-toe is exactly that base 3 number
 float qtable[19683][9];
 
+// with --int16 the q values live here instead, as fixed point numbers
+// (Q16_ONE is 1.0) in rows padded to 16 values: each state is one aligned
+// 32 byte block, half a cache line, read with two 16 byte vector loads.
+// finding the best legal move is then a few vector ops (see q16_argmax)
+// instead of a loop over 9 floats that often straddles two cache lines.
+// tic-tac-toe only, like the saved q-tables
+#define Q16_ONE 8192
+_Alignas(32) int16_t qtable16[19683][16];
+int use_int16 = 0;
+
+// bigger games don't fit a dense table (connect four has ~4*10^12 positions)
+// so their q values go in a fixed size hash table- open addressing, and when
+// the probes run out the new state simply evicts the old one
+#define QHASH_BITS 20
+#define QHASH_PROBES 8
+uint64_t *qhash_keys = NULL;    // key+1 per slot, 0 = empty
+float *qhash_values = NULL;     // env->num_actions per slot
+long qhash_used = 0, qhash_evictions = 0;
+
+// optional game log- when set, every training game is appended to it (see gamelog.h)
+GameLogWriter *game_log = NULL;
+
+// optional checkpoints- when set, the q-table is snapshotted every
+// checkpoint_every games and written by a background thread (see checkpoint.h)
+Checkpointer *checkpointer = NULL;
+int checkpoint_every = 50000;
+
 // helpers
-// clears the board to empty- every new game starts clean
-void reset_board() {
-    for (int i = 0; i < 9; i++) {
-        board[i] = EMPTY;
+// the q values of a state, one per action
+// with create = 0 a state never seen returns NULL (all its q values are 0)
+float *q_row(uint64_t key, int create) {
+    if (env == &tictactoe_env) return qtable[key];
+
+    int n = env->num_actions;
+    size_t home = (key * 0x9e3779b97f4a7c15ULL) >> (64 - QHASH_BITS);
+    for (size_t p = 0; p < QHASH_PROBES; p++) {
+        size_t i = (home + p) & ((1 << QHASH_BITS) - 1);
+        if (qhash_keys[i] == key + 1) return qhash_values + i * n;
+        if (qhash_keys[i] == 0) {
+            if (!create) return NULL;
+            qhash_keys[i] = key + 1;
+            qhash_used++;
+            return memset(qhash_values + i * n, 0, sizeof(float) * n);
+        }
     }
+    if (!create) return NULL;
+    qhash_keys[home] = key + 1;
+    qhash_evictions++;
+    return memset(qhash_values + home * n, 0, sizeof(float) * n);
 }
 
-// display the current board (for debugging + playing)
-void print_board() {
-    for (int i = 0; i < 9; i++) {
-        if (board[i] == PLAYER_X) printf("X");
-        else if (board[i] == PLAYER_O) printf("0");
-        else printf(".");
+// fixed point q-table kernels
+// a row is two vectors of 8 lanes, which plain SSE2 handles well
+typedef int16_t q16x8 __attribute__((vector_size(16), may_alias));
 
-        // agent scans left to right, until they run out of rows
-        // then drops to the next row
-        if (i % 3 == 2) printf("\n"); // new row
-        else printf("|");
-    }
+// bit i in lane i
+static const q16x8 q16_bit = {1, 2, 4, 8, 16, 32, 64, 128};
+
+// lane i all ones if bit i of 'legal' is set
+static inline q16x8 q16_legal_mask(unsigned legal) {
+    return ((int16_t)legal & q16_bit) != 0;
 }
 
-// pick a random empty spot on the board
-int random_move() {
-    int moves[9];
-    int count = 0;
-    for (int i = 0; i < 9; i++) {
-        if (board[i] == EMPTY) moves[count++] = i;
-    }
-    if (count == 0) return -1;
-    return moves[rand() % count];
+static inline q16x8 q16_max(q16x8 a, q16x8 b) {
+    q16x8 gt = a > b;
+    return (a & gt) | (b & ~gt);
 }
 
-// hash the whole board for storing as a vector in the q table as one q value
-int board_hash(int *b) {
-    int h = 0;
-    for (int i = 0; i < 9; i ++) {
-        h = h * 3 + b[i];
-    }
-    return h;
+// lane i swapped with lane i^4, i^2 and i^1- after the 3 steps every lane
+// has seen all the others
+static const q16x8 q16_swap[3] = {
+    {4, 5, 6, 7, 0, 1, 2, 3}, {2, 3, 0, 1, 6, 7, 4, 5}, {1, 0, 3, 2, 5, 4, 7, 6}
+};
+
+// max of all the lanes, in every lane
+static inline q16x8 q16_hmax(q16x8 v) {
+    for (int r = 0; r < 3; r++) v = q16_max(v, __builtin_shuffle(v, q16_swap[r]));
+    return v;
 }
 
-// places a move on the board
-void make_move(int pos, int player) {
-    board[pos] = player;
+// the two halves of row 'q' with the illegal moves set to the smallest
+// value, and their lanes of the legal moves
+static inline void q16_load(const int16_t *q, uint64_t legal,
+                            q16x8 *lo, q16x8 *hi, q16x8 *mask_lo, q16x8 *mask_hi)
+{
+    const q16x8 *row = __builtin_assume_aligned(q, 32);
+    *mask_lo = q16_legal_mask(legal & 0xff);
+    *mask_hi = q16_legal_mask((legal >> 8) & 0xff);
+    *lo = (row[0] & *mask_lo) | (INT16_MIN & ~*mask_lo);
+    *hi = (row[1] & *mask_hi) | (INT16_MIN & ~*mask_hi);
 }
 
-// checks if a player has 3 in a row
-int is_winner(int player) {
-    // rows 
-    if (board[0] == player && board[1] == player && board[2] == player) return 1;
-    if (board[3] == player && board[4] == player && board[5] == player) return 1;
-    if (board[6] == player && board[7] == player && board[8] == player) return 1;
-    
-    // columns
-    if (board[0] == player && board[3] == player && board[6] == player) return 1;
-    if (board[1] == player && board[4] == player && board[7] == player) return 1;
-    if (board[2] == player && board[5] == player && board[8] == player) return 1;
-    
-    // diagonals
-    if (board[0] == player && board[4] == player && board[8] == player) return 1;
-    if (board[2] == player && board[4] == player && board[6] == player) return 1;
-    return 0;
+// best q value among the legal moves (INT16_MIN if there is none)
+static inline int q16_max_legal(const int16_t *q, uint64_t legal) {
+    q16x8 lo, hi, mask_lo, mask_hi;
+    q16_load(q, legal, &lo, &hi, &mask_lo, &mask_hi);
+    return q16_hmax(q16_max(lo, hi))[0];
 }
 
-// check if the board is full, but no one won
-int is_draw() {
-    // scan all 9 cells
-    for (int i = 0; i < 9; i++) {
-        // if any are empty, no draw yet -> return 0
-        if (board[i] == EMPTY) return 0; // still moves left
-    }
-    // if none are empty, return 1 for draw
-    return 1;
+// the legal move with the best q value, the lowest one between equals
+// like the float loop, or -1 if there is no legal move
+static inline int q16_argmax(const int16_t *q, uint64_t legal) {
+    if (!legal) return -1;
+    q16x8 lo, hi, mask_lo, mask_hi;
+    q16_load(q, legal, &lo, &hi, &mask_lo, &mask_hi);
+    q16x8 best = q16_hmax(q16_max(lo, hi));
+
+    // a bit per lane holding the max, the upper half in the upper bits,
+    // or-ed together
+    q16x8 bits = ((lo == best) & mask_lo & q16_bit) |
+                 (((hi == best) & mask_hi & q16_bit) << 8);
+    for (int r = 0; r < 3; r++) bits |= __builtin_shuffle(bits, q16_swap[r]);
+    return __builtin_ctz((uint16_t)bits[0]);
+}
+
+// float q-table <-> fixed point one, for saving and loading
+void q16_to_float(void) {
+    for (int s = 0; s < 19683; s++)
+        for (int i = 0; i < 9; i++) qtable[s][i] = (float)qtable16[s][i] / Q16_ONE;
+}
+
+// rounded to nearest, saturated
+static inline int16_t q16_from(float q) {
+    float v = q * Q16_ONE + (q < 0 ? -0.5f : 0.5f);
+    return v >= 32767 ? 32767 : (v <= -32767 ? -32767 : (int16_t)v);
+}
+
+void q16_from_float(void) {
+    memset(qtable16, 0, sizeof(qtable16));
+    for (int s = 0; s < 19683; s++)
+        for (int i = 0; i < 9; i++) qtable16[s][i] = q16_from(qtable[s][i]);
+}
+
+// pick a random legal move
+int random_move() {
+    return env_random_move(env, &state, rand());
 }
 
 // RL logic
 // ai picks a move
-int select_move(int player) {
+int select_move() {
     if ((rand() % 100) < 20) {
         // 20% chance- random move 
         return random_move();
     }
 
     // 80% chance- pick the best move based on the q table
+    if (use_int16) return q16_argmax(qtable16[env->key(&state)], env->legal(&state));
+
     int best_move = -1;
     float best_q = -1e9; // very small number to start
-    int h = board_hash(board);
-
-    for (int i = 0; i < 9; i++) {
-        if (board[i] == EMPTY) {
-            if (qtable[h][i] > best_q) {
-                best_q = qtable[h][i];
+    float *q = q_row(env->key(&state), 0);
+    uint64_t legal = env->legal(&state);
+
+    for (int i = 0; i < env->num_actions; i++) {
+        if (legal & (1ULL << i)) {
+            float qi = q ? q[i] : 0;
+            if (qi > best_q) {
+                best_q = qi;
                 best_move = i;
             }
         }
@@ -121,16 +191,30 @@ int select_move(int player) {
 
 // learn- reinforce good moves by making q value bigger
 // gamme- balance between immediate reward and future possibilities
-void learn(int old_board[9], int move, int reward) {
-    int old_hash = board_hash(old_board);
-    int new_hash = board_hash(board);
+void learn(uint64_t old_key, int move, int reward) {
+    // learning params
+    float alpha = 0.1; // learning rate
+    float gamma = 0.9; // discount factor
+
+    if (use_int16) {
+        uint64_t legal = env->legal(&state);
+        int max_future_q = legal ? q16_max_legal(qtable16[env->key(&state)], legal) : 0;
+        int16_t q = qtable16[old_key][move];
+        qtable16[old_key][move] = q16_from((q + alpha * (reward * Q16_ONE +
+                                   gamma * max_future_q - q)) / Q16_ONE);
+        if (checkpointer) checkpoint_dirty(checkpointer, old_key * sizeof(qtable16[0]));
+        return;
+    }
 
     // find the best future q value after the move 
     float max_future_q = -1e9;
-    for (int i = 0; i < 9; i++) {
-        if (board[i] == EMPTY) {
-            if (qtable[new_hash][i] > max_future_q) {
-                max_future_q = qtable[new_hash][i];
+    float *future = q_row(env->key(&state), 0);
+    uint64_t legal = env->legal(&state);
+    for (int i = 0; i < env->num_actions; i++) {
+        if (legal & (1ULL << i)) {
+            float qi = future ? future[i] : 0;
+            if (qi > max_future_q) {
+                max_future_q = qi;
             }
         }
     }
@@ -138,92 +222,276 @@ void learn(int old_board[9], int move, int reward) {
     // no moves left
     if (max_future_q == -1e9) max_future_q = 0;
 
-    // learning params
-    float alpha = 0.1; // learning rate
-    float gamma = 0.9; // discount factor
-
     // update the q value
-    qtable[old_hash][move] += alpha * (reward + gamma * max_future_q - qtable[old_hash][move]);
+    float *q = q_row(old_key, 1);
+    q[move] += alpha * (reward + gamma * max_future_q - q[move]);
+    if (checkpointer) checkpoint_dirty(checkpointer, old_key * sizeof(qtable[0]));
 }
 
 // play millions of games to train the model
 void train(int episodes) {
+    long wins_x = 0, wins_o = 0, draws = 0;
+
     for (int episode = 0; episode < episodes; episode++) {
-        reset_board();
-        int current_player = PLAYER_X;
+        env->reset(&state);
 
-        // save board state before making move (required for learning)
-        int old_board[9];
+        // state key before making move (required for learning)
+        uint64_t old_key;
         int move = -1;
 
+        // moves played so far, for the game log (tic-tac-toe only)
+        int history[9];
+        int num_moves = 0;
+        char winner;
+
         while(1) {
-            // copy board to old_board
-            for (int i = 0; i < 9; i++) old_board[i] = board[i];
+            old_key = env->key(&state);
 
             // select move
-            move = select_move(current_player);
-            make_move(move, current_player);
-
-            // check for end of game
-            if (is_winner(current_player)) {
-                learn(old_board, move, +1);
+            move = select_move();
+            env->apply(&state, move);
+            if (num_moves < 9) history[num_moves++] = move;
+
+            // check for end of game- the env only looks at the last move
+            if (env->won(&state)) {
+                learn(old_key, move, +1);
+                winner = (state.ply & 1) ? 'X' : 'O';
                 break;
-            } else if (is_draw()) {
-                learn(old_board, move, 0); // draw reward
+            } else if (state.ply == env->max_moves) {
+                learn(old_key, move, 0); // draw reward
+                winner = 'T';
                 break;
             } else {
-                learn(old_board, move, 0); // normal move, no immediate reward
+                learn(old_key, move, 0); // normal move, no immediate reward
             }
-
-            // swap players
-            current_player = (current_player == PLAYER_X) ? PLAYER_O : PLAYER_X;
         }
+        if (winner == 'X') wins_x++;
+        else if (winner == 'O') wins_o++;
+        else draws++;
+
+        // record the finished game
+        if (game_log && gamelog_append(game_log, history, num_moves, winner) == -1) {
+            perror("writing game log");
+            exit(1);
+        }
+
+        // the copy is all training waits for, the writing happens in background
+        if (checkpointer && (episode + 1) % checkpoint_every == 0)
+            checkpoint_take(checkpointer, use_int16 ? (void *)qtable16 : (void *)qtable);
     }
+
+    printf("trained %s on %d games: X won %.1f%%, O won %.1f%%, draws %.1f%%\n",
+           env->name, episodes, wins_x * 100.0 / episodes,
+           wins_o * 100.0 / episodes, draws * 100.0 / episodes);
+    if (qhash_keys)
+        printf("q hash table: %ld of %d states used, %ld evictions\n",
+               qhash_used, 1 << QHASH_BITS, qhash_evictions);
 }
 
 // human vs trained ai
 void play() {
-    reset_board();
-    int current_player = PLAYER_X; // human = X, ai = O
+    env->reset(&state);
+    int human_turn = 1; // human = X, ai = O
 
     while (1) {
-        print_board();
-
-        if (current_player == PLAYER_X) {
-            int move;
-            printf("Enter your move (0-8): ");
-            scanf("%d", &move);
-            if (move < 0 || move > 8 || board[move] != EMPTY) {
+        int move;
+        env->print(&state);
+
+        if (human_turn) {
+            printf("Enter your move (0-%d): ", env->num_actions - 1);
+            if (scanf("%d", &move) != 1) return;
+            if (move < 0 || move >= env->num_actions ||
+                !(env->legal(&state) & (1ULL << move))) {
                 printf("Invalid move. Try again.\n");
                 continue;
             }
-            make_move(move, PLAYER_X);
         } else {
-            int move = select_move(PLAYER_O);
+            move = select_move();
             printf("AI plays at %d\n", move);
-            make_move(move, PLAYER_O);
         }
+        env->apply(&state, move);
 
-        if (is_winner(current_player)) {
-            print_board();
-            if (current_player == PLAYER_X) printf("You win!\n");
+        if (env->won(&state)) {
+            env->print(&state);
+            if (human_turn) printf("You win!\n");
             else printf("AI wins!\n");
             break;
-        } else if (is_draw()) {
-            print_board();
+        } else if (state.ply == env->max_moves) {
+            env->print(&state);
             printf("It's a draw!\n");
             break;
         }
 
         // switch player
-        current_player = (current_player == PLAYER_X) ? PLAYER_O : PLAYER_X;
+        human_turn = !human_turn;
     }
 }
 
+// save the q-table: 8 bytes magic, then the raw floats
+// the layout (and board_hash) is what template.c --qtable expects for its tournament
+// so a fixed point q-table is saved as floats too
+int save_qtable(const char *path) {
+    if (use_int16) q16_to_float();
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return -1;
+    int ok = fwrite("TTTQT001", 8, 1, fp) == 1 &&
+             fwrite(qtable, sizeof(qtable), 1, fp) == 1;
+    if (fclose(fp) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+// load a q-table written by save_qtable() or a checkpoint of one
+// checkpoints taken with --int16 have the fixed point rows instead
+int load_qtable(const char *path) {
+    FILE *fp = checkpoint_fopen(path);
+    if (fp == NULL) return -1;
+    char magic[8];
+    int ok = fread(magic, 8, 1, fp) == 1, fixed = 0;
+    if (ok && memcmp(magic, "TTTQT001", 8) == 0) {
+        ok = fread(qtable, sizeof(qtable), 1, fp) == 1;
+    } else if (ok && memcmp(magic, "TTTQI016", 8) == 0) {
+        ok = fread(qtable16, sizeof(qtable16), 1, fp) == 1;
+        fixed = 1;
+    } else {
+        ok = 0;
+    }
+    fclose(fp);
+    if (!ok) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fixed && !use_int16) q16_to_float();
+    if (!fixed && use_int16) q16_from_float();
+    return 0;
+}
+
+// --check-q16: q16_argmax() and q16_max_legal() against the plain loop over
+// the row, on random rows and legal moves. values are drawn from a few
+// numbers so that ties are common, with an INT16_MIN now and then (the
+// value the kernels give illegal moves), and some of the move sets are empty
+int check_q16(void) {
+    const int cases = 1000000;
+    _Alignas(32) int16_t q[16];
+    int failed = 0;
+
+    for (int c = 0; c < cases; c++) {
+        for (int i = 0; i < 16; i++)
+            q[i] = rand() % 50 == 0 ? INT16_MIN : (rand() % 7 - 3) * (rand() % 2 ? 1 : 9000);
+        // mostly tic-tac-toe's 9 moves, but the kernels take up to 16
+        uint64_t legal = c % 64 == 0 ? 0 : rand() & (c % 2 ? 0x1ff : 0xffff);
+
+        int best = -1;
+        for (int i = 0; i < 16; i++)
+            if ((legal >> i) & 1 && (best == -1 || q[i] > q[best])) best = i;
+        int best_q = best == -1 ? INT16_MIN : q[best];
+
+        int argmax = q16_argmax(q, legal);
+        int max_q = q16_max_legal(q, legal);
+        if (argmax != best || max_q != best_q) {
+            if (failed < 10)
+                fprintf(stderr, "legal %03llx: argmax %d max %d, expected %d %d\n",
+                        (unsigned long long)legal, argmax, max_q, best, best_q);
+            failed++;
+        }
+    }
+    printf("q16 kernels: %d of %d cases differ from the scalar loop\n", failed, cases);
+    return failed != 0;
+}
+
 // initialize the game
-int main() {
+// usage: ./v1 [game_log] [--save qtable_file] [--load qtable_file]
+//             [--checkpoint file [--checkpoint-every games]]
+//             [--env tictactoe|connect4] [--int16]
+//        ./v1 --check-q16
+// - if a log path is given, the training games are logged there
+// - with --save, the trained q-table is written to qtable_file
+// - with --load, training continues from a saved q-table or a checkpoint
+// - with --checkpoint, the q-table is checkpointed to file while training
+// - --env picks the game, logs and saved q-tables are for tic-tac-toe only
+// - --int16 keeps the q values in the fixed point table (tic-tac-toe only)
+// - --check-q16 checks the fixed point kernels against the scalar loop and exits
+int main(int argc, char **argv) {
+    const char *save_path = NULL;
+    const char *load_path = NULL;
+    const char *log_path = NULL;
+    const char *checkpoint_path = NULL;
     srand(time(NULL));  // init rng
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            load_path = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint_path = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            checkpoint_every = atoi(argv[++i]);
+            if (checkpoint_every < 1) checkpoint_every = 1;
+        } else if (strcmp(argv[i], "--int16") == 0) {
+            use_int16 = 1;
+        } else if (strcmp(argv[i], "--check-q16") == 0) {
+            return check_q16();
+        } else if (strcmp(argv[i], "--env") == 0 && i + 1 < argc) {
+            env = env_by_name(argv[++i]);
+            if (env == NULL) {
+                fprintf(stderr, "unknown game %s\n", argv[i]);
+                return 1;
+            }
+        } else if (argv[i][0] == '-') {
+            // a typo shouldn't become the name of a new log file
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        } else {
+            log_path = argv[i];
+        }
+    }
+    if (env != &tictactoe_env) {
+        if (log_path || save_path || load_path || checkpoint_path || use_int16) {
+            fprintf(stderr, "game logs and q-tables (also --int16) are for tic-tac-toe only\n");
+            return 1;
+        }
+        qhash_keys = calloc(1 << QHASH_BITS, sizeof(uint64_t));
+        qhash_values = malloc(sizeof(float) * env->num_actions << QHASH_BITS);
+        if (qhash_keys == NULL || qhash_values == NULL) {
+            fprintf(stderr, "out of memory for the q-table\n");
+            return 1;
+        }
+    }
+    if (log_path) {
+        game_log = gamelog_create(log_path, GAMELOG_FLAG_CHECKSUM);
+        if (game_log == NULL) {
+            perror(log_path);
+            return 1;
+        }
+    }
+
+    if (load_path && load_qtable(load_path) == -1) {
+        perror(load_path);
+        return 1;
+    }
+    if (checkpoint_path) {
+        // only the rows of the states played change, so copy just those
+        if (use_int16)
+            checkpointer = checkpoint_create(checkpoint_path, "TTTQI016", 8, sizeof(qtable16));
+        else
+            checkpointer = checkpoint_create(checkpoint_path, "TTTQT001", 8, sizeof(qtable));
+        size_t row = use_int16 ? sizeof(qtable16[0]) : sizeof(qtable[0]);
+        if (checkpointer == NULL || checkpoint_track(checkpointer, row) == -1) {
+            perror(checkpoint_path);
+            return 1;
+        }
+    }
+
     train(500000);      // train ai
+    if (game_log) gamelog_close(game_log); // flush before the interactive part
+    if (checkpointer && checkpoint_close(checkpointer) == -1) {
+        perror(checkpoint_path);
+        return 1;
+    }
+    if (save_path && save_qtable(save_path) == -1) {
+        perror(save_path);
+        return 1;
+    }
     play();             // play against ai
     return 0;
-}
\ No newline at end of file
+}